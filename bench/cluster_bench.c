@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "protocol.h"
+#include "zclient.h"
+
+/*
+ * Donation throughput against a server or a ZotDonate_proxy. CONNS
+ * connections each keep WINDOW DONATEs in flight, spread over the five
+ * charities, for SECS seconds; reports completed donations per second, the
+ * 50th/99th percentile of submit-to-reply time in microseconds and how many
+ * came back as ERROR.
+ *
+ * With -r, READERS more connections (to READER_PORT, the same port by
+ * default) keep WINDOW CINFO_ALL dashboard reads in flight at the same time,
+ * to see what observers cost donors (qos.h).
+ */
+
+#define USAGE_MSG "cluster_bench [-h] [-c CONNS] [-w WINDOW] [-d SECS] [-r READERS [-R READER_PORT]] HOST PORT_NUMBER\n"
+#define MAX_SAMPLES (1 << 22)  // latencies kept, later replies only count
+
+static uint64_t done, failed;
+static uint64_t reads, reads_failed;
+static uint64_t* samples;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+// arg is the submit time
+static void on_reply(const zc_reply_t* r, void* arg) {
+    if (r->status != ZC_OK || r->msg.msgtype == ERROR) {
+        failed++;
+        return;
+    }
+    if (done < MAX_SAMPLES) {
+        samples[done] = now_ns() - (uint64_t) (uintptr_t) arg;
+    }
+    done++;
+}
+
+static void on_read(const zc_reply_t* r, void* arg) {
+    if (r->status != ZC_OK || r->msg.msgtype == ERROR) {
+        reads_failed++;
+    } else {
+        reads++;
+    }
+}
+
+// Keep every connection of the pool at window requests in flight
+static void fill(zc_pool_t* pool, int window, message_t* req, uint64_t* sent, zc_done_fn done_fn) {
+    for (int i = 0; i < pool->size; i++) {
+        zc_conn_t* c = pool->conns[i];
+        while (c && !c->broken && zc_inflight(c) < window) {
+            req->msgdata.donation.charity = (*sent)++ % 5;
+            zc_submit(c, req, done_fn, (void*) (uintptr_t) now_ns());
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    int conns = 8, window = 64, secs = 5;
+    int readers = 0, reader_port = 0;
+    while ((opt = getopt(argc, argv, "hc:w:d:r:R:")) != -1) {
+        switch (opt) {
+            case 'h':
+                fprintf(stderr, USAGE_MSG);
+                exit(EXIT_SUCCESS);
+            case 'c':
+                conns = atoi(optarg);
+                break;
+            case 'w':
+                window = atoi(optarg);
+                break;
+            case 'd':
+                secs = atoi(optarg);
+                break;
+            case 'r':
+                readers = atoi(optarg);
+                break;
+            case 'R':
+                reader_port = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, USAGE_MSG);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind != 2 || conns < 1 || window < 1 || window > ZC_MAX_INFLIGHT || secs < 1 || readers < 0) {
+        fprintf(stderr, USAGE_MSG);
+        exit(EXIT_FAILURE);
+    }
+    samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+    if (samples == NULL) {
+        printf("alloc err\n");
+        exit(EXIT_FAILURE);
+    }
+    zc_pool_t* pool = zc_pool_open(argv[optind], atoi(argv[optind + 1]), conns, 0);
+    if (pool == NULL) {
+        printf("connect err\n");
+        exit(EXIT_FAILURE);
+    }
+
+    zc_pool_t* observers = NULL;
+    if (readers) {
+        observers = zc_pool_open(argv[optind], reader_port ? reader_port : atoi(argv[optind + 1]), readers, 0);
+        if (observers == NULL) {
+            printf("connect err\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    message_t req = {0};
+    req.msgtype = DONATE;
+    req.msgdata.donation.amount = 1;
+    message_t read_req = {0};
+    read_req.msgtype = CINFO_ALL;
+    uint64_t sent = 0, read_sent = 0;
+    uint64_t start = now_ns(), end = start + secs * 1000000000ull;
+    while (now_ns() < end) {
+        fill(pool, window, &req, &sent, on_reply);
+        if (observers) {
+            fill(observers, window, &read_req, &read_sent, on_read);
+            zc_pool_poll(observers, 0);
+        }
+        zc_pool_poll(pool, observers ? 1 : 10);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    zc_pool_drain(pool);
+    zc_pool_close(pool);
+    if (observers) {
+        zc_pool_drain(observers);
+        zc_pool_close(observers);
+    }
+    uint64_t kept = done < MAX_SAMPLES ? done : MAX_SAMPLES;
+    qsort(samples, kept, sizeof(uint64_t), cmp_u64);
+    double p50 = kept ? samples[kept / 2] / 1000.0 : 0, p99 = kept ? samples[(uint64_t) (kept * 0.99)] / 1000.0 : 0;
+    printf("%12.0f donations/s  p50 %8.1f us  p99 %8.1f us  (%llu errors)\n", done / elapsed, p50, p99, (unsigned long long) failed);
+    if (observers) {
+        printf("%12.0f reads/s  (%llu errors)\n", reads / elapsed, (unsigned long long) reads_failed);
+    }
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,36 @@
+#!/bin/bash
+# Throughput of a partitioned cluster (include/part.h) for each partition
+# count given, default 1 2 3 5: starts N MT servers with -P i/N and a proxy
+# on local ports, runs bin/cluster_bench against the proxy and stops them.
+# Build first with: make && make bench
+#   bench/cluster_bench.sh [N...]
+# Environment: BASE_PORT (default 9100), THREADS per partition (default 2),
+# WORKERS of the proxy (default 2), CONNS, WINDOW, SECS for cluster_bench.
+
+BASE_PORT=${BASE_PORT:-9100}
+THREADS=${THREADS:-2}
+WORKERS=${WORKERS:-2}
+CONNS=${CONNS:-16}
+WINDOW=${WINDOW:-64}
+SECS=${SECS:-5}
+COUNTS=${@:-1 2 3 5}
+
+cd "$(dirname "$0")/.."
+for n in $COUNTS; do
+    pids=()
+    parts=()
+    for ((i = 0; i < n; i++)); do
+        port=$((BASE_PORT + 1 + i))
+        ./bin/ZotDonate_MTserver -c "$THREADS" -P "$i/$n" "$port" "/tmp/cluster_bench_$i.log" > /dev/null 2>&1 &
+        pids+=($!)
+        parts+=("127.0.0.1:$port")
+    done
+    sleep 0.5
+    ./bin/ZotDonate_proxy -w "$WORKERS" "$BASE_PORT" "${parts[@]}" > /dev/null 2>&1 &
+    pids+=($!)
+    sleep 0.5
+    printf "%2d partitions: " "$n"
+    ./bin/cluster_bench -c "$CONNS" -w "$WINDOW" -d "$SECS" 127.0.0.1 "$BASE_PORT"
+    kill -INT "${pids[@]}"
+    wait
+done
@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "core.h"
+
+/*
+ * Socket-free throughput of the charity state operations under each
+ * synchronization strategy. THREADS threads (doubling from 1 up to -t) run a
+ * DONATE/CINFO/TOP/STATS/LOGOUT mix against the core for DURATION_MS:
+ * READ_PCT% of the operations are reads (80% CINFO, 10% TOP, 10% STATS),
+ * the rest are donations, and every LOGOUT_EVERY-th donation of a thread is
+ * followed by a LOGOUT of its running total. HOT_PCT% of the charity picks go
+ * to charity 0, the rest are uniform. Cache misses come from perf_event_open
+ * and count every thread of the run, "-" if the kernel does not allow it.
+ */
+
+#define USAGE_MSG "core_bench [-h] [-s STRATEGY] [-t MAX_THREADS] [-r READ_PCT] [-k HOT_PCT] [-d DURATION_MS] [-l LOGOUT_EVERY]\n"
+
+static const char* all_strategies[] = {"global", "charity", "rwlock", "rwpref", "atomic", "sharded", "owner"};
+
+static int max_threads = 8;
+static int read_pct = 50;
+static int hot_pct = 20;
+static int duration_ms = 500;
+static int logout_every = 16;
+
+static volatile int running;
+
+typedef struct {
+    pthread_t tid;
+    uint64_t seed;
+    uint64_t ops;
+} __attribute__((aligned(64))) bench_thread_t;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t* s) {
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+static int pick_charity(uint64_t* seed) {
+    if ((int) (xorshift(seed) % 100) < hot_pct) {
+        return 0;
+    }
+    return xorshift(seed) % NUM_CHARITIES;
+}
+
+static void* worker(void* vargp) {
+    bench_thread_t* t = vargp;
+    uint64_t donation_total = 0;
+    int donations = 0;
+    uint64_t ops = 0;
+    charity_t info;
+    uint64_t top[3];
+    core_stats_t stats;
+
+    while (running) {
+        uint64_t r = xorshift(&t->seed) % 100;
+        if ((int) r < read_pct) {
+            uint64_t kind = xorshift(&t->seed) % 10;
+            if (kind < 8) {
+                core_cinfo(pick_charity(&t->seed), &info);
+            } else if (kind == 8) {
+                core_top(top);
+            } else {
+                core_stats(&stats);
+            }
+        } else {
+            uint64_t amount = xorshift(&t->seed) % 1000 + 1;
+            core_donate(pick_charity(&t->seed), amount, xorshift(&t->seed) % 100000);
+            donation_total += amount;
+            if (++donations == logout_every) {
+                core_logout(donation_total);
+                donation_total = 0;
+                donations = 0;
+                ops++;
+            }
+        }
+        ops++;
+    }
+    t->ops = ops;
+    return NULL;
+}
+
+// Counts the calling thread and every thread it creates afterwards
+static int cache_miss_counter() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void run(const char* strategy, int threads, double* base) {
+    if (core_init(strategy, NULL)) {
+        fprintf(stderr, "unknown strategy %s\n", strategy);
+        exit(EXIT_FAILURE);
+    }
+    bench_thread_t* ts = calloc(threads, sizeof(bench_thread_t));
+    int perf_fd = cache_miss_counter();
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    running = 1;
+    uint64_t start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        ts[i].seed = 0x9E3779B97F4A7C15ull * (i + 1);
+        if (pthread_create(&ts[i].tid, NULL, worker, &ts[i])) {
+            printf("pthread_create err\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct timespec d = {duration_ms / 1000, (duration_ms % 1000) * 1000000L};
+    nanosleep(&d, NULL);
+    running = 0;
+    uint64_t ops = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ts[i].tid, NULL);
+        ops += ts[i].ops;
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    char misses[32] = "-";
+    if (perf_fd >= 0) {
+        uint64_t count;
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fd, &count, sizeof(count)) == sizeof(count)) {
+            snprintf(misses, sizeof(misses), "%.3f", (double) count / ops);
+        }
+        close(perf_fd);
+    }
+
+    double rate = ops / (elapsed / 1e9);
+    if (threads == 1) {
+        *base = rate;
+    }
+    printf("%-8s %8d %12.0f %8.2f %14s\n", strategy, threads, rate, rate / *base, misses);
+    free(ts);
+    core_destroy();
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    const char* strategy = NULL;
+    while ((opt = getopt(argc, argv, "hs:t:r:k:d:l:")) != -1) {
+        switch (opt) {
+            case 's': strategy = optarg; break;
+            case 't': max_threads = atoi(optarg); break;
+            case 'r': read_pct = atoi(optarg); break;
+            case 'k': hot_pct = atoi(optarg); break;
+            case 'd': duration_ms = atoi(optarg); break;
+            case 'l': logout_every = atoi(optarg); break;
+            default:
+                fprintf(stderr, USAGE_MSG);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (max_threads < 1 || read_pct < 0 || read_pct > 100 || hot_pct < 0 || hot_pct > 100 ||
+        duration_ms < 1 || logout_every < 1) {
+        fprintf(stderr, USAGE_MSG);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("threads<=%d reads=%d%% hot=%d%% duration=%dms logout_every=%d cpus=%ld\n",
+           max_threads, read_pct, hot_pct, duration_ms, logout_every, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-8s %8s %12s %8s %14s\n", "strategy", "threads", "ops/s", "scaling", "misses/op");
+    const char** strategies = strategy ? &strategy : all_strategies;
+    int n = strategy ? 1 : sizeof(all_strategies) / sizeof(all_strategies[0]);
+    for (int i = 0; i < n; i++) {
+        double base = 0;
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            run(strategies[i], threads, &base);
+        }
+    }
+    return 0;
+}
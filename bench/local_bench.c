@@ -0,0 +1,154 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "shmring.h"
+
+/*
+ * Round-trip latency of one DONATE against a running MT server, over TCP
+ * loopback and over the shared-memory transport (-u on the server). Each
+ * path sends COUNT donations one at a time, waiting for every reply, and
+ * reports the mean and the 50th/99th percentile in microseconds.
+ */
+
+#define USAGE_MSG "local_bench [-h] [-n COUNT] [-b SPINS] PORT_NUMBER SOCKET_PATH\n"
+
+static int count = 100000;
+static int spin = -1;  // shm_default_spin()
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char* name, uint64_t* ns) {
+    qsort(ns, count, sizeof(uint64_t), cmp_u64);
+    double sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += ns[i];
+    }
+    printf("%-6s %10.2f %10.2f %10.2f\n", name, sum / count / 1000, ns[count / 2] / 1000.0, ns[(int) (count * 0.99)] / 1000.0);
+}
+
+static int read_full(int fd, void* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char*) buf + done, len - done);
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static void run_tcp(int port, uint64_t* ns) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        printf("tcp connect err\n");
+        exit(EXIT_FAILURE);
+    }
+    message_t msg;
+    for (int i = 0; i < count; i++) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msgtype = DONATE;
+        msg.msgdata.donation.charity = i % 5;
+        msg.msgdata.donation.amount = 1;
+        uint64_t start = now_ns();
+        if (write(fd, &msg, sizeof(msg)) != sizeof(msg) || read_full(fd, &msg, sizeof(msg))) {
+            printf("tcp io err\n");
+            exit(EXIT_FAILURE);
+        }
+        ns[i] = now_ns() - start;
+    }
+    close(fd);
+}
+
+static void run_shm(const char* path, uint64_t* ns) {
+    shm_conn_t* c = shm_connect(path, spin);
+    if (c == NULL) {
+        printf("shm connect err\n");
+        exit(EXIT_FAILURE);
+    }
+    message_t msg;
+    for (int i = 0; i < count; i++) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msgtype = DONATE;
+        msg.msgdata.donation.charity = i % 5;
+        msg.msgdata.donation.amount = 1;
+        uint64_t start = now_ns();
+        if (shm_write(c, &msg, sizeof(msg)) != sizeof(msg)) {
+            printf("shm io err\n");
+            exit(EXIT_FAILURE);
+        }
+        size_t got = 0;
+        while (got < sizeof(msg)) {
+            ssize_t n = shm_read(c, (char*) &msg + got, sizeof(msg) - got);
+            if (n <= 0) {
+                printf("shm io err\n");
+                exit(EXIT_FAILURE);
+            }
+            got += n;
+        }
+        ns[i] = now_ns() - start;
+    }
+    shm_close(c);
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "hn:b:")) != -1) {
+        switch (opt) {
+            case 'n': count = atoi(optarg); break;
+            case 'b': spin = atoi(optarg); break;
+            default:
+                fprintf(stderr, USAGE_MSG);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (spin < 0) {
+        spin = shm_default_spin();
+    }
+    if (argc - optind != 2 || count < 1) {
+        fprintf(stderr, USAGE_MSG);
+        exit(EXIT_FAILURE);
+    }
+    int port = atoi(argv[optind]);
+    const char* path = argv[optind + 1];
+
+    uint64_t* ns = malloc(sizeof(uint64_t) * count);
+    if (ns == NULL) {
+        printf("alloc err\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("count=%d spins=%d cpus=%ld\n", count, spin, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-6s %10s %10s %10s\n", "path", "mean_us", "p50_us", "p99_us");
+    run_tcp(port, ns);
+    report("tcp", ns);
+    run_shm(path, ns);
+    report("shm", ns);
+    free(ns);
+    return 0;
+}
@@ -0,0 +1,31 @@
+#!/bin/bash
+# Donation throughput of one MT server with the NUMA-aware mode off and on
+# (-N), with thread-per-client sessions and with coroutine workers. Both
+# runs use the sharded strategy, so the only difference is placement: pinned
+# sessions and workers, node-local shards and stacks, connections steered
+# by SO_INCOMING_CPU. Build first with: make && make bench
+#   bench/numa_bench.sh
+# Environment: PORT (default 9200), WORKERS coroutine threads (default one
+# per CPU), CONNS, WINDOW, SECS for cluster_bench.
+
+PORT=${PORT:-9200}
+WORKERS=${WORKERS:-$(nproc)}
+CONNS=${CONNS:-32}
+WINDOW=${WINDOW:-64}
+SECS=${SECS:-5}
+
+cd "$(dirname "$0")/.."
+for sessions in threads coroutines; do
+    for mode in off on; do
+        args=(-s sharded)
+        [ "$sessions" = coroutines ] && args+=(-c "$WORKERS")
+        [ "$mode" = on ] && args+=(-N)
+        ./bin/ZotDonate_MTserver "${args[@]}" "$PORT" /tmp/numa_bench.log > /dev/null 2>&1 &
+        pid=$!
+        sleep 0.5
+        printf "%-10s NUMA %-3s: " "$sessions" "$mode"
+        ./bin/cluster_bench -c "$CONNS" -w "$WINDOW" -d "$SECS" 127.0.0.1 "$PORT"
+        kill -INT "$pid"
+        wait "$pid"
+    done
+done
@@ -0,0 +1,42 @@
+#!/bin/bash
+# Donors under a flood of dashboard reads, with and without QoS classes
+# (include/qos.h): cluster_bench donors on the donor port while READERS
+# connections keep CINFO_ALL requests in flight, against the MT server (one
+# thread per client) and the RW server (reader-preference lock).
+# Build first with: make && make bench
+#   bench/qos_bench.sh [QOS_ARG...]
+# Environment: PORT (default 9400, the RW server also takes PORT+1), CONNS,
+# READERS, WINDOW, SECS.
+
+PORT=${PORT:-9400}
+CONNS=${CONNS:-4}
+READERS=${READERS:-32}
+WINDOW=${WINDOW:-8}
+SECS=${SECS:-5}
+QOS=${@:-off 500 100}
+
+cd "$(dirname "$0")/.."
+for q in $QOS; do
+    args=""
+    if [ "$q" != off ]; then
+        args="-q $q"
+    fi
+    ./bin/ZotDonate_MTserver $args "$PORT" /tmp/qos_bench.log > /tmp/qos_bench.out 2>&1 &
+    pid=$!
+    sleep 0.5
+    echo "== MT -q $q"
+    ./bin/cluster_bench -c "$CONNS" -w "$WINDOW" -d "$SECS" -r "$READERS" 127.0.0.1 "$PORT"
+    kill -INT "$pid"
+    wait "$pid"
+    grep "^qos" /tmp/qos_bench.out
+
+    # The RW server has a single writer thread, one donor connection at a time
+    ./bin/ZotDonate_RWserver $args "$PORT" $((PORT + 1)) /tmp/qos_bench.log > /tmp/qos_bench.out 2>&1 &
+    pid=$!
+    sleep 0.5
+    echo "== RW -q $q"
+    ./bin/cluster_bench -c 1 -w "$WINDOW" -d "$SECS" -r "$READERS" -R "$PORT" 127.0.0.1 $((PORT + 1))
+    kill -INT "$pid"
+    wait "$pid"
+    grep "^qos" /tmp/qos_bench.out
+done
@@ -0,0 +1,30 @@
+#!/bin/bash
+# Effect of each socket tuning profile (include/socktune.h) on one MT server
+# with coroutine workers: pipelined donation throughput and latency from
+# cluster_bench, then one-at-a-time round trips from local_bench.
+# Build first with: make && make bench
+#   bench/socktune_bench.sh [PROFILE...]
+# Environment: PORT (default 9200), WORKERS (default one per CPU), CONNS,
+# WINDOW, SECS for cluster_bench, COUNT round trips for local_bench.
+
+PORT=${PORT:-9200}
+WORKERS=${WORKERS:-$(nproc)}
+CONNS=${CONNS:-16}
+WINDOW=${WINDOW:-16}
+SECS=${SECS:-5}
+COUNT=${COUNT:-20000}
+PROFILES=${@:-default latency throughput}
+SOCK=/tmp/socktune_bench.sock
+
+cd "$(dirname "$0")/.."
+for profile in $PROFILES; do
+    ./bin/ZotDonate_MTserver -c "$WORKERS" -o "$profile" -u "$SOCK" "$PORT" /tmp/socktune_bench.log > /dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    echo "== $profile"
+    printf "pipelined: "
+    ./bin/cluster_bench -c "$CONNS" -w "$WINDOW" -d "$SECS" 127.0.0.1 "$PORT"
+    ./bin/local_bench -n "$COUNT" "$PORT" "$SOCK" | grep -i -E "mean|tcp"
+    kill -INT "$pid"
+    wait "$pid"
+done
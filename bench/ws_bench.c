@@ -0,0 +1,115 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "coro.h"
+
+/*
+ * Tail latency of session tasks under skewed load, with and without work
+ * stealing. Sessions are coroutines that alternate between "waiting for the
+ * next message" (a yield) and processing it (a busy loop). skew% of them are
+ * homed on worker 0, which models a few bulk donors landing on one worker.
+ * Latency is measured from the moment a request becomes runnable until it has
+ * been processed, so it includes the time spent queued behind other sessions.
+ */
+
+#define USAGE_MSG "ws_bench [-h] [-w WORKERS] [-s SESSIONS] [-r REQUESTS] [-k SKEW_PCT] [-c COST_US]\n"
+
+static int num_workers = 4;
+static int num_sessions = 64;
+static int num_requests = 200;
+static int skew_pct = 90;
+static int cost_us = 20;
+
+static uint64_t* latencies;  // num_sessions * num_requests, in ns
+static int sessions_done;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void busy(uint64_t ns) {
+    uint64_t end = now_ns() + ns;
+    while (now_ns() < end) {
+    }
+}
+
+static void* session(void* vargp) {
+    int id = (int) (intptr_t) vargp;
+    uint64_t* out = &latencies[(size_t) id * num_requests];
+    for (int i = 0; i < num_requests; i++) {
+        uint64_t ready = now_ns();
+        coro_yield();
+        busy((uint64_t) cost_us * 1000);
+        out[i] = now_ns() - ready;
+    }
+    __atomic_fetch_add(&sessions_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(int steal) {
+    size_t n = (size_t) num_sessions * num_requests;
+    sessions_done = 0;
+    coro_set_stealing(steal);
+    coro_sched_init(num_workers);
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < num_sessions; i++) {
+        int home = (i * 100 < skew_pct * num_sessions) ? 0 : i % num_workers;
+        coro_spawn_on(home, session, (void*) (intptr_t) i);
+    }
+    while (__atomic_load_n(&sessions_done, __ATOMIC_ACQUIRE) < num_sessions) {
+        usleep(1000);
+    }
+    uint64_t elapsed = now_ns() - start;
+    unsigned long steals = coro_steal_count();
+    coro_sched_shutdown();
+
+    qsort(latencies, n, sizeof(uint64_t), cmp_u64);
+    printf("%-8s %10.1f %10.1f %10.1f %10.1f %10lu %10.0f\n", steal ? "on" : "off",
+           latencies[n / 2] / 1e3, latencies[n * 99 / 100] / 1e3,
+           latencies[n * 999 / 1000] / 1e3, latencies[n - 1] / 1e3,
+           steals, n / (elapsed / 1e9));
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "hw:s:r:k:c:")) != -1) {
+        switch (opt) {
+            case 'w': num_workers = atoi(optarg); break;
+            case 's': num_sessions = atoi(optarg); break;
+            case 'r': num_requests = atoi(optarg); break;
+            case 'k': skew_pct = atoi(optarg); break;
+            case 'c': cost_us = atoi(optarg); break;
+            default:
+                fprintf(stderr, USAGE_MSG);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (num_workers < 1 || num_sessions < 1 || num_requests < 1) {
+        fprintf(stderr, USAGE_MSG);
+        exit(EXIT_FAILURE);
+    }
+
+    latencies = malloc(sizeof(uint64_t) * num_sessions * num_requests);
+    printf("workers=%d sessions=%d requests=%d skew=%d%% cost=%dus\n",
+           num_workers, num_sessions, num_requests, skew_pct, cost_us);
+    printf("%-8s %10s %10s %10s %10s %10s %10s\n",
+           "stealing", "p50(us)", "p99(us)", "p99.9(us)", "max(us)", "steals", "req/s");
+    run(0);
+    run(1);
+    free(latencies);
+    return 0;
+}
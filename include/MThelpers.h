@@ -3,20 +3,14 @@
 
 #include "dlinkedlist.h"
 
-extern pthread_mutex_t mt_stats_lock;
 extern pthread_mutex_t log_file_lock;
-extern pthread_mutex_t charity_locks[5];
 
 extern dlist_t* list;
 extern FILE* log_file;
 extern volatile sig_atomic_t sigint;
-
-// Global variables, statistics collected since server start-up
-extern int clientCnt;  // # of client connections made, Updated by the main thread
-extern uint64_t maxDonations[3];  // 3 highest total donations amounts (sum of all donations to all
-                           // charities in one connection), updated by client threads
-                           // index 0 is the highest total donation
-extern charity_t charities[5]; // Global variable, one charity per index
+// -P IDX/N, part_count is 1 when not partitioned (part.h)
+extern int part_index;
+extern int part_count;
 
 void emptyDeleter();
 
@@ -25,7 +19,11 @@ void cleanup_server();
 void init_server(const char* log_filename);
 
 void* client_handler(void* vargp);
-void print_stats();
+
+// Accept co-located clients on a Unix socket at path, served over shared-memory rings (shmring.h)
+void local_start(const char* path, int spin);
+// Stop accepting them, sessions already running are left to the drain
+void local_stop();
 void sigint_handler(int sig);
 
 // discussion:
@@ -0,0 +1,44 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Connection admission and token-bucket rate limiting. Everything here is
+ * lock-free: the connection limit is a single atomic counter and the per-IP
+ * buckets live in a fixed open-addressed table updated with CAS.
+ *
+ * A bucket is packed into one 64-bit word: the upper 36 bits hold the last
+ * refill time in ms, the lower 28 bits the available tokens in 1/1000ths.
+ * Bursts are capped at 268k messages.
+ */
+typedef uint64_t rate_bucket_t;
+
+#define RATE_IP_SLOTS 4096  // distinct source addresses tracked at once
+
+/*
+ * All limits are optional, 0 means unlimited.
+ * @param max_conns concurrent client connections accepted
+ * @param conn_rate messages/sec allowed on one connection (burst of 1s)
+ * @param ip_rate messages/sec allowed from one source address (burst of 1s)
+ */
+void admission_init(int max_conns, int conn_rate, int ip_rate);
+
+// Take a connection slot, false when the server is full
+bool admission_enter();
+void admission_leave();
+
+// Reply ERROR to a connection that was not admitted and close it
+void admission_reject(int fd);
+
+void rate_bucket_init(rate_bucket_t* bucket);
+
+/*
+ * Charge one message against the connection's bucket and its source address.
+ * @param ip source address in network byte order
+ * @return false if either limit is exceeded
+ */
+bool admission_allow(rate_bucket_t* conn_bucket, uint32_t ip);
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef CORE_H
+#define CORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "protocol.h"
+
+/*
+ * Charity state shared by ZotDonate_MTserver and ZotDonate_RWserver
+ * (build/libzotcore.a). The servers do the I/O and logging, every read or
+ * update of the charities, the top 3 and the client count goes through here.
+ *
+ * How the state is synchronized is a strategy picked at start time (-s) or
+ * build time (make SYNC=name):
+ *   global   one mutex around everything
+ *   charity  one mutex per charity, one for the top 3
+ *   rwlock   pthread rwlock, donations take the write side
+ *   rwpref   hand-rolled reader-preference lock
+ *   atomic   lock-free counters, CAS for topDonation, spinlock for the top 3
+ *   sharded  per-thread shards of the charity counters, summed on read
+ *   owner    each charity owned by one pinned thread fed over SPSC rings,
+ *            reads come from seqlock snapshots (core_owner.c)
+ */
+#define NUM_CHARITIES 5
+
+// Everything that has to survive a restart
+typedef struct {
+    charity_t charities[NUM_CHARITIES];
+    uint64_t maxDonations[3];  // 3 highest total donations of one connection, index 0 is the highest
+    int clientCnt;
+} core_state_t;
+
+typedef struct {
+    int charity_high;
+    int charity_low;
+    uint64_t amount_high;
+    uint64_t amount_low;
+} core_stats_t;
+
+// Everything a dashboard shows, from one point in time (CINFO_ALL payload)
+typedef struct {
+    charity_t charities[NUM_CHARITIES];
+    uint64_t maxDonations[3];
+    core_stats_t stats;  // derived from charities[]
+} core_snapshot_t;
+
+typedef struct {
+    const char* name;
+    void (*init)();
+    void (*destroy)();
+    void (*donate)(int charity, uint64_t amount);
+    void (*cinfo)(int charity, charity_t* out);
+    void (*top)(uint64_t out[3]);
+    void (*logout)(uint64_t donation_total);
+    // Every charity total as of one point in time
+    void (*totals)(uint64_t out[NUM_CHARITIES]);
+    // charities and maxDonations as of one point in time, the lock-free
+    // strategies (atomic, owner) only promise that per charity
+    void (*snapshot)(core_snapshot_t* out);
+    // Quiescent only, move private state (shards) out of / into core_state
+    void (*sync_out)();
+    void (*sync_in)();
+    // Donations become visible later than donate() returns, the strategy calls
+    // core_version_bump() itself once they are
+    bool async_versions;
+} sync_ops_t;
+
+/*
+ * @param strategy name from the list above, NULL for the build-time default
+ *                 or, without one, fallback
+ * @return 0, or -1 for an unknown name
+ */
+int core_init(const char* strategy, const char* fallback);
+void core_destroy();
+const char* core_strategy();
+
+// A charity index out of range returns false and changes nothing
+// @param source donor key for the distinct count, see SKETCH_SOURCE
+bool core_donate(int charity, uint64_t amount, uint64_t source);
+bool core_cinfo(int charity, charity_t* out);
+void core_top(uint64_t out[3]);
+// Fold one connection's total into the top 3
+void core_logout(uint64_t donation_total);
+// Charities with the highest and lowest total, ties go to the lower index
+void core_stats(core_stats_t* out);
+void core_client_connected();
+
+/*
+ * Read-your-writes for the strategies that apply donations later (owner).
+ * A session's mark records where its own donations were queued, and a read
+ * from that session waits for those only, never for other sessions'. The
+ * mark in use is the hook's, if it returns one (coroutine sessions move
+ * between threads and carry theirs), else one per thread, which is the
+ * session of a thread-per-client handler.
+ */
+typedef struct {
+    void* queue[NUM_CHARITIES];  // strategy-private, NULL while nothing is pending
+    uint64_t pos[NUM_CHARITIES];
+} core_mark_t;
+void core_set_mark_hook(core_mark_t* (*hook)());
+core_mark_t* core_mark();
+
+/*
+ * Change counters, read without locking. A reader that loads a version and
+ * then the data sees at least that version's changes, so an unchanged
+ * version means the client's copy is current. Values are offset by the
+ * start time in ns and never repeat across a restart.
+ */
+uint64_t core_version(int charity);  // DONATEs to charity
+uint64_t core_version_all();         // every DONATE and LOGOUT
+
+/*
+ * Encode the reply to CINFO_IF_CHANGED, TOP_IF_CHANGED or STATS_IF_CHANGED
+ * (see protocol_ext.h) into buf, at least IF_CHANGED_REPLY_MAX bytes.
+ * @return bytes to send, 0 for a charity index out of range
+ */
+#define IF_CHANGED_REPLY_MAX (sizeof(message_t) + sizeof(uint64_t))
+size_t core_if_changed_reply(const message_t* req, char* buf);
+
+// One synchronization for every charity, the top 3 and the STATS summary
+void core_snapshot(core_snapshot_t* out);
+// Variable-length CINFO_ALL reply, a message_t then the core_snapshot_t
+#define CINFO_ALL_REPLY_MAX (sizeof(message_t) + sizeof(core_snapshot_t))
+size_t core_cinfo_all_reply(const message_t* req, char* buf);
+
+/*
+ * Replication journal (repl.h). Set while quiescent; when set it is called
+ * by the updating thread after every applied DONATE and every LOGOUT with a
+ * non-zero total, the only changes to the charities and the top 3.
+ */
+typedef void (*core_journal_fn)(uint8_t type, int charity, uint64_t amount, uint64_t source);
+extern core_journal_fn core_journal;
+
+/*
+ * Multi-process servers (prefork.h). Before forking, core_share moves the
+ * state, the change counters and the top 3 lock into MAP_SHARED memory, so
+ * every forked process updates one copy. Only the atomic strategy keeps
+ * nothing else, -1 for the others. A forked process attaches to take the
+ * lock under its pid; after one died, recover releases the lock if it held
+ * it. The donor totals, rates, series and sketches stay per process.
+ */
+int core_share();
+void core_share_attach();
+bool core_share_recover(pid_t dead);
+
+// Quiescent only (startup, shutdown, restart handoff)
+void core_export(core_state_t* out);
+void core_import(const core_state_t* in);
+void core_print_stats();
+
+// For the strategies
+#define CACHE_LINE 64
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() do {} while (0)
+#endif
+
+extern core_state_t* core_state;
+extern int* core_top_spin;  // the atomic strategy's top 3 lock
+extern int core_lock_id;    // what a holder stores in it, its pid once shared
+void core_fold_top(uint64_t top[3], uint64_t donation_total);
+void core_apply_donation(charity_t* c, uint64_t amount);
+void core_version_bump(int charity);
+
+extern const sync_ops_t sync_global;
+extern const sync_ops_t sync_charity;
+extern const sync_ops_t sync_rwlock;
+extern const sync_ops_t sync_rwpref;
+extern const sync_ops_t sync_atomic;
+extern const sync_ops_t sync_sharded;
+extern const sync_ops_t sync_owner;
+
+#endif
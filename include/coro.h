@@ -0,0 +1,79 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Stack given to each coroutine. Pages are only committed when touched, so a
+// session parked in coro_read() typically costs a few KB of resident memory.
+#define CORO_STACK_SIZE (64 * 1024)
+
+// Same signature as a pthread start routine so thread handlers can be spawned
+// as coroutines unchanged.
+typedef void* (*coro_fn)(void*);
+
+/*
+ * M:N scheduler. Coroutines are multiplexed over nworkers OS threads, each
+ * with its own epoll set and a Chase-Lev deque of runnable coroutines. A
+ * coroutine that would block in coro_read()/coro_write() parks on its fd and
+ * the worker runs something else.
+ *
+ * Every coroutine has a home worker whose epoll set watches its fd, so a
+ * session keeps running where its state is cache-hot. When a home worker has
+ * more runnable sessions than it can serve, idle workers steal them; a stolen
+ * session goes back to its home the next time it blocks.
+ */
+void coro_sched_init(int nworkers);
+void coro_sched_shutdown();
+
+/*
+ * Create a coroutine running fn(arg). Workers are picked round-robin.
+ * @return 0 on success, -1 on failure (like pthread_create, nothing is run)
+ */
+int coro_spawn(coro_fn fn, void* arg);
+// Same as coro_spawn() but with an explicit home worker
+int coro_spawn_on(int worker, coro_fn fn, void* arg);
+/*
+ * NUMA-aware mode (topo.h): worker i is pinned to node i % nodes and steals
+ * from its own node first. @return the next worker of node, round-robin, -1
+ * if it has none
+ */
+int coro_worker_on_node(int node);
+
+// Work stealing is on by default; turning it off pins sessions to their home
+void coro_set_stealing(int enabled);
+// Before coro_sched_init: an idle worker spins on its epoll set for us
+// microseconds before sleeping in it
+void coro_set_busy_poll(int us);
+// Before coro_sched_init: worker i runs on CPU i only (socktune.h steering)
+void coro_set_cpu_pinning(int enabled);
+unsigned long coro_steal_count();
+
+// Non-zero when called from inside a coroutine
+int coro_running();
+// Pointer slot of the running coroutine for the caller's use, NULL outside
+// one. Unlike a __thread variable it moves along when the coroutine is stolen.
+void** coro_local();
+void coro_yield();
+
+/*
+ * Parking without an fd. coro_suspend() switches the running coroutine out
+ * until coro_wake() is called on its coro_self() handle, from any thread; a
+ * wake that comes first makes the next suspend return at once. Callers
+ * re-check what they wait for, a wake is only a hint.
+ */
+void* coro_self();
+void coro_suspend();
+void coro_wake(void* handle);
+
+int coro_set_nonblocking(int fd);
+
+/*
+ * Drop-in replacements for read()/write(). Inside a coroutine the fd must be
+ * non-blocking and the call suspends the coroutine instead of the thread;
+ * outside a coroutine they are plain read()/write().
+ */
+ssize_t coro_read(int fd, void* buf, size_t count);
+ssize_t coro_write(int fd, const void* buf, size_t count);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef DONORMAP_H
+#define DONORMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol_ext.h"
+
+/*
+ * Lifetime donation total per donor id, across connections. Open-addressed
+ * tables with linear probing, one per DONOR_STRIPES stripe (picked by hash);
+ * keys are published with release stores and totals are atomic adds, so
+ * lookups never lock. Updates hold their stripe's mutex. A stripe doubles its
+ * own table at 70% load, under that mutex only, so a resize stalls 1/64 of
+ * the donors for 1/64 of the rehash; the old table stays readable until
+ * donors_destroy().
+ *
+ * The MAX_TOP_DONORS highest totals are kept on the side, updates that
+ * cannot make the list skip its lock.
+ */
+#define DONOR_STRIPES 64
+#define DONOR_INITIAL_SLOTS (1 << 16)  // over all stripes
+
+void donors_init();
+void donors_destroy();
+
+// donor 0 is not a donor and is ignored
+void donors_add(uint64_t donor, uint64_t amount);
+uint64_t donors_get(uint64_t donor);
+// @return number of entries written to out (at most n), highest first
+int donors_top(donor_total_t* out, int n);
+size_t donors_count();
+
+// Largest TOP_DONORS reply
+#define TOP_DONORS_REPLY_MAX (sizeof(message_t) + MAX_TOP_DONORS * sizeof(donor_total_t))
+
+/*
+ * Encode the variable-length reply to a TOP_DONORS request.
+ * @param buf at least TOP_DONORS_REPLY_MAX bytes
+ * @return bytes to send
+ */
+size_t donors_top_reply(const message_t* req, char* buf);
+
+// Quiescent only (restart handoff), export returns a malloc'd array
+donor_total_t* donors_export(size_t* n);
+void donors_import(const donor_total_t* in, size_t n);
+
+#endif
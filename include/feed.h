@@ -0,0 +1,45 @@
+#ifndef FEED_H
+#define FEED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "core.h"
+
+/*
+ * SUBSCRIBE push feed. One publisher thread checks core_version_all() every
+ * FEED_TICK_MS; when it moved it takes a core_snapshot(), encodes a single
+ * update and hands the same buffer to every subscriber
+ * that is due. Sends
+ * never block: a subscriber keeps at most the update being written plus the
+ * newest one waiting behind it, anything older is dropped, so a slow reader
+ * sees fewer updates instead of making the server buffer without bound.
+ *
+ * An update is variable-length (see protocol_ext.h): a message_t of type
+ * SUBSCRIBE followed by the feed_update_t payload.
+ */
+#define FEED_TICK_MS 100
+
+typedef struct {
+    uint64_t seq;  // +1 per encoded update, a gap means updates were dropped
+    core_snapshot_t state;  // same as a CINFO_ALL reply
+} feed_update_t;
+
+// Start/stop the publisher thread
+void feed_start();
+void feed_stop();
+
+/*
+ * Push updates to fd until feed_unsubscribe(). The first update goes out on
+ * the next tick.
+ * @param interval_ms minimum time between two updates to this subscriber
+ */
+void feed_subscribe(int fd, uint64_t interval_ms);
+/*
+ * Must be called before fd is closed.
+ * @return true if no update was left half-written, so fd is at a message
+ *         boundary and the caller may still write a reply to it
+ */
+bool feed_unsubscribe(int fd);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef LIFECYCLE_H
+#define LIFECYCLE_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "core.h"
+#include "util.h"
+
+// Set once the server stops accepting; handlers log out their session on EOF
+extern volatile sig_atomic_t draining;
+// Set by SIGUSR2, the accept loop hands its listeners to a new process
+extern volatile sig_atomic_t restart_requested;
+// This process took over from an old one, append to its log instead of truncating
+extern int restarted;
+
+#define DEFAULT_DRAIN_SECS 5
+
+void restart_handler(int sig);
+// No-op handler, lets pthread_kill(SIGUSR1) interrupt a blocking accept()
+void wakeup_handler(int sig);
+
+/*
+ * Registry of open client sessions. Register at accept time, unregister when
+ * the handler is done with the fd.
+ */
+void session_register(int fd);
+void session_unregister(int fd);
+int session_count();
+
+/*
+ * Graceful drain: stop reading new requests on every session (in-flight
+ * requests still get their reply), wait for handlers to finish, and once
+ * deadline_ms has passed force the remaining sockets closed.
+ * @return number of sessions that had to be forced
+ */
+int drain_sessions(uint64_t deadline_ms);
+
+/*
+ * Hot restart. The old process starts its own binary (/proc/self/exe) again
+ * with a socketpair in ZOTDONATE_HANDOFF_FD and passes the listening sockets
+ * with SCM_RIGHTS. It only stops accepting once the new process acked them;
+ * if the new process fails to start or stays silent for RESTART_ACK_MS, it
+ * is killed and the old one keeps serving. The final state follows once the
+ * old process has drained, the new one receives it before it starts
+ * accepting; connections arriving in between wait in the listen backlog
+ * (SOMAXCONN) instead of being refused.
+ *
+ * That accept gap is the restart's SLA: at most the drain timeout (-d, the
+ * same in both processes) plus RESTART_STATE_SLACK_MS for the old process to
+ * stop its threads and send the state. A new process still without the
+ * state by then gives up rather than serve counters that miss the old
+ * process's donations. The new process prints how long the gap was.
+ */
+#define RESTART_ACK_MS 5000
+#define RESTART_STATE_SLACK_MS 2000
+
+// Channel to the old process, -1 when this is a fresh start
+int restart_inherited_fd();
+/*
+ * Old process: spawn, hand over the listeners and wait for the ack.
+ * @return the channel to send the state on, or -1 to keep serving
+ */
+int restart_handoff(char* argv[], const int* fds, int n);
+// New process: receive the listeners, then ack them
+int restart_recv_listeners(int channel, int* fds, int n);
+int restart_ack(int channel);
+// The charity state and the donor totals, the receiver imports them into the core
+int restart_send_state(int channel);
+// @param drain_ms the drain timeout, the wait is bounded by it plus the slack
+int restart_recv_state(int channel, uint64_t drain_ms);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef MUX_H
+#define MUX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "admission.h"
+#include "core.h"
+
+/*
+ * Multiplexed connections (MUX_HELLO, see protocol_ext.h). After the hello
+ * every request is a frame of a u32 session id followed by a message_t, and
+ * every reply is prefixed with the id of the session it answers. Each
+ * session has its own running total and LOGIN, so one gateway connection
+ * carries many donors. The sessions of a connection live in a small
+ * open-addressed table owned by its handler, no locking.
+ *
+ * The per-connection rate limit (-r) applies to each session on its own.
+ * The per-address limit (-i) still covers all of a gateway's sessions, the
+ * hello proves nothing about who is behind it.
+ */
+#define MUX_MAX_SESSIONS 65536
+#define MUX_ID_BYTES 4
+
+// One donor session: a whole plain connection, or one id of a mux connection
+typedef struct {
+    uint64_t donation_total;
+    uint64_t donor;  // set by LOGIN, 0 for anonymous sessions
+    rate_bucket_t rate_bucket;
+    core_mark_t mark;  // its own donations, for read-your-writes
+    uint32_t id;
+    bool used;
+} session_t;
+
+typedef struct {
+    session_t* slots;
+    uint32_t cap;  // power of 2
+    uint32_t count;
+} mux_table_t;
+
+void mux_init(mux_table_t* t);
+void mux_destroy(mux_table_t* t);
+// The session for id, created on first use. NULL once MUX_MAX_SESSIONS are open.
+session_t* mux_get(mux_table_t* t, uint32_t id);
+void mux_remove(mux_table_t* t, uint32_t id);
+
+#endif
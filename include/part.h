@@ -0,0 +1,24 @@
+#ifndef PART_H
+#define PART_H
+
+#include <stdint.h>
+
+/*
+ * Partitioned cluster. Each ZotDonate_MTserver started with -P IDX/N owns
+ * the charities whose id hashes into the IDX-th of N equal ranges, and
+ * answers ERROR to DONATE and CINFO for the others. ZotDonate_proxy routes
+ * DONATE and CINFO to the owner, and answers TOP and STATS by asking every
+ * partition and merging: the partial top 3s into one top 3, the per
+ * partition high/low (STATS over the charities it owns) into one.
+ *
+ * The top 3 holds whole donor totals, which only the proxy sees. It folds
+ * a donor's total at LOGOUT into one partition (FOLD_TOTAL, picked by the
+ * donor's connection number), and a partition never folds the totals of
+ * its own sessions, which are the proxy's connections.
+ */
+#define PART_MAX 64
+
+// Fibonacci hash of the charity id, scaled into [0, n)
+#define PART_OF(charity, n) ((int) (((uint64_t) ((uint32_t) (charity) * 2654435769u) * (uint64_t) (n)) >> 32))
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+
+/*
+ * Prefork mode (-p PROCS), after the nginx model. The supervisor opens the
+ * listener, moves the core state into shared memory (core_share) and forks
+ * PROCS workers that all accept on it. Each worker is an ordinary server
+ * with its own threads, so a crash only drops that worker's clients: the
+ * supervisor frees the top 3 lock if the worker died holding it and forks
+ * a replacement, and the charities, the top 3 and the client count live on.
+ *
+ * SIGINT/SIGTERM to the supervisor is passed on to every worker; each one
+ * drains and exits, then the supervisor prints the aggregate statistics.
+ */
+#define PREFORK_MAX 256
+#define PREFORK_BACKOFF_MS 200  // between restarts of a worker that dies on start
+
+/*
+ * Fork the workers. Returns in each worker with its index in [0, procs), and
+ * in the supervisor with -1 once every worker has exited after a shutdown.
+ */
+int prefork_start(int procs);
+// In a worker: this process's index, -1 in a single-process server
+int prefork_worker();
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef PROTOCOL_EXT_H
+#define PROTOCOL_EXT_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+/*
+ * Message types added on top of protocol.h, which stays untouched. Requests
+ * still use message_t. Replies that do not fit in message_t are
+ * variable-length: a message_t echoing the request type with
+ * msgdata.donation.amount set to the payload size in bytes, followed by
+ * that many bytes of payload.
+ */
+enum msg_types_ext {
+    LOGIN = 5,   // donation.amount = donor id (non-zero), later DONATEs count toward that donor
+    TOP_DONORS,  // donation.amount = how many donors (at most MAX_TOP_DONORS), variable-length reply
+    RATE,        // donation.charity, reply maxDonations[] = amount donated in the last 1m, 5m, 1h
+    HISTORY,     // stats = {charity, width in minutes, T1, T2 in epoch secs}, variable-length reply
+                 // of one u64 total per width bucket in [T1, T2)
+    SKETCH,      // donation.charity, donation.amount = quantile in thousandths (500 is the median),
+                 // reply maxDonations[] = distinct donors, amount at that quantile, donations
+    SUBSCRIBE,   // donation.amount = min ms between updates, no reply, the connection then only
+                 // receives variable-length feed updates (feed.h) and only LOGOUT is read
+    CINFO_IF_CHANGED,  // CINFO with donation.amount = last version seen, see below
+    TOP_IF_CHANGED,    // TOP with donation.amount = last version seen
+    STATS_IF_CHANGED,  // STATS with donation.amount = last version seen
+    CINFO_ALL,   // variable-length reply, every charity, the top 3 and the STATS summary from one
+                 // synchronization (core_snapshot_t in core.h)
+    MUX_HELLO,   // first message only, echoed, then the connection carries mux frames (mux.h)
+    REPL_STATUS, // reply maxDonations[] = replication sequence number, lag in us, peers (repl.h)
+    FOLD_TOTAL,  // partitions only (part.h), donation.amount = a donor's whole total to fold
+                 // into the top 3, echoed
+    NOT_MODIFIED = 0xFE,
+};
+
+/*
+ * Conditional reads. If the version (the charity's for CINFO, the global one
+ * for TOP and STATS) still equals the one in the request, the reply is the
+ * single byte NOT_MODIFIED. Otherwise it is the CINFO/TOP/STATS reply, with
+ * the request type, followed by the current u64 version. Send 0 the first
+ * time.
+ */
+
+#define MAX_TOP_DONORS 16
+
+// TOP_DONORS payload entry, highest total first
+typedef struct {
+    uint64_t donor;
+    uint64_t total;
+} donor_total_t;
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef QOS_H
+#define QOS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "core.h"
+#include "protocol_ext.h"
+
+/*
+ * Quality of service under overload (-q TARGET_US[/SLOTS]). Requests fall
+ * into three classes: donor (DONATE, LOGIN, LOGOUT, FOLD_TOTAL), admin
+ * (REPL_STATUS, MUX_HELLO) and observer (every read). At most SLOTS requests
+ * are served at once; when they are all taken a request waits in its class's
+ * own queue, and a freed slot goes to the next class by smooth weighted
+ * round-robin (QOS_WEIGHT_*), so a donor queued behind hundreds of observers
+ * is still served within a few grants.
+ *
+ * Every QOS_TICK_MS the server checks the donor latency (from reading the
+ * request to finishing its reply) against TARGET_US. If more than 1% of the
+ * tick's donor requests, or the oldest queued donor, are over it, the level
+ * goes up one step, and it comes down one step after QOS_CALM_TICKS ticks
+ * within target. Observers absorb the whole degradation:
+ *   QOS_STALE  CINFO, TOP, STATS, CINFO_ALL and the conditional reads are
+ *              answered from a snapshot at most QOS_TICK_MS old, without
+ *              taking a slot or touching the charity locks
+ *   QOS_SHED   the other observer reads get ERROR
+ * and at any level an observer that waited QOS_OBSERVER_WAIT_MS for a slot
+ * gets ERROR. Donors and admin requests are never turned away: after
+ * QOS_MAX_WAIT_MS they are served over the limit.
+ */
+#define QOS_TICK_MS 100
+#define QOS_CALM_TICKS 10
+#define QOS_WEIGHT_DONOR 8
+#define QOS_WEIGHT_ADMIN 4
+#define QOS_WEIGHT_OBSERVER 1
+#define QOS_OBSERVER_WAIT_MS 100
+#define QOS_MAX_WAIT_MS 1000
+
+enum qos_class {
+    QOS_DONOR,
+    QOS_OBSERVER,
+    QOS_ADMIN,
+    QOS_CLASSES,
+};
+
+enum qos_level {
+    QOS_NORMAL,
+    QOS_STALE,
+    QOS_SHED,
+};
+
+typedef struct {
+    int cls;
+    bool held;          // holds a slot until qos_leave
+    uint64_t start_ns;
+} qos_ticket_t;
+
+/*
+ * @param target_us donor latency target, 0 leaves QoS off and every call
+ *                  below costs a branch
+ * @param slots requests served at once, 0 for twice the online CPUs
+ */
+void qos_init(int target_us, int slots);
+void qos_stop();
+bool qos_enabled();
+int qos_level();
+/*
+ * Coroutine sessions (MT -c) must not block their worker: a coroutine that
+ * waits for a slot queues in its class like a thread, but parks itself
+ * (coro.h: coro_self, coro_suspend, coro_wake) and is woken by the grant.
+ * Its wait times out on the tick after the deadline, up to QOS_TICK_MS late.
+ */
+void qos_set_coroutines(void* (*self)(), void (*suspend)(), void (*wake)(void*));
+
+int qos_class_of(uint8_t msgtype);
+
+/*
+ * Wait for a slot for the request. @return false if it is to get ERROR
+ * (observers only), otherwise qos_leave once it is answered.
+ */
+bool qos_enter(qos_ticket_t* t, uint8_t msgtype);
+void qos_leave(qos_ticket_t* t);
+
+/*
+ * From QOS_STALE on, encode the reply to a cacheable observer read into
+ * buf, at least QOS_REPLY_MAX bytes. @return bytes to send, 0 when it has
+ * to be served live (level, type or charity index out of range)
+ */
+#define QOS_REPLY_MAX CINFO_ALL_REPLY_MAX
+size_t qos_cached_reply(const message_t* req, char* buf);
+
+// One line per class: served, queued, over target, cached, rejected
+void qos_print_stats();
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef RATE_H
+#define RATE_H
+
+#include <stdint.h>
+
+/*
+ * Sliding-window donation rates per charity. Every charity has a ring of
+ * one-second buckets in each of RATE_SHARDS shards; a donation is a single
+ * atomic add into the current second's bucket of the calling thread's shard,
+ * so threads donating to the same charity do not bounce one cache line, and
+ * a query sums the window over all shards without stopping writers. Buckets
+ * are zeroed a few seconds ahead of use by rate_advance(), which must run at
+ * least every RATE_TICK_MS.
+ */
+#define RATE_SLOTS 4096  // power of 2, more than the longest window plus the clear-ahead
+#define RATE_SHARDS 8    // power of 2, threads beyond it share shards round-robin
+#define RATE_CLEAR_AHEAD 3
+#define RATE_TICK_MS 500
+
+enum rate_windows {
+    RATE_1M,
+    RATE_5M,
+    RATE_1H,
+    RATE_WINDOWS
+};
+
+void rate_init();
+void rate_record(int charity, uint64_t amount);
+// Donated amount in the last minute, 5 minutes and hour, indexed by rate_windows
+void rate_query(int charity, uint64_t out[RATE_WINDOWS]);
+void rate_advance();
+
+#endif
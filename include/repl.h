@@ -0,0 +1,83 @@
+#ifndef REPL_H
+#define REPL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "core.h"
+
+/*
+ * Log shipping to read replicas. On the primary (-R PORT) every applied
+ * DONATE and every LOGOUT that folds a total into the top 3 is journaled by
+ * the thread that made it into a bounded MPSC ring, which orders it and
+ * gives it a sequence number. A shipper thread drains the ring every
+ * REPL_TICK_MS, applies each batch to a shadow copy of the charities and
+ * the top 3, keeps the last REPL_HISTORY records and sends the batch to
+ * every follower. Donors only pay for one atomic add and a slot write.
+ *
+ * A follower (-F HOST:PORT) says which primary epoch and sequence it has
+ * applied. It is answered with the missing records from the history, or, if
+ * they are gone or it is new, with the shadow state and its sequence number
+ * followed by the stream. The follower replays records through
+ * core_donate/core_logout, so every read (CINFO, TOP, STATS, CINFO_ALL,
+ * conditional reads, SUBSCRIBE) works unchanged, and refuses DONATE and
+ * LOGIN. A snapshot is only loaded before the follower accepts clients; a
+ * follower that falls off the history later hot-restarts itself (SIGUSR2)
+ * to load a fresh one.
+ *
+ * Wire format, host byte order: the follower sends a repl_hello_t, then the
+ * primary sends messages of a repl_header_t followed by a core_snapshot_t
+ * (REPL_SNAPSHOT) or by count repl_record_t (REPL_BATCH). An empty batch
+ * is a heartbeat.
+ */
+#define REPL_JOURNAL_SLOTS (1 << 16)  // power of 2, donors wait when it is full
+#define REPL_HISTORY (1 << 18)        // records kept for followers that reconnect
+#define REPL_BATCH_MAX 4096
+#define REPL_TICK_MS 5
+#define REPL_HEARTBEAT_MS 100
+#define REPL_TIMEOUT_MS 1000          // follower gives up on a silent primary
+#define REPL_RETRY_MS 500
+#define REPL_MAX_BACKLOG (16 << 20)   // bytes queued to one follower before it is dropped
+
+enum repl_kind {
+    REPL_SNAPSHOT = 1,
+    REPL_BATCH,
+};
+
+typedef struct {
+    uint64_t epoch;  // primary incarnation the follower's state comes from, 0 if none
+    uint64_t seq;    // last record applied
+} repl_hello_t;
+
+typedef struct {
+    uint32_t kind;
+    uint32_t count;    // records after a batch
+    uint64_t epoch;
+    uint64_t seq;      // batch: its first record, snapshot: the last record it includes
+    uint64_t sent_ns;  // primary CLOCK_REALTIME, for the lag
+} repl_header_t;
+
+typedef struct {
+    uint8_t type;     // DONATE or LOGOUT
+    uint8_t charity;
+    uint64_t amount;  // LOGOUT: the connection's donation total
+    uint64_t source;  // DONATE: SKETCH_SOURCE
+} repl_record_t;
+
+// Quiescent (before accepting, after draining)
+void repl_primary_start(int port);
+void repl_primary_stop();
+// Blocks until the primary's state is loaded, exits if it can not be reached
+void repl_follow_start(const char* primary);
+void repl_follow_stop();
+bool repl_is_follower();
+
+/*
+ * REPL_STATUS reply in msg->msgdata.maxDonations: last sequence number
+ * shipped (primary) or applied (follower), how many us the last batch took
+ * from the primary to being applied, connected followers (primary) or 1
+ * while connected to the primary (follower).
+ */
+void repl_status_reply(message_t* msg);
+
+#endif
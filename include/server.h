@@ -14,17 +14,53 @@
 
 #define SA struct sockaddr
 
-#define USAGE_MSG_MT "ZotDonation_MTserver [-h] PORT_NUMBER LOG_FILENAME"\
+#define USAGE_MSG_LIMITS \
+                  "\n  -m MAX_CONNS       Refuse clients with ERROR beyond MAX_CONNS concurrent connections."\
+                  "\n  -r RATE            Max messages/sec per connection (per session when multiplexed), excess messages get ERROR."\
+                  "\n  -i RATE            Max messages/sec per source address, excess messages get ERROR."\
+                  "\n  -t IDLE_SECS       Log out clients that send nothing for IDLE_SECS seconds."\
+                  "\n  -T REQUEST_SECS    Log out clients whose request is not answered within REQUEST_SECS seconds."\
+                  "\n  -d DRAIN_SECS      On SIGINT/SIGTERM/SIGUSR2, wait up to DRAIN_SECS for in-flight requests (default 5)."\
+                  "\n                     SIGUSR2 restarts the server binary and hands it the listening sockets and state;"\
+                  "\n                     new clients wait in the backlog until the drain ends (at most DRAIN_SECS + 2)."\
+                  "\n  -s STRATEGY        Synchronization of the charity state: global, charity, rwlock, rwpref,"\
+                  "\n                     atomic, sharded or owner (MT default charity, RW default rwpref)."\
+                  "\n  -R REPL_PORT       Ship applied donations to read replicas connecting on REPL_PORT."\
+                  "\n  -F HOST:PORT       Run as a read replica of the primary at HOST:PORT, donations get ERROR."\
+                  "\n  -S NAME            Publish the state to the read-only stats page /dev/shm/NAME (ZotDonate_stat NAME)."\
+                  "\n  -H HOURS           Keep HOURS of donation history for HISTORY requests (off by default, HISTORY gets ERROR)."\
+                  "\n  -o PROFILE         Socket tuning: default, latency or throughput (see include/socktune.h)."\
+                  "\n  -q TARGET_US[/SLOTS] Serve SLOTS requests at once (default 2 per CPU), donors first; when donor"\
+                  "\n                     latency passes TARGET_US, answer reads from a snapshot, then refuse them (see include/qos.h)."
+
+#define USAGE_MSG_MT "ZotDonation_MTserver [-h] [-c NUM_WORKERS] [-m MAX_CONNS] [-r RATE] [-i RATE] [-t IDLE_SECS] [-T REQUEST_SECS] [-d DRAIN_SECS] [-s STRATEGY] [-R REPL_PORT] [-F HOST:PORT] [-S NAME] [-H HOURS] [-o PROFILE] [-q TARGET_US[/SLOTS]] [-P IDX/N] [-p PROCS] [-N] [-u SOCKET_PATH [-b SPINS]] PORT_NUMBER LOG_FILENAME"\
                   "\n  -h                 Displays this help menu and returns EXIT_SUCCESS."\
+                  "\n  -c NUM_WORKERS     Run client sessions as coroutines over NUM_WORKERS threads."\
+                  USAGE_MSG_LIMITS\
+                  "\n  -P IDX/N           Partition IDX of N, own only the charities in that hash range (behind ZotDonate_proxy)."\
+                  "\n  -p PROCS           Prefork PROCS worker processes that share the charity state, restarted when they crash"\
+                  "\n                     (atomic strategy, not with -R, -F, -u or -H; RATE, SKETCH and TOP_DONORS get ERROR)."\
+                  "\n  -N                 NUMA-aware: pin sessions and workers to the node that received the connection,"\
+                  "\n                     keep the counter shards node-local (default strategy sharded)."\
+                  "\n  -u SOCKET_PATH     Also accept clients on this host at a Unix socket, served over shared-memory rings."\
+                  "\n  -b SPINS           Busy-poll a local client's ring SPINS times before sleeping (default 2000, 0 on one CPU)."\
                   "\n  PORT_NUMBER        Port number to listen on."\
                   "\n  LOG_FILENAME       File to output server actions into. Create/overwrite, if exists\n"
 
-#define USAGE_MSG_RW "ZotDonation_RWserver [-h] R_PORT_NUMBER W_PORT_NUMBER LOG_FILENAME"\
+#define USAGE_MSG_RW "ZotDonation_RWserver [-h] [-m MAX_CONNS] [-r RATE] [-i RATE] [-t IDLE_SECS] [-T REQUEST_SECS] [-d DRAIN_SECS] [-s STRATEGY] [-R REPL_PORT] [-F HOST:PORT] [-S NAME] [-H HOURS] [-o PROFILE] [-q TARGET_US[/SLOTS]] R_PORT_NUMBER W_PORT_NUMBER LOG_FILENAME"\
                   "\n  -h                 Displays this help menu and returns EXIT_SUCCESS."\
+                  USAGE_MSG_LIMITS\
                   "\n  R_PORT_NUMBER      Port number to listen on for reader (observer) clients."\
                   "\n  W_PORT_NUMBER      Port number to listen on for writer (donor) clients."\
                   "\n  LOG_FILENAME       File to output server actions into. Create/overwrite, if exists\n"
 
+// Handed to a client handler, freed by the handler
+typedef struct {
+    int fd;
+    struct sockaddr_in addr;
+    struct shm_conn* shm;  // local transport (shmring.h), NULL for TCP
+} client_info_t;
+
 int socket_listen_init(int server_port);
 
 
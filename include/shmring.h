@@ -0,0 +1,72 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "core.h"
+
+/*
+ * Local transport for clients on the same host. The client connects to a
+ * Unix-domain socket; the server answers with a memfd holding two SPSC byte
+ * rings (requests in, replies out) and one eventfd per side, passed with
+ * SCM_RIGHTS. After that no syscall is needed while the peer keeps up: each
+ * side busy-polls its ring for a while, then flags itself as waiting and
+ * sleeps on its eventfd, which the other side only writes to when the flag
+ * is set. The socket stays open as the liveness channel, closing or
+ * shutting it down ends the session just like a TCP disconnect.
+ *
+ * The rings carry the same byte stream as a TCP connection (message_t
+ * requests, variable-length replies, mux frames), so the server dispatch is
+ * unchanged.
+ */
+#define SHM_RING_BYTES (64 * 1024)  // power of 2
+#define SHM_DEFAULT_SPIN 2000      // empty polls before sleeping
+
+typedef struct {
+    uint64_t head __attribute__((aligned(CACHE_LINE)));  // bytes written, producer only
+    uint64_t tail __attribute__((aligned(CACHE_LINE)));  // bytes read, consumer only
+    char data[SHM_RING_BYTES] __attribute__((aligned(CACHE_LINE)));
+} shm_ring_t;
+
+typedef struct {
+    shm_ring_t requests;  // client -> server
+    shm_ring_t replies;   // server -> client
+    int server_waiting __attribute__((aligned(CACHE_LINE)));
+    int client_waiting __attribute__((aligned(CACHE_LINE)));
+} shm_region_t;
+
+typedef struct shm_conn {
+    shm_region_t* region;
+    shm_ring_t* in;
+    shm_ring_t* out;
+    int* my_waiting;
+    int* peer_waiting;
+    int my_efd;
+    int peer_efd;
+    int sock;  // the Unix socket, session fd for timers and the registry
+    int spin;
+} shm_conn_t;
+
+// SHM_DEFAULT_SPIN, or 0 on a single CPU where spinning only delays the peer
+int shm_default_spin();
+
+// Listening Unix socket at path, replacing a stale one. -1 on failure.
+int shm_listen(const char* path);
+// Server side handshake. NULL if accept or the handshake failed.
+shm_conn_t* shm_accept(int listen_fd, int spin);
+// Client side handshake. NULL on failure.
+shm_conn_t* shm_connect(const char* path, int spin);
+
+/*
+ * Same contract as read()/write() on a blocking socket: shm_read returns
+ * at least 1 byte, 0 once the peer is gone; shm_write writes everything or
+ * returns -1 once the peer is gone.
+ */
+ssize_t shm_read(shm_conn_t* c, void* buf, size_t len);
+ssize_t shm_write(shm_conn_t* c, const void* buf, size_t len);
+// Unmaps the rings and closes every fd, including sock
+void shm_close(shm_conn_t* c);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdint.h>
+
+#include "protocol_ext.h"
+
+/*
+ * Constant-memory summaries per charity:
+ *  - distinct donors, HyperLogLog with 2^SKETCH_HLL_BITS registers (about
+ *    1.6% standard error, Flajolet et al.)
+ *  - amount quantiles, DDSketch with SKETCH_DD_ALPHA relative accuracy
+ *    (Masson et al.)
+ * Every donating thread updates its own copy without locking (threads past
+ * SKETCH_MAX_THREADS share one under a mutex). A query merges all copies;
+ * a thread's copy is folded into a retired one when the thread exits.
+ */
+#define SKETCH_HLL_BITS 12
+#define SKETCH_DD_ALPHA 0.01
+#define SKETCH_MAX_THREADS 64
+
+void sketch_init();
+void sketch_destroy();
+// Distinct-count key: the LOGIN donor id, or the client address when anonymous
+#define SKETCH_SOURCE(donor, addr) ((donor) ? (donor) : (1ull << 63) | (addr))
+
+void sketch_record(int charity, uint64_t source, uint64_t amount);
+
+typedef struct {
+    uint64_t distinct;  // estimated distinct sources
+    uint64_t quantile;  // amount at the requested quantile, within SKETCH_DD_ALPHA
+    uint64_t count;     // donations seen
+} sketch_result_t;
+
+// @param permille quantile in thousandths, 500 is the median
+void sketch_query(int charity, int permille, sketch_result_t* out);
+
+#endif
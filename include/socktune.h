@@ -0,0 +1,59 @@
+#ifndef SOCKTUNE_H
+#define SOCKTUNE_H
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+/*
+ * Socket tuning profiles (-o PROFILE), applied to the listeners and every
+ * accepted client socket:
+ *   default     nothing beyond SO_REUSEPORT, as before
+ *   latency     TCP_NODELAY so a 32-byte reply is not held back by Nagle,
+ *               TCP_QUICKACK re-armed after every read, SO_BUSY_POLL on
+ *               client sockets and busy-polling coroutine workers
+ *   throughput  Nagle left on, so pipelined replies share segments (every
+ *               reply is one write, none waits behind a partial one),
+ *               TCP_DEFER_ACCEPT, 1 MiB socket buffers, a deep backlog
+ *
+ * Both tuned profiles also steer connections in the kernel when sessions
+ * run on coroutine workers: every worker gets its own listener in one
+ * SO_REUSEPORT group, and a classic BPF program attached to the group picks
+ * listener (receiving CPU % workers). Worker i is pinned to CPU i, so a
+ * connection is served on the CPU that took its packets.
+ */
+typedef struct {
+    const char* name;
+    bool nodelay;
+    bool quickack;          // the kernel clears it, so it is set again after every read
+    int defer_accept_secs;  // accept() only once the first request arrived
+    int busy_poll_us;       // SO_BUSY_POLL and coroutine worker spinning, 0 off
+    int buf_bytes;          // SO_RCVBUF/SO_SNDBUF, 0 leaves the kernel's autotuning
+    int backlog;            // 0 keeps the server's own
+    bool steer;
+} sock_profile_t;
+
+extern const sock_profile_t* sock_profile;
+
+// @return 0, or -1 for an unknown name
+int socktune_select(const char* name);
+// Between socket() and listen(); options set here are inherited by accepted sockets
+void socktune_listener(int fd);
+int socktune_backlog(int fallback);
+// How long an idle coroutine worker spins, 0 on a single CPU
+int socktune_worker_spin_us();
+void socktune_client(int fd);
+void socktune_after_read(int fd);
+
+/*
+ * Attach the CPU steering program to the reuseport group of fds, which
+ * must have been bound in this order, and make them non-blocking.
+ * @return 0, -1 if the kernel refused
+ */
+int socktune_steer(const int* fds, int n);
+/*
+ * accept() on whichever of fds has a connection waiting, its index in *which.
+ * @return like accept(), -1 with EINTR when a signal came first
+ */
+int socktune_accept(const int* fds, int n, int* which, struct sockaddr* addr, socklen_t* addr_len);
+
+#endif
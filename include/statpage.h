@@ -0,0 +1,46 @@
+#ifndef STATPAGE_H
+#define STATPAGE_H
+
+#include <stdint.h>
+
+#include "core.h"
+#include "rate.h"
+
+/*
+ * Stats page for monitoring agents (-S NAME). The server publishes the
+ * charities, the top 3 and live counters into /dev/shm/NAME, which agents
+ * map read-only (ZotDonate_stat), so watching the server takes no
+ * connection, no lock and no log line.
+ *
+ * A timer on the wheel republishes every STATPAGE_TICK_MS: it rereads only
+ * the charities whose change counter moved and the top 3 when anything did,
+ * then copies the page under a seqlock. Readers retry while seq is odd or
+ * changed under them, the server never waits for a reader.
+ */
+#define STATPAGE_MAGIC 0x3145474154535a5aull  // set once the first copy is in
+#define STATPAGE_TICK_MS 100
+
+typedef struct {
+    uint64_t magic;
+    uint64_t seq;         // odd while the server is writing
+    int32_t pid;
+    int32_t sessions;     // open sessions of the publishing process
+    int32_t clientCnt;    // connections accepted since start
+    int32_t pad;
+    char strategy[16];
+    uint64_t started_ns;  // CLOCK_REALTIME
+    uint64_t updated_ns;  // last time anything changed
+    uint64_t updates;     // publishes that changed something
+    uint64_t version;     // core_version_all()
+    charity_t charities[NUM_CHARITIES];
+    uint64_t maxDonations[3];
+    // Donated in the last minute, 5 minutes, hour, as seen by the publishing process
+    uint64_t rates[NUM_CHARITIES][RATE_WINDOWS];
+} statpage_t;
+
+// Create /dev/shm/NAME and publish until statpage_stop, which unlinks it
+// unless the page is handed to a restarted process
+void statpage_start(const char* name);
+void statpage_stop(int unlink_page);
+
+#endif
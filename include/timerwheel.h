@@ -0,0 +1,79 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Hierarchical timing wheel (Varghese & Lauck). TW_LEVELS wheels of
+ * TW_SLOTS slots each; level 0 advances every TW_TICK_MS and every higher
+ * level covers TW_SLOTS times the span of the one below. Arming, re-arming
+ * and cancelling a timer are O(1); timers are cascaded down a level when
+ * their slot comes up.
+ *
+ * Callbacks run on the wheel thread without the wheel lock, so a slow one
+ * (a stats snapshot) only delays later timers, never tw_arm() callers.
+ * tw_cancel() waits for a running callback of its timer, so once it returns
+ * the callback is guaranteed not to be running. A callback may arm other
+ * timers but must not cancel its own; returning a non-zero number of ms
+ * re-arms the timer unless it was armed again while the callback ran.
+ */
+#define TW_TICK_MS 100
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1 << TW_SLOT_BITS)
+#define TW_LEVELS 4
+
+typedef struct tw_timer tw_timer_t;
+typedef uint64_t (*tw_callback)(tw_timer_t*);
+
+struct tw_timer {
+    tw_timer_t* next;
+    tw_timer_t* prev;
+    uint64_t expires;  // absolute tick
+    tw_callback cb;
+    void* data;
+    bool pending;
+};
+
+// Starts the wheel thread, later calls are no-ops until tw_shutdown()
+void tw_init();
+void tw_shutdown();
+void tw_timer_init(tw_timer_t* t, tw_callback cb, void* data);
+void tw_arm(tw_timer_t* t, uint64_t ms);
+void tw_cancel(tw_timer_t* t);
+
+/*
+ * Client session timeouts on top of the wheel. The idle timeout bounds the
+ * wait for the next request, the request timeout bounds the time from reading
+ * a request to finishing its reply. On expiry the socket is shut down, which
+ * wakes the handler out of read()/write() so it can close the session.
+ *
+ * Moving the deadline, twice per request, only stores it: the timer is linked
+ * into the wheel once and, when it comes due, re-armed for whatever is left
+ * of the current deadline. Only a session that had no deadline armed, and
+ * conn_timer_stop, take the wheel lock.
+ */
+typedef struct {
+    tw_timer_t timer;
+    int fd;
+    atomic_bool expired;
+    atomic_ullong deadline;  // monotonic ms, 0 for none
+    atomic_bool armed;       // linked into the wheel, or about to be re-armed by it
+} conn_timer_t;
+
+// 0 disables the corresponding timeout
+void conn_timeouts_init(uint64_t idle_ms, uint64_t request_ms);
+void conn_timeouts_shutdown();
+
+void conn_timer_init(conn_timer_t* ct, int fd);
+void conn_timer_idle(conn_timer_t* ct);
+void conn_timer_request(conn_timer_t* ct);
+// Unlinks the timer, required before ct goes away
+void conn_timer_stop(conn_timer_t* ct);
+bool conn_timer_expired(conn_timer_t* ct);
+
+// Zero the sliding-window rate buckets ahead of time, every RATE_TICK_MS (see rate.h)
+void rate_timer_start();
+
+#endif
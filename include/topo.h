@@ -0,0 +1,39 @@
+#ifndef TOPO_H
+#define TOPO_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Machine topology for the NUMA-aware mode (-N). Nodes and their CPUs come
+ * from /sys/devices/system/node. Memory is placed with mbind(2) called
+ * directly, so there is no libnuma dependency; where that fails the pages
+ * still land on the node of the pinned thread that touches them first.
+ * Until topo_init() (or on a machine without sysfs) there is one node,
+ * pinning does nothing and topo_alloc() is a plain zeroed mapping.
+ *
+ * Nodes are numbered 0..topo_nodes()-1 in the order of their kernel ids,
+ * which may have gaps (offlined or absent nodes); only the memory policy
+ * sees the kernel id. Ids from TOPO_MAX_NODES on are ignored.
+ */
+#define TOPO_MAX_NODES 64
+
+// Read the topology and turn the mode on. @return number of nodes
+int topo_init();
+bool topo_enabled();
+int topo_nodes();
+// 0 for a CPU that is not listed
+int topo_node_of_cpu(int cpu);
+int topo_current_node();
+int topo_cpus_on_node(int node);
+
+// Keep the calling thread, or the thread attr is used for, on node's CPUs
+void topo_pin_self(int node);
+void topo_pin_attr(pthread_attr_t* attr, int node);
+
+// Zeroed, page-aligned memory on node. NULL on failure
+void* topo_alloc(size_t size, int node);
+void topo_free(void* p, size_t size);
+
+#endif
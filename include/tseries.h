@@ -0,0 +1,52 @@
+#ifndef TSERIES_H
+#define TSERIES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol_ext.h"
+
+/*
+ * Donation history per charity, compressed in memory (Pelkonen et al.,
+ * "Gorilla: A Fast, Scalable, In-Memory Time Series Database"). Every
+ * donation is a (ms timestamp, amount) point appended to the charity's open
+ * chunk: the timestamp as a delta-of-delta in a 1 to 68 bit code, the amount
+ * XORed with the previous one and stored as its meaningful bits only. A full
+ * chunk is sealed and never changes again, so queries pin the sealed chunks
+ * that overlap the requested range and decode them without holding the
+ * charity's lock.
+ *
+ * History is off unless the server was started with -H HOURS: a DONATE then
+ * costs no clock read or lock here and HISTORY gets ERROR. With it on,
+ * ts_trim() (on the rate tick) drops the sealed chunks older than HOURS; one
+ * a query still has pinned is freed by that query when it is done.
+ */
+#define TS_CHUNK_BYTES 1024
+#define HISTORY_MAX_BUCKETS 1024
+
+void ts_init();
+void ts_destroy();
+// @param hours retention, 0 turns history off
+void ts_enable(int hours);
+bool ts_enabled();
+void ts_append(int charity, uint64_t ms, uint64_t amount);
+// Free the chunks past the retention, one caller at a time
+void ts_trim();
+
+/*
+ * Sum the amounts donated to charity in [from_ms, from_ms + n * width_ms),
+ * one total per width_ms bucket.
+ */
+void ts_query(int charity, uint64_t from_ms, uint64_t width_ms, uint64_t* out, int n);
+// Bytes of chunk memory in use, all charities
+size_t ts_memory();
+
+/*
+ * Encode the variable-length reply to a HISTORY request.
+ * @param buf set to a malloc'd buffer on success
+ * @return bytes to send, 0 for a malformed request
+ */
+size_t ts_history_reply(const message_t* req, char** buf);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Small pieces shared by the servers, the proxy and the core library, built
+ * into libzotcore.
+ */
+
+/*
+ * Block the shutdown/restart signals in threads created after this call so
+ * they are delivered to the accept loop. Restore with the returned mask.
+ */
+void block_server_signals(sigset_t* old);
+void restore_signals(const sigset_t* old);
+// pthread_create with those signals blocked, exits naming what on failure
+void spawn_thread(pthread_t* tid, void* (*fn)(void*), void* arg, const char* what);
+
+// Whole buffers over a socket (no SIGPIPE). @return 0, -1 on error or EOF
+int write_all(int fd, const void* buf, size_t len);
+int read_all(int fd, void* buf, size_t len);
+
+// CLOCK_REALTIME in ns, comparable across processes and hosts
+uint64_t wall_ns();
+
+#endif
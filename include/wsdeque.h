@@ -0,0 +1,39 @@
+#ifndef WSDEQUE_H
+#define WSDEQUE_H
+
+#include <stdatomic.h>
+
+/*
+ * Chase-Lev work-stealing deque (Le et al., "Correct and Efficient
+ * Work-Stealing for Weak Memory Models"). The owning thread pushes and takes
+ * at the bottom, any other thread may steal from the top. The backing array
+ * grows on demand; retired arrays are kept until ws_deque_destroy().
+ */
+typedef struct ws_array {
+    long size;              // always a power of 2
+    struct ws_array* prev;  // retired array chain
+    _Atomic(void*) buf[];
+} ws_array_t;
+
+typedef struct {
+    atomic_long top;
+    atomic_long bottom;
+    _Atomic(ws_array_t*) array;
+} ws_deque_t;
+
+// Returned by ws_steal() when it lost a race, the caller may retry
+#define WS_ABORT ((void*) 1)
+
+void ws_deque_init(ws_deque_t* q, long size);
+void ws_deque_destroy(ws_deque_t* q);
+
+// Owner only
+void ws_push(ws_deque_t* q, void* x);
+void* ws_take(ws_deque_t* q);
+
+// Any thread, NULL when empty
+void* ws_steal(ws_deque_t* q);
+
+long ws_size(ws_deque_t* q);
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef ZCLIENT_H
+#define ZCLIENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+#include "protocol_ext.h"
+
+/*
+ * Client library for both servers. A connection keeps many requests in
+ * flight: zc_submit only queues a request with its completion callback,
+ * zc_poll writes everything queued in as few sends as possible, reads
+ * whatever replies have arrived and runs their callbacks. The servers answer
+ * a connection's requests in order, so replies are matched to a FIFO of the
+ * pending requests, and the reply shape (fixed, variable-length or
+ * conditional) follows from the request type.
+ *
+ * Nothing blocks except zc_connect and zc_poll/zc_drain with a timeout, so a
+ * connection also fits in the caller's own poll loop through zc_fd and
+ * zc_events. A pool spreads requests over several connections to use more
+ * than one server thread; TOP counts donations per connection, donors that
+ * use a pool should LOGIN on every connection and read TOP_DONORS instead.
+ *
+ * SUBSCRIBE turns a connection into a one-way feed and is not supported.
+ */
+#define ZC_MAX_INFLIGHT 4096  // per connection
+
+#define ZC_MUX 1  // zc_connect flag: MUX_HELLO first, requests carry a session id (mux.h)
+
+enum zc_status {
+    ZC_OK,
+    ZC_EDISCONNECTED,  // the connection dropped before the reply came
+};
+
+typedef struct {
+    int status;
+    uint32_t session;     // mux session id, 0 on plain connections
+    message_t msg;        // the reply, msgtype ERROR or NOT_MODIFIED included
+    uint64_t version;     // *_IF_CHANGED replies other than NOT_MODIFIED
+    const void* payload;  // variable-length replies, only valid during the callback
+    size_t payload_len;
+} zc_reply_t;
+
+typedef void (*zc_done_fn)(const zc_reply_t* reply, void* arg);
+
+typedef struct {
+    uint8_t type;
+    uint32_t session;
+    zc_done_fn done;
+    void* arg;
+} zc_pending_t;
+
+typedef struct {
+    int fd;
+    bool mux;
+    bool broken;
+    char* out;  // queued requests, sent from out_off
+    size_t out_len, out_off, out_cap;
+    char* in;   // received bytes not yet matched to a request
+    size_t in_len, in_cap;
+    zc_pending_t pending[ZC_MAX_INFLIGHT];  // FIFO ring
+    uint32_t head, count;
+} zc_conn_t;
+
+// Blocking connect to host:port. NULL on failure.
+zc_conn_t* zc_connect(const char* host, int port, int flags);
+// Fails every request still pending with ZC_EDISCONNECTED, then frees c
+void zc_close(zc_conn_t* c);
+
+/*
+ * Queue a request, done(reply, arg) runs from a later zc_poll. done may be
+ * NULL, it may submit more requests but not poll or close. @return 0, or -1
+ * if the connection is broken, ZC_MAX_INFLIGHT requests are pending or the
+ * type is not supported.
+ */
+int zc_submit(zc_conn_t* c, const message_t* req, zc_done_fn done, void* arg);
+// Same on a ZC_MUX connection, for the given session
+int zc_submit_session(zc_conn_t* c, uint32_t session, const message_t* req, zc_done_fn done, void* arg);
+
+int zc_fd(const zc_conn_t* c);
+// poll() events to wait for: POLLIN, plus POLLOUT while requests are unsent
+short zc_events(const zc_conn_t* c);
+int zc_inflight(const zc_conn_t* c);
+
+/*
+ * Send, wait up to timeout_ms (-1 forever, 0 not at all) for replies and run
+ * their callbacks. @return how many completed, -1 if the connection was
+ * already broken. When it breaks, whatever is still pending completes with
+ * ZC_EDISCONNECTED (a LOGOUT the server answered by closing with ZC_OK).
+ */
+int zc_poll(zc_conn_t* c, int timeout_ms);
+// Same, for revents the caller's own poll() returned for zc_fd/zc_events
+int zc_service(zc_conn_t* c, short revents);
+// Poll until nothing is in flight. @return -1 if the connection broke first
+int zc_drain(zc_conn_t* c);
+
+/*
+ * A fixed set of connections to one server. Requests go to the connection
+ * with the fewest in flight, a broken connection is reopened on next use.
+ */
+typedef struct {
+    zc_conn_t** conns;
+    int size;
+    char* host;
+    int port;
+    int flags;
+} zc_pool_t;
+
+// NULL if not even one connection could be opened
+zc_pool_t* zc_pool_open(const char* host, int port, int size, int flags);
+void zc_pool_close(zc_pool_t* p);
+// The least loaded live connection, NULL if none can be opened
+zc_conn_t* zc_pool_pick(zc_pool_t* p);
+int zc_pool_submit(zc_pool_t* p, const message_t* req, zc_done_fn done, void* arg);
+// zc_poll over every connection at once. @return how many completed
+int zc_pool_poll(zc_pool_t* p, int timeout_ms);
+int zc_pool_inflight(const zc_pool_t* p);
+void zc_pool_drain(zc_pool_t* p);
+
+#endif
@@ -5,6 +5,23 @@
 #include <signal.h>
 
 #include "MThelpers.h"
+#include "socktune.h"
+#include "coro.h"
+#include "admission.h"
+#include "timerwheel.h"
+#include "lifecycle.h"
+#include "core.h"
+#include "donormap.h"
+#include "rate.h"
+#include "tseries.h"
+#include "sketch.h"
+#include "feed.h"
+#include "mux.h"
+#include "shmring.h"
+#include "repl.h"
+#include "part.h"
+#include "qos.h"
+#include "prefork.h"
 
 // for dlist
 void EmptyDeleter() {}
@@ -14,24 +31,21 @@ void sigint_handler(int sig) {
 }
 
 // void init_server(const char* log_filename, dlist_t* list) {
-void init_server(const char* log_filename) {
-    clientCnt = 0;
-    for (int i = 0; i < 3; i++) {
-        maxDonations[i] = 0;
-    }
-    pthread_mutex_init(&mt_stats_lock, NULL);
+// Session whose request is being handled: kept with the coroutine under -c,
+// which may resume on another thread, else with the thread
+static __thread core_mark_t* thread_mark;
 
-    for (int i = 0; i < 5; i++) {
-        charities[i].numDonations = 0;
-        charities[i].totalDonationAmt = 0;
-        charities[i].topDonation = 0;
-        if (pthread_mutex_init(&charity_locks[i], NULL)) {
-            printf("mutex init err\n");
-            exit(EXIT_FAILURE);
-        }
-    }
+static core_mark_t** session_mark() {
+    void** local = coro_local();
+    return local ? (core_mark_t**) local : &thread_mark;
+}
+
+static core_mark_t* current_mark() {
+    return *session_mark();
+}
 
-    log_file = fopen(log_filename, "w");
+void init_server(const char* log_filename) {
+    log_file = fopen(log_filename, restarted ? "a" : "w");
     if (log_file == NULL) {
         printf("log fopen err\n");
         exit(EXIT_FAILURE);
@@ -39,14 +53,11 @@ void init_server(const char* log_filename) {
     pthread_mutex_init(&log_file_lock, NULL);
 
     list = CreateList(NULL, NULL, EmptyDeleter);
+    core_set_mark_hook(current_mark);
 }
 
 void cleanup_server() {
     fclose(log_file);
-    pthread_mutex_destroy(&mt_stats_lock);
-    for (int i = 0; i < 5; i++) {
-        pthread_mutex_destroy(&charity_locks[i]);
-    }
     pthread_mutex_destroy(&log_file_lock);
 }
 
@@ -87,114 +98,502 @@ void kill_and_join_all_threads() {
     }
 }
 
-void print_stats() {
-	for (int i = 0; i < 5; i++) {
-        printf("%d, %u, %lu, %lu\n", i, charities[i].numDonations, charities[i].topDonation, charities[i].totalDonationAmt);
+typedef struct {
+    int fd;           // the TCP socket, or the Unix socket of a shm session
+    uint32_t ip;
+    shm_conn_t* shm;  // requests and replies go through shared-memory rings
+    bool mux;         // after MUX_HELLO, requests and replies are framed with a session id
+    bool subscribed;  // SUBSCRIBE, the feed owns the write side
+    conn_timer_t timer;
+} client_conn_t;
+
+static ssize_t conn_read(client_conn_t* c, void* buf, size_t len) {
+    return c->shm ? shm_read(c->shm, buf, len) : coro_read(c->fd, buf, len);
+}
+
+static ssize_t conn_write(client_conn_t* c, const void* buf, size_t len) {
+    return c->shm ? shm_write(c->shm, buf, len) : coro_write(c->fd, buf, len);
+}
+
+static void conn_close(client_conn_t* c) {
+    if (c->shm) {
+        shm_close(c->shm);
+    } else {
+        close(c->fd);
     }
-    fprintf(stderr, "%d\n%lu, %lu, %lu\n", clientCnt, maxDonations[0], maxDonations[1], maxDonations[2]);
 }
 
-// 
-void* client_handler(void* vargp) {
-    int client_fd = *((int*) vargp);
-    free(vargp);
+// Reply to session s, prefixed with its id on a mux connection
+static void reply(client_conn_t* c, const session_t* s, const void* buf, size_t len) {
+    if (!c->mux) {
+        conn_write(c, buf, len);
+        return;
+    }
+    char frame[MUX_ID_BYTES + CINFO_ALL_REPLY_MAX];
+    if (len <= CINFO_ALL_REPLY_MAX) {
+        // One write, the common case
+        memcpy(frame, &s->id, MUX_ID_BYTES);
+        memcpy(frame + MUX_ID_BYTES, buf, len);
+        conn_write(c, frame, MUX_ID_BYTES + len);
+    } else {
+        conn_write(c, &s->id, MUX_ID_BYTES);
+        conn_write(c, buf, len);
+    }
+}
 
+// Short reads happen once frames are pipelined
+static bool read_full(client_conn_t* c, void* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = conn_read(c, (char*) buf + done, len - done);
+        if (n <= 0) {
+            return false;
+        }
+        if (!c->shm) {
+            socktune_after_read(c->fd);
+        }
+        done += n;
+    }
+    return true;
+}
+
+static bool owned(int charity) {
+    return PART_OF(charity, part_count) == part_index;
+}
+
+// A partition's sessions are the proxy's connections, whole donor totals
+// only arrive through FOLD_TOTAL
+static void fold_session(const session_t* s) {
+    if (part_count == 1) {
+        core_logout(s->donation_total);
+    }
+}
+
+// STATS over the charities this partition owns, for the proxy to merge
+static void owned_stats(core_stats_t* out) {
+    core_snapshot_t snap;
+    core_snapshot(&snap);
+    out->charity_high = out->charity_low = 0;
+    out->amount_high = 0;
+    out->amount_low = UINT64_MAX;
+    bool first = true;
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        uint64_t total = snap.charities[i].totalDonationAmt;
+        if (!owned(i)) {
+            continue;
+        }
+        // Ties go to the lower index, like core_stats()
+        if (first || total > out->amount_high) {
+            out->amount_high = total;
+            out->charity_high = i;
+        }
+        if (first || total < out->amount_low) {
+            out->amount_low = total;
+            out->charity_low = i;
+        }
+        first = false;
+    }
+}
+
+/*
+ * Handle one request of session s.
+ * @return false once the session logged out
+ */
+static bool handle_message(client_conn_t* c, session_t* s, message_t* msg) {
+    int client_fd = c->fd;
+    int which_charity = msg->msgdata.donation.charity;
     bool error = false;
-    message_t msg;
-    uint64_t donation_total = 0;
-
-    while (read(client_fd, &msg, sizeof(message_t))) {
-    	int which_charity = msg.msgdata.donation.charity;
-        switch (msg.msgtype) {
-            case DONATE:
-                if (which_charity >= 5) {
-                    error = true;
-                } else {
-	                pthread_mutex_lock(&charity_locks[which_charity]);
-
-	                printf("donate: locked %d\n", which_charity);
-	                uint64_t amt = msg.msgdata.donation.amount;
-	                charities[which_charity].numDonations++;
-	                charities[which_charity].totalDonationAmt += amt;
-	                if (amt > charities[which_charity].topDonation) {
-	                    charities[which_charity].topDonation = amt;
-	                }
-
-	                pthread_mutex_unlock(&charity_locks[which_charity]);
-					printf("donate: unlocked %d\n", which_charity);
-
-	                donation_total += amt;
-
-	                pthread_mutex_lock(&log_file_lock);
-	                fprintf(log_file, "%d DONATE %d %lu\n", client_fd, which_charity, amt);
-	                pthread_mutex_unlock(&log_file_lock);
-
-	                write(client_fd, &msg, sizeof(message_t));
-                }
+    // Rates, sketches, history and donor totals are kept per process, a
+    // prefork worker would only answer for its own clients
+    bool local_only = prefork_worker() >= 0;
+    switch (msg->msgtype) {
+        case DONATE:
+            // A read replica only takes donations from its primary
+            if (repl_is_follower() || !owned(which_charity) || !core_donate(which_charity, msg->msgdata.donation.amount, SKETCH_SOURCE(s->donor, c->ip))) {
+                error = true;
+            } else {
+                uint64_t amt = msg->msgdata.donation.amount;
+                s->donation_total += amt;
+                donors_add(s->donor, amt);
+
+                pthread_mutex_lock(&log_file_lock);
+                fprintf(log_file, "%d DONATE %d %lu\n", client_fd, which_charity, amt);
+                pthread_mutex_unlock(&log_file_lock);
+
+                reply(c, s, msg, sizeof(message_t));
+            }
+            break;
+        case CINFO:
+            if (!owned(which_charity) || !core_cinfo(which_charity, &msg->msgdata.charityInfo)) {
+                error = true;
+            } else {
+                pthread_mutex_lock(&log_file_lock);
+                fprintf(log_file, "%d CINFO %d\n", client_fd, which_charity);
+                pthread_mutex_unlock(&log_file_lock);
+
+                reply(c, s, msg, sizeof(message_t));
+            }
+            break;
+        case TOP:
+            core_top(msg->msgdata.maxDonations);
+
+            write_log("%d TOP\n", client_fd);
+
+            reply(c, s, msg, sizeof(message_t));
+            break;
+
+        case STATS: {
+            if (part_count == 1) {
+                error = true;
                 break;
-            case CINFO:
-                if (which_charity >= 5) {
-                    error = true;
-                } else {
-	                pthread_mutex_lock(&charity_locks[which_charity]);
-	                printf("cinfo: locked %d\n", which_charity);
+            }
+            core_stats_t stats;
+            owned_stats(&stats);
+            msg->msgdata.stats.charityID_high = stats.charity_high;
+            msg->msgdata.stats.charityID_low = stats.charity_low;
+            msg->msgdata.stats.amount_high = stats.amount_high;
+            msg->msgdata.stats.amount_low = stats.amount_low;
+            write_log("%d STATS %d:%lu %d:%lu\n", client_fd, stats.charity_high, stats.amount_high, stats.charity_low, stats.amount_low);
+            reply(c, s, msg, sizeof(message_t));
+            break;
+        }
 
-	                memcpy(&msg.msgdata.charityInfo, &charities[which_charity], sizeof(charity_t));
+        case FOLD_TOTAL:
+            if (part_count == 1) {
+                error = true;
+                break;
+            }
+            core_logout(msg->msgdata.donation.amount);
+            write_log("%d FOLD_TOTAL %lu\n", client_fd, msg->msgdata.donation.amount);
+            reply(c, s, msg, sizeof(message_t));
+            break;
 
-	                pthread_mutex_unlock(&charity_locks[which_charity]);
-	                printf("cinfo: unlocked locked %d\n", which_charity);
+        case RATE:
+            if (local_only || which_charity >= NUM_CHARITIES) {
+                error = true;
+            } else {
+                rate_query(which_charity, msg->msgdata.maxDonations);
+                write_log("%d RATE %d\n", client_fd, which_charity);
+                reply(c, s, msg, sizeof(message_t));
+            }
+            break;
 
-	                pthread_mutex_lock(&log_file_lock);
-	                fprintf(log_file, "%d CINFO %d\n", client_fd, which_charity);
-	                pthread_mutex_unlock(&log_file_lock);
+        case SKETCH:
+            if (local_only || which_charity >= NUM_CHARITIES || msg->msgdata.donation.amount > 1000) {
+                error = true;
+            } else {
+                sketch_result_t sk;
+                sketch_query(which_charity, msg->msgdata.donation.amount, &sk);
+                msg->msgdata.maxDonations[0] = sk.distinct;
+                msg->msgdata.maxDonations[1] = sk.quantile;
+                msg->msgdata.maxDonations[2] = sk.count;
+                write_log("%d SKETCH %d\n", client_fd, which_charity);
+                reply(c, s, msg, sizeof(message_t));
+            }
+            break;
 
-	                write(client_fd, &msg, sizeof(message_t));
-                }
+        case HISTORY: {
+            char* buf;
+            size_t len = local_only ? 0 : ts_history_reply(msg, &buf);
+            if (len == 0) {
+                error = true;
                 break;
-            case TOP:
-                pthread_mutex_lock(&mt_stats_lock);
-                printf("locked top\n");
-                for (int i = 0; i < 3; i++) {
-                    msg.msgdata.maxDonations[i] = maxDonations[i];
-                }
-                pthread_mutex_unlock(&mt_stats_lock);
-                printf("unlocked top\n");
+            }
+            write_log("%d HISTORY %d\n", client_fd, msg->msgdata.stats.charityID_high);
+            reply(c, s, buf, len);
+            free(buf);
+            break;
+        }
 
-                write_log("%d TOP\n", client_fd);
+        case LOGIN:
+            if (repl_is_follower() || msg->msgdata.donation.amount == 0) {
+                error = true;
+            } else {
+                s->donor = msg->msgdata.donation.amount;
+                write_log("%d LOGIN %lu\n", client_fd, s->donor);
+                reply(c, s, msg, sizeof(message_t));
+            }
+            break;
 
-                write(client_fd, &msg, sizeof(message_t));
+        case TOP_DONORS: {
+            if (local_only) {
+                error = true;
                 break;
+            }
+            char buf[TOP_DONORS_REPLY_MAX];
+            size_t len = donors_top_reply(msg, buf);
+            write_log("%d TOP_DONORS\n", client_fd);
+            reply(c, s, buf, len);
+            break;
+        }
 
-            case LOGOUT:
-            	write_log("%d LOGOUT\n", client_fd);
-
-                pthread_mutex_lock(&mt_stats_lock);
-                if (donation_total > maxDonations[0]) {
-                    maxDonations[2] = maxDonations[1];
-                    maxDonations[1] = maxDonations[0];
-                    maxDonations[0] = donation_total;
-                } else if (donation_total > maxDonations[1]) {
-                    maxDonations[2] = maxDonations[1];
-                    maxDonations[1] = donation_total;
-                } else if (donation_total > maxDonations[2]) {
-                    maxDonations[2] = donation_total;
-                }
-                pthread_mutex_unlock(&mt_stats_lock);
+        case CINFO_IF_CHANGED:
+        case TOP_IF_CHANGED:
+        case STATS_IF_CHANGED: {
+            char buf[IF_CHANGED_REPLY_MAX];
+            size_t len = core_if_changed_reply(msg, buf);
+            if (len == 0) {
+                error = true;
+                break;
+            }
+            write_log("%d IF_CHANGED %d %s\n", client_fd, msg->msgtype, len == 1 ? "NOT_MODIFIED" : "SENT");
+            reply(c, s, buf, len);
+            break;
+        }
 
-                close(client_fd);
-                return NULL;
+        case CINFO_ALL: {
+            char buf[CINFO_ALL_REPLY_MAX];
+            size_t len = core_cinfo_all_reply(msg, buf);
+            write_log("%d CINFO_ALL\n", client_fd);
+            reply(c, s, buf, len);
+            break;
+        }
+
+        case REPL_STATUS:
+            repl_status_reply(msg);
+            write_log("%d REPL_STATUS\n", client_fd);
+            reply(c, s, msg, sizeof(message_t));
+            break;
+
+        case SUBSCRIBE:
+            // The feed writes whole updates to the socket, they can not carry a
+            // session id nor go through the rings
+            if (c->mux || c->shm) {
+                error = true;
+                break;
+            }
+            feed_subscribe(client_fd, msg->msgdata.donation.amount);
+            c->subscribed = true;
+            write_log("%d SUBSCRIBE %lu\n", client_fd, msg->msgdata.donation.amount);
+            break;
+
+        case LOGOUT:
+            write_log("%d LOGOUT\n", client_fd);
+            fold_session(s);
+            // A plain connection just closes, a mux session needs to know it is gone
+            if (c->mux) {
+                reply(c, s, msg, sizeof(message_t));
+            }
+            return false;
+
+        default:
+            error = true;
+            break;
+    }
+    if (error) {
+        write_log("%d ERROR\n", client_fd);
+        msg->msgtype = ERROR;
+        reply(c, s, msg, sizeof(message_t));
+    }
+    return true;
+}
 
-            default:
-            	error = true;
+// Runs either as a thread or as a coroutine (-c), I/O goes through coro_read/coro_write
+void* client_handler(void* vargp) {
+    client_info_t* info = vargp;
+    client_conn_t conn = {info->fd, info->addr.sin_addr.s_addr, info->shm, false, false};
+    int client_fd = conn.fd;
+    free(vargp);
+
+    message_t msg;
+    session_t plain = {0};  // the connection's own session, unused once mux
+    mux_table_t sessions;
+    bool first = true;
+    rate_bucket_init(&plain.rate_bucket);
+    conn_timer_init(&conn.timer, client_fd);
+    conn_timer_idle(&conn.timer);
+
+    while (1) {
+        session_t* s = &plain;
+        if (conn.mux) {
+            char frame[MUX_ID_BYTES + sizeof(message_t)];
+            if (!read_full(&conn, frame, sizeof(frame))) {
                 break;
+            }
+            uint32_t id;
+            memcpy(&id, frame, MUX_ID_BYTES);
+            memcpy(&msg, frame + MUX_ID_BYTES, sizeof(message_t));
+            s = mux_get(&sessions, id);
+            if (s == NULL) {
+                // Table full, still answer under the id that was asked for
+                session_t none = {.id = id};
+                conn_timer_request(&conn.timer);
+                write_log("%d ERROR\n", client_fd);
+                msg.msgtype = ERROR;
+                reply(&conn, &none, &msg, sizeof(message_t));
+                conn_timer_idle(&conn.timer);
+                continue;
+            }
+        } else if (!read_full(&conn, &msg, sizeof(message_t))) {
+            break;
+        }
+        conn_timer_request(&conn.timer);
+        // Replies would interleave with feed updates, a subscriber can only leave
+        if (conn.subscribed && msg.msgtype != LOGOUT) {
+            conn_timer_stop(&conn.timer);
+            continue;
         }
-        if (error) {
-    	    write_log("%d ERROR\n", client_fd);
+        // LOGOUT is never throttled so a limited client can always leave
+        if (msg.msgtype != LOGOUT && !admission_allow(&s->rate_bucket, conn.ip)) {
+            write_log("%d ERROR\n", client_fd);
             msg.msgtype = ERROR;
-            write(client_fd, &msg, sizeof(message_t));
+            reply(&conn, s, &msg, sizeof(message_t));
+            conn_timer_idle(&conn.timer);
+            continue;
+        }
+        // Only the very first message may switch the connection over
+        if (msg.msgtype == MUX_HELLO && first) {
+            first = false;
+            write_log("%d MUX_HELLO\n", client_fd);
+            conn_write(&conn, &msg, sizeof(message_t));
+            conn.mux = true;
+            mux_init(&sessions);
+            conn_timer_idle(&conn.timer);
+            continue;
+        }
+        first = false;
+
+        // Degraded observer reads are answered from the QoS snapshot, a
+        // partition's CINFO and STATS only cover what it owns
+        char cached[QOS_REPLY_MAX];
+        size_t cached_len = part_count == 1 ? qos_cached_reply(&msg, cached) : 0;
+        if (cached_len) {
+            write_log("%d CACHED %d\n", client_fd, msg.msgtype);
+            reply(&conn, s, cached, cached_len);
+            conn_timer_idle(&conn.timer);
+            continue;
+        }
+        qos_ticket_t ticket;
+        if (!qos_enter(&ticket, msg.msgtype)) {
+            write_log("%d ERROR\n", client_fd);
+            msg.msgtype = ERROR;
+            reply(&conn, s, &msg, sizeof(message_t));
+            conn_timer_idle(&conn.timer);
+            continue;
+        }
+        *session_mark() = &s->mark;
+        bool alive = handle_message(&conn, s, &msg);
+        *session_mark() = NULL;
+        qos_leave(&ticket);
+        if (!alive) {
+            if (!conn.mux) {
+                if (conn.subscribed) {
+                    feed_unsubscribe(client_fd);
+                }
+                conn_timer_stop(&conn.timer);
+                session_unregister(client_fd);
+                conn_close(&conn);
+                admission_leave();
+                return NULL;
+            }
+            mux_remove(&sessions, s->id);
+        }
+        // Subscribers are expected to sit silent
+        if (conn.subscribed) {
+            conn_timer_stop(&conn.timer);
+        } else {
+            conn_timer_idle(&conn.timer);
         }
     }
 
-    close(client_fd);
+    // A session that timed out or was drained is logged out exactly like a LOGOUT request
+    conn_timer_stop(&conn.timer);
+    if (conn.subscribed) {
+        feed_unsubscribe(client_fd);
+    }
+    bool logout = conn_timer_expired(&conn.timer) || draining;
+    if (conn.mux) {
+        for (uint32_t i = 0; logout && i < sessions.cap; i++) {
+            if (sessions.slots[i].used) {
+                write_log("%d LOGOUT\n", client_fd);
+                fold_session(&sessions.slots[i]);
+            }
+        }
+        mux_destroy(&sessions);
+    } else if (logout) {
+        write_log("%d LOGOUT\n", client_fd);
+        fold_session(&plain);
+    }
+    session_unregister(client_fd);
+    conn_close(&conn);
+    admission_leave();
     return NULL;
-}
\ No newline at end of file
+}
+
+/********************** local transport *****/
+static int local_fd = -1;
+static const char* local_path;
+static int local_spin;
+static volatile int local_stopping;
+static pthread_t local_tid;
+
+// Co-located clients get a thread each, a session waiting on its ring can not park as a coroutine
+static void* local_acceptor(void* vargp) {
+    while (!local_stopping) {
+        shm_conn_t* shm = shm_accept(local_fd, local_spin);
+        if (shm == NULL) {
+            continue;
+        }
+        if (!admission_enter()) {
+            message_t msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msgtype = ERROR;
+            shm_write(shm, &msg, sizeof(msg));
+            shm_close(shm);
+            continue;
+        }
+        session_register(shm->sock);
+        client_info_t* info = malloc(sizeof(client_info_t));
+        info->fd = shm->sock;
+        memset(&info->addr, 0, sizeof(info->addr));
+        info->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        info->shm = shm;
+
+        pthread_t tid;
+        sigset_t old_mask;
+        block_server_signals(&old_mask);
+        int err = pthread_create(&tid, NULL, client_handler, info);
+        restore_signals(&old_mask);
+        if (err) {
+            session_unregister(shm->sock);
+            shm_close(shm);
+            free(info);
+            admission_leave();
+        } else {
+            pthread_detach(tid);
+            core_client_connected();
+        }
+    }
+    return NULL;
+}
+
+void local_start(const char* path, int spin) {
+    local_fd = shm_listen(path);
+    if (local_fd < 0) {
+        printf("local socket err\n");
+        exit(EXIT_FAILURE);
+    }
+    local_path = path;
+    local_spin = spin;
+    local_stopping = 0;
+    sigset_t old_mask;
+    block_server_signals(&old_mask);
+    if (pthread_create(&local_tid, NULL, local_acceptor, NULL)) {
+        printf("local acceptor thread err\n");
+        exit(EXIT_FAILURE);
+    }
+    restore_signals(&old_mask);
+}
+
+void local_stop() {
+    if (local_fd < 0) {
+        return;
+    }
+    local_stopping = 1;
+    // Fails the acceptor's accept()
+    shutdown(local_fd, SHUT_RDWR);
+    pthread_join(local_tid, NULL);
+    close(local_fd);
+    unlink(local_path);
+    local_fd = -1;
+}
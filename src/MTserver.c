@@ -4,70 +4,300 @@
 #include <signal.h>
 
 #include "MThelpers.h"
+#include "coro.h"
+#include "admission.h"
+#include "timerwheel.h"
+#include "lifecycle.h"
+#include "core.h"
+#include "feed.h"
+#include "shmring.h"
+#include "repl.h"
+#include "statpage.h"
+#include "part.h"
+#include "prefork.h"
+#include "topo.h"
+#include "socktune.h"
+#include "qos.h"
+#include "tseries.h"
 #include <errno.h>
 dlist_t* list;
 FILE* log_file;
 volatile sig_atomic_t sigint = 0;
+int part_index = 0;
+int part_count = 1;
 
 /********************** LOCKS *************/
-pthread_mutex_t mt_stats_lock;
 pthread_mutex_t log_file_lock;
-// fine grain locking
-pthread_mutex_t charity_locks[5];
 /******************************************/
 
+static int restart_fd = -1;  // to the new process after a hot restart
 
-// Global variables, statistics collected since server start-up
-int clientCnt;  // # of client connections made, Updated by the main thread
-uint64_t maxDonations[3];  // 3 highest total donations amounts (sum of all donations to all
-                           // charities in one connection), updated by client threads
-                           // index 0 is the highest total donation
-charity_t charities[5]; // Global variable, one charity per index
+// Whether the accept loop is done: on SIGINT/SIGTERM, or once a hot restart
+// handed the listeners over. A restart that failed keeps this process serving.
+static bool stop_accepting(char* argv[], const int* fds, int n) {
+    if (sigint) {
+        return true;
+    }
+    if (!restart_requested) {
+        return false;
+    }
+    restart_fd = restart_handoff(argv, fds, n);
+    if (restart_fd >= 0) {
+        return true;
+    }
+    printf("restart failed, still serving\n");
+    restart_requested = 0;
+    return false;
+}
+
+// Node whose CPU took the connection's packets, where its session should run
+static int incoming_node(int fd) {
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) || cpu < 0) {
+        return topo_current_node();
+    }
+    return topo_node_of_cpu(cpu);
+}
 
 int main(int argc, char *argv[]) {
 
     // Arg parsing
     int opt;
-    while ((opt = getopt(argc, argv, "h")) != -1) {
+    int coro_workers = 0;  // 0: one thread per client
+    int max_conns = 0, conn_rate = 0, ip_rate = 0;
+    int idle_secs = 0, request_secs = 0;
+    int drain_secs = DEFAULT_DRAIN_SECS;
+    const char* strategy = NULL;
+    const char* local_path = NULL;
+    int local_spin = shm_default_spin();
+    int repl_port = 0;
+    const char* primary = NULL;
+    const char* stat_name = NULL;
+    int procs = 0;
+    bool numa = false;
+    int qos_target_us = 0, qos_slots = 0;
+    int history_hours = 0;
+    while ((opt = getopt(argc, argv, "hc:m:r:i:t:T:d:s:u:b:R:F:P:p:S:H:No:q:")) != -1) {
         switch (opt) {
             case 'h':
                 fprintf(stderr, USAGE_MSG_MT);
                 exit(EXIT_FAILURE);
+            case 'c':
+                coro_workers = atoi(optarg);
+                if (coro_workers <= 0) {
+                    fprintf(stderr, USAGE_MSG_MT);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                max_conns = atoi(optarg);
+                break;
+            case 'r':
+                conn_rate = atoi(optarg);
+                break;
+            case 'i':
+                ip_rate = atoi(optarg);
+                break;
+            case 't':
+                idle_secs = atoi(optarg);
+                break;
+            case 'T':
+                request_secs = atoi(optarg);
+                break;
+            case 'd':
+                drain_secs = atoi(optarg);
+                break;
+            case 's':
+                strategy = optarg;
+                break;
+            case 'u':
+                local_path = optarg;
+                break;
+            case 'b':
+                local_spin = atoi(optarg);
+                break;
+            case 'R':
+                repl_port = atoi(optarg);
+                break;
+            case 'F':
+                primary = optarg;
+                break;
+            case 'S':
+                stat_name = optarg;
+                break;
+            case 'N':
+                numa = true;
+                break;
+            case 'H':
+                history_hours = atoi(optarg);
+                if (history_hours <= 0) {
+                    fprintf(stderr, USAGE_MSG_MT);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'o':
+                if (socktune_select(optarg)) {
+                    fprintf(stderr, USAGE_MSG_MT);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'q':
+                if (sscanf(optarg, "%d/%d", &qos_target_us, &qos_slots) < 1 || qos_target_us <= 0 || qos_slots < 0) {
+                    fprintf(stderr, USAGE_MSG_MT);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'P':
+                if (sscanf(optarg, "%d/%d", &part_index, &part_count) != 2 || part_count < 1 || part_count > PART_MAX ||
+                    part_index < 0 || part_index >= part_count) {
+                    fprintf(stderr, USAGE_MSG_MT);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                procs = atoi(optarg);
+                if (procs <= 0 || procs > PREFORK_MAX) {
+                    fprintf(stderr, USAGE_MSG_MT);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                fprintf(stderr, USAGE_MSG_MT);
+                exit(EXIT_FAILURE);
         }
     }
 
-    // 3 positional arguments necessary
-    if (argc != 3) {
+    // 2 positional arguments necessary, the journal, the local rings and the history are per process
+    if (argc - optind != 2 || (procs && (repl_port || primary || local_path || history_hours))) {
         fprintf(stderr, USAGE_MSG_MT);
         exit(EXIT_FAILURE);
     }
-    unsigned int port_number = atoi(argv[1]);
-    char *log_filename = argv[2];
+    unsigned int port_number = atoi(argv[optind]);
+    char *log_filename = argv[optind + 1];
+    // Client threads all hit the same few charities, per-charity locks by default.
+    // Workers of a prefork server can only share lock-free state, the NUMA-aware
+    // mode keeps a shard of the counters on every node.
+    if (numa) {
+        printf("NUMA-aware, %d nodes.\n", topo_init());
+    }
+    if (core_init(strategy, procs ? "atomic" : numa ? "sharded" : "charity")) {
+        fprintf(stderr, USAGE_MSG_MT);
+        exit(EXIT_FAILURE);
+    }
+    ts_enable(history_hours);
+    if (procs && core_share()) {
+        printf("prefork needs the atomic strategy\n");
+        exit(EXIT_FAILURE);
+    }
 
 
     // SERVER INITIALIZATION CODE 
+    int handoff_fd = restart_inherited_fd();
     init_server(log_filename);
+    // A steering profile gives every coroutine worker its own listener
+    int num_listeners = sock_profile->steer && coro_workers > 1 && !procs ? coro_workers : 1;
+    int* listeners = malloc(num_listeners * sizeof(int));
+    // Prefork: the workers share one listener and go on from here, each
+    // starting its own threads; the supervisor only returns once they stopped
+    if (procs) {
+        listeners[0] = socket_listen_init(port_number);
+        // One write() per line, the workers share the file offset
+        setvbuf(log_file, NULL, _IOLBF, 0);
+        if (prefork_start(procs) < 0) {
+            close(listeners[0]);
+            cleanup_server();
+            core_print_stats();
+            core_destroy();
+            return 0;
+        }
+    }
+    admission_init(max_conns, conn_rate, ip_rate);
+    qos_init(qos_target_us, qos_slots);
+    conn_timeouts_init(idle_secs * 1000ull, request_secs * 1000ull);
+    rate_timer_start();
+    feed_start();
     struct sigaction myaction = {{0}};
     myaction.sa_handler = sigint_handler;
-    if (sigaction(SIGINT, &myaction, NULL) == -1) {
+    if (sigaction(SIGINT, &myaction, NULL) == -1 || sigaction(SIGTERM, &myaction, NULL) == -1) {
+        printf("signal handler failed to install\n");
+        exit(EXIT_FAILURE);
+    }
+    struct sigaction restart_action = {{0}};
+    // A prefork worker is replaced by its supervisor, not restarted in place
+    restart_action.sa_handler = procs ? SIG_IGN : restart_handler;
+    if (sigaction(SIGUSR2, &restart_action, NULL) == -1) {
         printf("signal handler failed to install\n");
         exit(EXIT_FAILURE);
     }
+    // Writes to a client that went away (or timed out) must not kill the server
+    struct sigaction ignore_action = {{0}};
+    ignore_action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore_action, NULL);
+    if (coro_workers) {
+        qos_set_coroutines(coro_self, coro_suspend, coro_wake);
+        coro_set_busy_poll(socktune_worker_spin_us());
+        coro_set_cpu_pinning(num_listeners > 1);
+        coro_sched_init(coro_workers);
+    }
 
-    // Initiate server socket for listening
-    int listen_fd = socket_listen_init(port_number);
+    // Initiate server socket for listening, or take it over from the old process
+    if (procs) {
+        printf("Worker %d (pid %d).\n", prefork_worker(), getpid());
+    } else if (handoff_fd >= 0) {
+        // The state only arrives once the old process has drained its sessions,
+        // clients wait in the backlog until then (the SLA in lifecycle.h)
+        if (restart_recv_listeners(handoff_fd, listeners, num_listeners) || restart_ack(handoff_fd) ||
+            restart_recv_state(handoff_fd, drain_secs * 1000ull)) {
+            printf("restart handoff failed\n");
+            exit(EXIT_FAILURE);
+        }
+        close(handoff_fd);
+        printf("Took over listener from previous process.\n");
+    } else {
+        for (int i = 0; i < num_listeners; i++) {
+            listeners[i] = socket_listen_init(port_number);
+        }
+        if (num_listeners > 1 && socktune_steer(listeners, num_listeners)) {
+            printf("connection steering unavailable\n");
+        }
+    }
+    if (num_listeners > 1) {
+        printf("Steering connections to %d workers by receiving CPU.\n", num_listeners);
+    }
+    // A replica loads the primary's state before its first client, a primary
+    // starts its journal from the state it has now
+    if (primary) {
+        repl_follow_start(primary);
+    }
+    if (repl_port) {
+        repl_primary_start(repl_port);
+        printf("Replicating on port %d.\n", repl_port);
+    }
     printf("Currently listening on port: %d.\n", port_number);
+    // One prefork worker publishes for all of them
+    if (stat_name && prefork_worker() <= 0) {
+        statpage_start(stat_name);
+    }
+    if (part_count > 1) {
+        printf("Partition %d of %d.\n", part_index, part_count);
+    }
+    if (local_path) {
+        local_start(local_path, local_spin);
+        printf("Local clients on %s.\n", local_path);
+    }
     int client_fd;
     struct sockaddr_in client_addr;
     unsigned int client_addr_len = sizeof(client_addr);
 
     while(1) {
         // Wait and Accept the connection from client
-        client_fd = accept(listen_fd, (SA*)&client_addr, &client_addr_len);
+        int which;
+        client_fd = socktune_accept(listeners, num_listeners, &which, (SA*)&client_addr, &client_addr_len);
         if (client_fd < 0) {
             printf("server acccept failed\n");
             if (errno == EINTR) {
-                if (sigint) {
+                if (stop_accepting(argv, listeners, num_listeners)) {
                     // Kill all threads in thread_list, print stats, exit.
                     break;
                 }
@@ -80,39 +310,117 @@ int main(int argc, char *argv[]) {
             }
         }
 
+        socktune_client(client_fd);
+
+        // Shed load before spending a thread or coroutine on the client
+        if (!admission_enter()) {
+            admission_reject(client_fd);
+            if (stop_accepting(argv, listeners, num_listeners)) {
+                break;
+            }
+            continue;
+        }
+        session_register(client_fd);
+        client_info_t* client_ptr = malloc(sizeof(client_info_t));
+        client_ptr->fd = client_fd;
+        client_ptr->addr = client_addr;
+        client_ptr->shm = NULL;
+
+        int node = numa ? incoming_node(client_fd) : 0;
+
+        // Coroutine mode: the session is parked on its fd instead of owning a thread
+        if (coro_workers) {
+            // The kernel already picked the worker of the receiving CPU
+            int worker = num_listeners > 1 ? which : numa ? coro_worker_on_node(node) : -1;
+            if (coro_set_nonblocking(client_fd) == -1 ||
+                (worker >= 0 ? coro_spawn_on(worker, client_handler, client_ptr) : coro_spawn(client_handler, client_ptr))) {
+                session_unregister(client_fd);
+                close(client_fd);
+                free(client_ptr);
+                admission_leave();
+            } else {
+                core_client_connected();
+            }
+            if (stop_accepting(argv, listeners, num_listeners)) {
+                break;
+            }
+            continue;
+        }
+
         // Call the helper function you made to join terminated threads.
         remove_joinable_threads();
         
         // Create your new thread.
         // tid_t new_tid = pthread_create(client_function);
+        // Client threads leave SIGINT/SIGUSR2 to this loop
         pthread_t tid;
-        int* client_ptr = malloc(sizeof(int));
-        *client_ptr = client_fd;
-        if (pthread_create(&tid, NULL, client_handler, client_ptr)) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (numa) {
+            topo_pin_attr(&attr, node);
+        }
+        sigset_t old_mask;
+        block_server_signals(&old_mask);
+        int err = pthread_create(&tid, &attr, client_handler, client_ptr);
+        restore_signals(&old_mask);
+        pthread_attr_destroy(&attr);
+        if (err) {
+            session_unregister(client_fd);
             close(client_fd);
             free(client_ptr);
+            admission_leave();
         } else {
             // Put new_tid into the thread_list.
             pthread_t* new_tid = malloc(sizeof(pthread_t));
             *new_tid = tid;
             InsertAtHead(list, new_tid);
-            
-            pthread_mutex_lock(&mt_stats_lock);
-            clientCnt++;
-            pthread_mutex_unlock(&mt_stats_lock);
+
+            core_client_connected();
         }
 
         // Need to see if SIGINT occurred between accept and here.
-        if (sigint) {
+        if (stop_accepting(argv, listeners, num_listeners)) {
             // Kill all threads in thread_list, print stats, exit.
             break;
         }
     }
 
-    kill_and_join_all_threads();
+    // Stop accepting and let in-flight requests finish within the deadline
+    for (int i = 0; i < num_listeners; i++) {
+        close(listeners[i]);
+    }
+    free(listeners);
+    local_stop();
+    int forced = drain_sessions(drain_secs * 1000ull);
+    if (forced) {
+        printf("drain deadline passed, %d sessions closed\n", forced);
+    }
+    if (coro_workers) {
+        coro_sched_shutdown();
+    } else {
+        kill_and_join_all_threads();
+    }
+    repl_follow_stop();
+    repl_primary_stop();
+    statpage_stop(!restart_requested);
+    qos_stop();
+    feed_stop();
+    conn_timeouts_shutdown();
+    fflush(log_file);
+
+    if (restart_fd >= 0) {
+        if (restart_send_state(restart_fd)) {
+            printf("restart state handoff failed\n");
+        }
+        close(restart_fd);
+    }
     cleanup_server();
-    print_stats();
-    close(listen_fd);
+    qos_print_stats();
+    // A prefork worker's state is the supervisor's to print
+    if (!procs) {
+        core_print_stats();
+    }
+    core_destroy();
     return 0;
 }
 
@@ -151,8 +459,10 @@ int socket_listen_init(int server_port){
     else
         printf("Socket successfully binded\n");
 
+    socktune_listener(sockfd);
+
     // Now server is ready to listen and verification
-    if ((listen(sockfd, 1)) != 0) {
+    if ((listen(sockfd, socktune_backlog(SOMAXCONN))) != 0) {
         printf("Listen failed\n");
         exit(EXIT_FAILURE);
     }
@@ -5,25 +5,23 @@
 #include <signal.h>
 
 #include "RWhelpers.h"
+#include "admission.h"
+#include "timerwheel.h"
+#include "lifecycle.h"
+#include "core.h"
+#include "donormap.h"
+#include "rate.h"
+#include "tseries.h"
+#include "sketch.h"
+#include "feed.h"
+#include "repl.h"
+#include "socktune.h"
+#include "qos.h"
 #include <stdbool.h>
 #include <errno.h>
 
 void init_server(const char* log_filename) {
-    pthread_mutex_init(&client_cnt_lock, NULL);
-    pthread_mutex_init(&max_donations_lock, NULL);
-    for (int i = 0; i < 3; ++i) {
-        maxDonations[i] = 0;
-    }
-
-    pthread_mutex_init(&readers_lock, NULL);
-    pthread_mutex_init(&writers_lock, NULL);
-    for (int i = 0; i < 5; ++i) {
-        charities[i].totalDonationAmt = 0;
-        charities[i].topDonation = 0;
-        charities[i].numDonations = 0;
-    }
-
-    log_file = fopen(log_filename, "w");
+    log_file = fopen(log_filename, restarted ? "a" : "w");
     if (log_file == NULL) {
         printf("log fopen err\n");
         exit(EXIT_FAILURE);
@@ -33,49 +31,25 @@ void init_server(const char* log_filename) {
 
 void cleanup_server() {
     fclose(log_file);
-    pthread_mutex_destroy(&client_cnt_lock);
-    pthread_mutex_destroy(&max_donations_lock);
-    pthread_mutex_destroy(&readers_lock);
-    pthread_mutex_destroy(&writers_lock);
     pthread_mutex_destroy(&log_file_lock);
 }
 
-void reader_lock() {
-    pthread_mutex_lock(&readers_lock);
-    readcnt++;
-    // specifically the FIRST one in, not just != 0
-    if (readcnt == 1) {
-        pthread_mutex_lock(&writers_lock);
-    }
-    pthread_mutex_unlock(&readers_lock);
-}
-
-void reader_unlock() {
-    pthread_mutex_lock(&readers_lock);
-    readcnt--;
-    if (!readcnt) {
-        pthread_mutex_unlock(&writers_lock);
-    }
-    pthread_mutex_unlock(&readers_lock);
-}
-
-void writer_lock() {
-    pthread_mutex_lock(&writers_lock);
-}
-
-void writer_unlock() {
-    pthread_mutex_unlock(&writers_lock);
-}
-
 void sigint_handler(int sig) {
     sigint = 1;
 }
 
-void print_stats() {
-    for (int i = 0; i < 5; i++) {
-        printf("%d, %u, %lu, %lu\n", i, charities[i].numDonations, charities[i].topDonation, charities[i].totalDonationAmt);
+// A message can arrive in pieces, false once the client closed or the read failed
+static bool read_full(int fd, void* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char*) buf + done, len - done);
+        if (n <= 0) {
+            return false;
+        }
+        socktune_after_read(fd);
+        done += n;
     }
-    fprintf(stderr, "%d\n%lu, %lu, %lu\n", clientCnt, maxDonations[0], maxDonations[1], maxDonations[2]);
+    return true;
 }
 
 void *handle_writer(void *vargp) {
@@ -84,7 +58,8 @@ void *handle_writer(void *vargp) {
     bool error = false;
     uint64_t donation_total = 0;
     message_t msg;
-    bool update = false;
+    rate_bucket_t rate_bucket;
+    conn_timer_t timer;
 
     int writer_fd;
     struct sockaddr_in client_addr;
@@ -96,7 +71,7 @@ void *handle_writer(void *vargp) {
             printf("writer acccept failed\n");
             // disc
             if (errno == EINTR) {
-                if (sigint) {
+                if (sigint || draining) {
                     // Kill all threads in thread_list, print stats, exit.
                     break;
                 }
@@ -108,64 +83,69 @@ void *handle_writer(void *vargp) {
                 exit(EXIT_FAILURE);
             }
         }
-        pthread_mutex_lock(&client_cnt_lock);
-        clientCnt++;
-        pthread_mutex_unlock(&client_cnt_lock);
+        socktune_client(writer_fd);
+        if (!admission_enter()) {
+            admission_reject(writer_fd);
+            continue;
+        }
+        session_register(writer_fd);
+        core_client_connected();
         donation_total = 0; 
+        uint64_t donor = 0;  // set by LOGIN, 0 for anonymous sessions
+        bool logged_out = false;
+        rate_bucket_init(&rate_bucket);
+        // The writer thread serves one donor at a time, a stalled donor must not keep it
+        conn_timer_init(&timer, writer_fd);
+        conn_timer_idle(&timer);
         
-        while ((read(writer_fd, &msg, sizeof(msg))) > 0) {
+        while (!logged_out && read_full(writer_fd, &msg, sizeof(msg))) {
+            conn_timer_request(&timer);
+            // LOGOUT is never throttled so a limited client can always leave
+            if (msg.msgtype != LOGOUT && !admission_allow(&rate_bucket, client_addr.sin_addr.s_addr)) {
+                write_log("%d ERROR\n", writer_fd);
+                msg.msgtype = ERROR;
+                write(writer_fd, &msg, sizeof(message_t));
+                conn_timer_idle(&timer);
+                continue;
+            }
         
+            // Donor requests are never refused, anything else gets ERROR below anyway
+            qos_ticket_t ticket;
+            qos_enter(&ticket, msg.msgtype);
             uint64_t which_charity = msg.msgdata.donation.charity;
+            error = false;
 
             switch (msg.msgtype) {
                 case DONATE:
-
-                    if (which_charity >= 5) {
+                    // A read replica only takes donations from its primary
+                    if (repl_is_follower() || !core_donate(which_charity, msg.msgdata.donation.amount,
+                                     SKETCH_SOURCE(donor, client_addr.sin_addr.s_addr))) {
                         error = true;
                     } else {
-                        writer_lock();
-                        charities[which_charity].totalDonationAmt += msg.msgdata.donation.amount;
-                        charities[which_charity].numDonations++;
-                        if (msg.msgdata.donation.amount > charities[which_charity].topDonation) {
-                            charities[which_charity].topDonation = msg.msgdata.donation.amount;
-                        }
                         donation_total += msg.msgdata.donation.amount;
-                        writer_unlock();
+                        donors_add(donor, msg.msgdata.donation.amount);
 
                         write_log("%d DONATE %lu %lu\n", writer_fd, (unsigned long) which_charity, msg.msgdata.donation.amount);
                         write(writer_fd, &msg, sizeof(msg));
                     }
                     break;
 
-                case LOGOUT: 
-                    // "act like a reader"
-                    reader_lock();
-                    pthread_mutex_lock(&max_donations_lock);
-                    for (int i = 0; i < 3; ++i) {
-                        if (maxDonations[i] < donation_total) {
-                            update = true;
-                            break;
-                        }
-                    }
-                    if (update) {
-                        if (donation_total > maxDonations[0]) {
-                            maxDonations[2] = maxDonations[1];
-                            maxDonations[1] = maxDonations[0];
-                            maxDonations[0] = donation_total;
-                        } else if (donation_total > maxDonations[1]) {
-                            maxDonations[2] = maxDonations[1];
-                            maxDonations[1] = donation_total;
-                        } else if (donation_total > maxDonations[2]) {
-                            maxDonations[2] = donation_total;
-                        }
+                case LOGIN:
+                    if (repl_is_follower() || msg.msgdata.donation.amount == 0) {
+                        error = true;
+                    } else {
+                        donor = msg.msgdata.donation.amount;
+                        write_log("%d LOGIN %lu\n", writer_fd, donor);
+                        write(writer_fd, &msg, sizeof(msg));
                     }
-                    pthread_mutex_unlock(&max_donations_lock);
-                    reader_unlock();
+                    break;
+
+                case LOGOUT: 
+                    core_logout(donation_total);
 
                     write_log("%d LOGOUT\n", writer_fd);
                     write(writer_fd, &msg, sizeof(msg));
-                    close(writer_fd);
-                    // return NULL;
+                    logged_out = true;
                     break;
 
                 default: 
@@ -177,10 +157,20 @@ void *handle_writer(void *vargp) {
                 msg.msgtype = ERROR;
                 write(writer_fd, &msg, sizeof(message_t));
             }
+            qos_leave(&ticket);
+            conn_timer_idle(&timer);
         }
 
+        // A writer that timed out or was drained is logged out exactly like a LOGOUT request
+        conn_timer_stop(&timer);
+        if (!logged_out && (conn_timer_expired(&timer) || draining)) {
+            core_logout(donation_total);
+            write_log("%d LOGOUT\n", writer_fd);
+        }
+        session_unregister(writer_fd);
         close(writer_fd);
-        if (sigint) {
+        admission_leave();
+        if (sigint || draining) {
             break;
         }
     }
@@ -190,67 +180,173 @@ void *handle_writer(void *vargp) {
 }
 
 void *handle_reader(void *vargp) {
-    int reader_fd = *(int *) vargp;
+    client_info_t *info = vargp;
+    int reader_fd = info->fd;
+    uint32_t reader_ip = info->addr.sin_addr.s_addr;
     free(vargp);
     message_t msg;
     bool error = false;
+    rate_bucket_t rate_bucket;
+    rate_bucket_init(&rate_bucket);
+    conn_timer_t timer;
+    conn_timer_init(&timer, reader_fd);
+    conn_timer_idle(&timer);
+    bool subscribed = false;
 
-    while ((read(reader_fd, &msg, sizeof(msg))) > 0) {
+    while (read_full(reader_fd, &msg, sizeof(msg))) {
+        conn_timer_request(&timer);
+        // Replies would interleave with feed updates, a subscriber can only leave
+        if (subscribed && msg.msgtype != LOGOUT) {
+            conn_timer_stop(&timer);
+            continue;
+        }
+        // LOGOUT is never throttled so a limited client can always leave
+        if (msg.msgtype != LOGOUT && !admission_allow(&rate_bucket, reader_ip)) {
+            write_log("%d ERROR\n", reader_fd);
+            msg.msgtype = ERROR;
+            write(reader_fd, &msg, sizeof(message_t));
+            conn_timer_idle(&timer);
+            continue;
+        }
+        // Degraded reads are answered from the QoS snapshot, they never wait on the writer
+        char cached[QOS_REPLY_MAX];
+        size_t cached_len = qos_cached_reply(&msg, cached);
+        if (cached_len) {
+            write(reader_fd, cached, cached_len);
+            write_log("%d CACHED %d\n", reader_fd, msg.msgtype);
+            conn_timer_idle(&timer);
+            continue;
+        }
+        qos_ticket_t ticket;
+        if (!qos_enter(&ticket, msg.msgtype)) {
+            write_log("%d ERROR\n", reader_fd);
+            msg.msgtype = ERROR;
+            write(reader_fd, &msg, sizeof(message_t));
+            conn_timer_idle(&timer);
+            continue;
+        }
         uint64_t which_charity = msg.msgdata.donation.charity;
+        error = false;
 
         switch (msg.msgtype) {
             case CINFO: 
-                if (which_charity >= 5) {
+                if (!core_cinfo(which_charity, &msg.msgdata.charityInfo)) {
                     error = true;
+                    break;
                 }
-                reader_lock();
-                memcpy(&msg.msgdata.charityInfo, &charities[which_charity], sizeof(charity_t));
                 write(reader_fd, &msg, sizeof(msg));
-                reader_unlock();
                 write_log("%d CINFO %lu\n", reader_fd, (unsigned long)which_charity);
                 break;
 
             case TOP: 
-                reader_lock();
-                pthread_mutex_lock(&max_donations_lock);
-                for (int i = 0; i < 3; i++) {
-                    msg.msgdata.maxDonations[i] = maxDonations[i];
-                }
-                pthread_mutex_unlock(&max_donations_lock);
+                core_top(msg.msgdata.maxDonations);
                 write(reader_fd, &msg, sizeof(message_t));
-                reader_unlock();
                 write_log("%d TOP\n", reader_fd);
                 break;
 
-            case STATS:
-                reader_lock();
-                uint64_t amt_high = 0; 
-                uint64_t amt_low = UINT64_MAX;
-                int charity_high = 0, charity_low = 0;
-                for (int i = 0; i < 5; ++i) {
-                    if (charities[i].totalDonationAmt > amt_high) {
-                        amt_high = charities[i].totalDonationAmt;
-                        charity_high = i;
-                    }
-                    if (charities[i].totalDonationAmt < amt_low) {
-                        amt_low = charities[i].totalDonationAmt;
-                        charity_low = i;
-                    }
+            case STATS: {
+                core_stats_t stats;
+                core_stats(&stats);
+                msg.msgdata.stats.charityID_high = stats.charity_high;
+                msg.msgdata.stats.charityID_low = stats.charity_low;
+                msg.msgdata.stats.amount_high = stats.amount_high;
+                msg.msgdata.stats.amount_low = stats.amount_low;
+                write(reader_fd, &msg, sizeof(msg));
+
+                write_log("%d STATS %d:%lu %d:%lu\n", reader_fd, stats.charity_high, stats.amount_high, stats.charity_low, stats.amount_low);
+                break;
+            }
+
+            case RATE:
+                if (which_charity >= NUM_CHARITIES) {
+                    error = true;
+                    break;
+                }
+                rate_query(which_charity, msg.msgdata.maxDonations);
+                write(reader_fd, &msg, sizeof(msg));
+                write_log("%d RATE %lu\n", reader_fd, (unsigned long) which_charity);
+                break;
+
+            case SKETCH: {
+                if (which_charity >= NUM_CHARITIES || msg.msgdata.donation.amount > 1000) {
+                    error = true;
+                    break;
                 }
-                msg.msgdata.stats.charityID_high = charity_high;
-                msg.msgdata.stats.charityID_low = charity_low;
-                msg.msgdata.stats.amount_high = amt_high;
-                msg.msgdata.stats.amount_low = amt_low;
+                sketch_result_t sk;
+                sketch_query(which_charity, msg.msgdata.donation.amount, &sk);
+                msg.msgdata.maxDonations[0] = sk.distinct;
+                msg.msgdata.maxDonations[1] = sk.quantile;
+                msg.msgdata.maxDonations[2] = sk.count;
                 write(reader_fd, &msg, sizeof(msg));
-                reader_unlock();
+                write_log("%d SKETCH %lu\n", reader_fd, (unsigned long) which_charity);
+                break;
+            }
 
-                write_log("%d STATS %d:%lu %d:%lu\n", reader_fd, charity_high, amt_high, charity_low, amt_low);
+            case HISTORY: {
+                char* reply;
+                size_t len = ts_history_reply(&msg, &reply);
+                if (len == 0) {
+                    error = true;
+                    break;
+                }
+                write(reader_fd, reply, len);
+                free(reply);
+                write_log("%d HISTORY %d\n", reader_fd, msg.msgdata.stats.charityID_high);
+                break;
+            }
+
+            case TOP_DONORS: {
+                char reply[TOP_DONORS_REPLY_MAX];
+                size_t len = donors_top_reply(&msg, reply);
+                write(reader_fd, reply, len);
+                write_log("%d TOP_DONORS\n", reader_fd);
+                break;
+            }
+
+            case CINFO_IF_CHANGED:
+            case TOP_IF_CHANGED:
+            case STATS_IF_CHANGED: {
+                char reply[IF_CHANGED_REPLY_MAX];
+                size_t len = core_if_changed_reply(&msg, reply);
+                if (len == 0) {
+                    error = true;
+                    break;
+                }
+                write(reader_fd, reply, len);
+                write_log("%d IF_CHANGED %d %s\n", reader_fd, msg.msgtype, len == 1 ? "NOT_MODIFIED" : "SENT");
+                break;
+            }
+
+            case CINFO_ALL: {
+                char reply[CINFO_ALL_REPLY_MAX];
+                size_t len = core_cinfo_all_reply(&msg, reply);
+                write(reader_fd, reply, len);
+                write_log("%d CINFO_ALL\n", reader_fd);
+                break;
+            }
+
+            case REPL_STATUS:
+                repl_status_reply(&msg);
+                write(reader_fd, &msg, sizeof(msg));
+                write_log("%d REPL_STATUS\n", reader_fd);
+                break;
+
+            case SUBSCRIBE:
+                feed_subscribe(reader_fd, msg.msgdata.donation.amount);
+                subscribed = true;
+                write_log("%d SUBSCRIBE %lu\n", reader_fd, msg.msgdata.donation.amount);
                 break;
 
             case LOGOUT: 
                 write_log("%d LOGOUT\n", reader_fd);
-                write(reader_fd, &msg, sizeof(msg));
+                if (!subscribed || feed_unsubscribe(reader_fd)) {
+                    write(reader_fd, &msg, sizeof(msg));
+                }
+                qos_leave(&ticket);
+                conn_timer_stop(&timer);
+                session_unregister(reader_fd);
                 close(reader_fd);
+                admission_leave();
                 return NULL;
 
             default: 
@@ -262,7 +358,23 @@ void *handle_reader(void *vargp) {
             msg.msgtype = ERROR;
             write(reader_fd, &msg, sizeof(message_t));
         }
+        qos_leave(&ticket);
+        // Subscribers are expected to sit silent
+        if (subscribed) {
+            conn_timer_stop(&timer);
+        } else {
+            conn_timer_idle(&timer);
+        }
+    }
+    conn_timer_stop(&timer);
+    if (subscribed) {
+        feed_unsubscribe(reader_fd);
+    }
+    if (conn_timer_expired(&timer) || draining) {
+        write_log("%d LOGOUT\n", reader_fd);
     }
+    session_unregister(reader_fd);
     close(reader_fd);
+    admission_leave();
     return NULL;
 }
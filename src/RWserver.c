@@ -1,81 +1,220 @@
+#define _GNU_SOURCE
 #include "server.h"
 #include "protocol.h"
 #include <pthread.h>
 #include <signal.h>
 
 #include "RWhelpers.h"
+#include "admission.h"
+#include "timerwheel.h"
+#include "lifecycle.h"
+#include "core.h"
+#include "feed.h"
+#include "repl.h"
+#include "statpage.h"
+#include "socktune.h"
+#include "qos.h"
+#include "tseries.h"
 #include <errno.h>
 FILE* log_file;
 volatile sig_atomic_t sigint = 0;
-int readcnt = 0;
 int writer_fd;
 
 /********************** LOCKS *************/
-pthread_mutex_t client_cnt_lock;
-pthread_mutex_t max_donations_lock;
-pthread_mutex_t readers_lock;
-pthread_mutex_t writers_lock;
 pthread_mutex_t log_file_lock;
 /******************************************/
 
-// Global variables, statistics collected since server start-up
-int clientCnt = 0;  // # of client connections made, Updated by the main thread
-uint64_t maxDonations[3];  // 3 highest total donations amounts (sum of all donations to all  
-                           // charities in one connection), updated by client threads
-                           // index 0 is the highest total donation
-charity_t charities[5]; // Global variable, one charity per index
+static int restart_fd = -1;  // to the new process after a hot restart
+
+// Whether the accept loop is done: on SIGINT/SIGTERM, or once a hot restart
+// handed the listeners over. A restart that failed keeps this process serving.
+static bool stop_accepting(char* argv[], const int* fds, int n) {
+    if (sigint) {
+        return true;
+    }
+    if (!restart_requested) {
+        return false;
+    }
+    restart_fd = restart_handoff(argv, fds, n);
+    if (restart_fd >= 0) {
+        return true;
+    }
+    printf("restart failed, still serving\n");
+    restart_requested = 0;
+    return false;
+}
 
 int main(int argc, char *argv[]) {
 
     // Arg parsing
     int opt;
-    while ((opt = getopt(argc, argv, "h")) != -1) {
+    int max_conns = 0, conn_rate = 0, ip_rate = 0;
+    int idle_secs = 0, request_secs = 0;
+    int drain_secs = DEFAULT_DRAIN_SECS;
+    const char* strategy = NULL;
+    int repl_port = 0;
+    const char* primary = NULL;
+    const char* stat_name = NULL;
+    int qos_target_us = 0, qos_slots = 0;
+    int history_hours = 0;
+    while ((opt = getopt(argc, argv, "hm:r:i:t:T:d:s:R:F:S:H:o:q:")) != -1) {
         switch (opt) {
             case 'h':
                 fprintf(stderr, USAGE_MSG_RW);
                 exit(EXIT_FAILURE);
+            case 'm':
+                max_conns = atoi(optarg);
+                break;
+            case 'r':
+                conn_rate = atoi(optarg);
+                break;
+            case 'i':
+                ip_rate = atoi(optarg);
+                break;
+            case 't':
+                idle_secs = atoi(optarg);
+                break;
+            case 'T':
+                request_secs = atoi(optarg);
+                break;
+            case 'd':
+                drain_secs = atoi(optarg);
+                break;
+            case 's':
+                strategy = optarg;
+                break;
+            case 'R':
+                repl_port = atoi(optarg);
+                break;
+            case 'F':
+                primary = optarg;
+                break;
+            case 'S':
+                stat_name = optarg;
+                break;
+            case 'H':
+                history_hours = atoi(optarg);
+                if (history_hours <= 0) {
+                    fprintf(stderr, USAGE_MSG_RW);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'o':
+                if (socktune_select(optarg)) {
+                    fprintf(stderr, USAGE_MSG_RW);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'q':
+                if (sscanf(optarg, "%d/%d", &qos_target_us, &qos_slots) < 1 || qos_target_us <= 0 || qos_slots < 0) {
+                    fprintf(stderr, USAGE_MSG_RW);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                fprintf(stderr, USAGE_MSG_RW);
+                exit(EXIT_FAILURE);
         }
     }
 
     // 3 positional arguments necessary
-    if (argc != 4) {
+    if (argc - optind != 3) {
         fprintf(stderr, USAGE_MSG_RW);
         exit(EXIT_FAILURE);
     }
-    unsigned int r_port_number = atoi(argv[1]);
-    unsigned int w_port_number = atoi(argv[2]);
-    char *log_filename = argv[3];
+    unsigned int r_port_number = atoi(argv[optind]);
+    unsigned int w_port_number = atoi(argv[optind + 1]);
+    char *log_filename = argv[optind + 2];
+    // One writer and many readers, readers go first by default
+    if (core_init(strategy, "rwpref")) {
+        fprintf(stderr, USAGE_MSG_RW);
+        exit(EXIT_FAILURE);
+    }
+    ts_enable(history_hours);
 
     // SERVER INITIALIZATION
+    int handoff_fd = restart_inherited_fd();
     init_server(log_filename);
+    admission_init(max_conns, conn_rate, ip_rate);
+    qos_init(qos_target_us, qos_slots);
+    conn_timeouts_init(idle_secs * 1000ull, request_secs * 1000ull);
+    rate_timer_start();
+    feed_start();
 
     struct sigaction myaction = {{0}};
     myaction.sa_handler = sigint_handler;
-    if (sigaction(SIGINT, &myaction, NULL) == -1) {
+    if (sigaction(SIGINT, &myaction, NULL) == -1 || sigaction(SIGTERM, &myaction, NULL) == -1) {
         printf("signal handler failed to install\n");
         exit(EXIT_FAILURE);
     }
+    struct sigaction restart_action = {{0}};
+    restart_action.sa_handler = restart_handler;
+    struct sigaction wakeup_action = {{0}};
+    wakeup_action.sa_handler = wakeup_handler;
+    if (sigaction(SIGUSR2, &restart_action, NULL) == -1 || sigaction(SIGUSR1, &wakeup_action, NULL) == -1) {
+        printf("signal handler failed to install\n");
+        exit(EXIT_FAILURE);
+    }
+    // Writes to a client that went away (or timed out) must not kill the server
+    struct sigaction ignore_action = {{0}};
+    ignore_action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore_action, NULL);
+
+    // Listening sockets, either fresh or taken over from the old process
+    int reader_listen_fd;
+    if (handoff_fd >= 0) {
+        int fds[2];
+        // The state only arrives once the old process has drained its sessions,
+        // clients wait in the backlog until then (the SLA in lifecycle.h)
+        if (restart_recv_listeners(handoff_fd, fds, 2) || restart_ack(handoff_fd) ||
+            restart_recv_state(handoff_fd, drain_secs * 1000ull)) {
+            printf("restart handoff failed\n");
+            exit(EXIT_FAILURE);
+        }
+        close(handoff_fd);
+        reader_listen_fd = fds[0];
+        writer_fd = fds[1];
+        printf("Took over listeners from previous process.\n");
+    } else {
+        writer_fd = socket_listen_init(w_port_number);
+        reader_listen_fd = socket_listen_init(r_port_number);
+    }
+
+    // A replica loads the primary's state before its first client, a primary
+    // starts its journal from the state it has now
+    if (primary) {
+        repl_follow_start(primary);
+    }
+    if (repl_port) {
+        repl_primary_start(repl_port);
+        printf("Replicating on port %d.\n", repl_port);
+    }
 
     // WRITER THREAD CREATION
+    // Server threads leave SIGINT/SIGUSR2 to the reader accept loop
     pthread_t writer_tid;
-    writer_fd = socket_listen_init(w_port_number);
+    sigset_t old_mask;
+    block_server_signals(&old_mask);
     pthread_create(&writer_tid, NULL, handle_writer, &writer_fd);
+    restore_signals(&old_mask);
     printf("Listening for writers on port %d.\n", w_port_number);
-
-    // Initiate server socket for listening for reader clients
-    int reader_listen_fd = socket_listen_init(r_port_number); 
     printf("Listening for readers on port %d.\n", r_port_number);
+    if (stat_name) {
+        statpage_start(stat_name);
+    }
 
     int reader_fd;
     struct sockaddr_in client_addr;
     unsigned int client_addr_len = sizeof(client_addr);
 
+    // Handed over together on a hot restart
+    int listen_fds[2] = {reader_listen_fd, writer_fd};
     while(1) {
         // Wait and Accept the connection from client
         reader_fd = accept(reader_listen_fd, (SA*)&client_addr, &client_addr_len);
         if (reader_fd < 0) {
             if (errno == EINTR) {
-                if (sigint) {
+                if (stop_accepting(argv, listen_fds, 2)) {
                     // Kill all threads in thread_list, print stats, exit.
                     break;
                 }
@@ -88,27 +227,72 @@ int main(int argc, char *argv[]) {
             }
         }
 
-        pthread_mutex_lock(&client_cnt_lock);
-        clientCnt++;
-        pthread_mutex_unlock(&client_cnt_lock);
+        socktune_client(reader_fd);
+
+        // Shed load before spending a thread on the reader
+        if (!admission_enter()) {
+            admission_reject(reader_fd);
+            if (stop_accepting(argv, listen_fds, 2)) {
+                break;
+            }
+            continue;
+        }
+        session_register(reader_fd);
+
+        core_client_connected();
 
         // SERVER ACTIONS FOR CONNECTED READER CLIENT
-        int *reader_fd_ptr = malloc(sizeof(int));
-        *reader_fd_ptr = reader_fd;
+        client_info_t *reader_info = malloc(sizeof(client_info_t));
+        reader_info->fd = reader_fd;
+        reader_info->addr = client_addr;
+        reader_info->shm = NULL;
         pthread_t reader_tid;
-        pthread_create(&reader_tid, NULL, handle_reader, reader_fd_ptr);
-        pthread_detach(reader_tid);
+        block_server_signals(&old_mask);
+        int err = pthread_create(&reader_tid, NULL, handle_reader, reader_info);
+        restore_signals(&old_mask);
+        if (err) {
+            session_unregister(reader_fd);
+            close(reader_fd);
+            free(reader_info);
+            admission_leave();
+        } else {
+            pthread_detach(reader_tid);
+        }
 
-        if (sigint) {
+        if (stop_accepting(argv, listen_fds, 2)) {
             break;
         }
     }
 
+    // Stop accepting and let in-flight requests (including the writer's) finish
     close(reader_listen_fd);
-    pthread_cancel(writer_tid);
-    pthread_join(writer_tid, NULL);
-    print_stats();
+    int forced = drain_sessions(drain_secs * 1000ull);
+    if (forced) {
+        printf("drain deadline passed, %d sessions closed\n", forced);
+    }
+    // The writer may be parked in accept(), kick it until it notices the drain
+    while (pthread_tryjoin_np(writer_tid, NULL) == EBUSY) {
+        pthread_kill(writer_tid, SIGUSR1);
+        usleep(10000);
+    }
+    repl_follow_stop();
+    repl_primary_stop();
+    statpage_stop(!restart_requested);
+    qos_stop();
+    feed_stop();
+    conn_timeouts_shutdown();
+    fflush(log_file);
+
+    if (restart_fd >= 0) {
+        if (restart_send_state(restart_fd)) {
+            printf("restart state handoff failed\n");
+        }
+        close(restart_fd);
+    }
+    qos_print_stats();
+    core_print_stats();
     cleanup_server();
+    core_destroy();
     return 0;
 }
 
@@ -147,8 +331,10 @@ int socket_listen_init(int server_port) {
         printf("Socket successfully binded\n");
     }
 
+    socktune_listener(sockfd);
+
     // Now server is ready to listen and verification
-    if ((listen(sockfd, 10)) != 0) { // increased backlog to 10
+    if ((listen(sockfd, socktune_backlog(SOMAXCONN))) != 0) { // connections wait here during a hot restart
         printf("Listen failed\n");
         exit(EXIT_FAILURE);
     }
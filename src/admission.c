@@ -0,0 +1,177 @@
+#include "admission.h"
+#include "protocol.h"
+
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// A token is TOKEN_SCALE units, so one ms of refill is exactly rate units
+// and no fraction is ever dropped
+#define TOKEN_SCALE 1000
+#define TOKEN_BITS 28
+#define TOKEN_MASK ((1ull << TOKEN_BITS) - 1)
+#define TIME_MASK ((1ull << (64 - TOKEN_BITS)) - 1)
+#define MAX_PROBE 16
+#define IP_IDLE_MS 1000  // a slot whose bucket has been full this long can go to another address
+
+typedef struct {
+    atomic_uint ip;       // 0 = free slot
+    atomic_ullong state;  // packed rate_bucket_t
+} ip_slot_t;
+
+static int max_connections;
+static int conn_rate_limit;
+static int ip_rate_limit;
+static atomic_int active_connections;
+static ip_slot_t ip_slots[RATE_IP_SLOTS];
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t bucket_pack(uint64_t ms, uint64_t tokens) {
+    return ((ms & TIME_MASK) << TOKEN_BITS) | (tokens & TOKEN_MASK);
+}
+
+// ms since the bucket's last refill, the packed clock wraps after ~2 years
+static uint64_t bucket_elapsed(uint64_t state, uint64_t now) {
+    return (now - (state >> TOKEN_BITS)) & TIME_MASK;
+}
+
+static uint64_t bucket_full(int rate) {
+    uint64_t tokens = (uint64_t) rate * TOKEN_SCALE;
+    return tokens > TOKEN_MASK ? TOKEN_MASK : tokens;
+}
+
+/*
+ * Refill old up to now and try to take one token.
+ * @return true and the new packed state in *out, or false if the bucket is empty
+ */
+static bool bucket_take(uint64_t old, int rate, uint64_t now, uint64_t* out) {
+    uint64_t tokens = old & TOKEN_MASK;
+    uint64_t cap = bucket_full(rate);
+    uint64_t elapsed = bucket_elapsed(old, now);
+    // An empty bucket is full again after a second
+    uint64_t added = elapsed >= 1000 ? cap : elapsed * rate;
+
+    tokens = tokens + added > cap ? cap : tokens + added;
+    if (tokens < TOKEN_SCALE) {
+        return false;
+    }
+    *out = bucket_pack(now, tokens - TOKEN_SCALE);
+    return true;
+}
+
+// Refilled to the cap at least IP_IDLE_MS ago, nobody is being limited by it
+static bool bucket_idle(uint64_t state, int rate, uint64_t now) {
+    uint64_t elapsed = bucket_elapsed(state, now);
+    if (elapsed < IP_IDLE_MS) {
+        return false;
+    }
+    if (elapsed >= IP_IDLE_MS + 1000) {
+        return true;
+    }
+    return (state & TOKEN_MASK) + (elapsed - IP_IDLE_MS) * rate >= bucket_full(rate);
+}
+
+/*
+ * Slots are never freed, only handed over: once the neighbourhood is full,
+ * an address whose bucket has sat full for IP_IDLE_MS gives its slot to the
+ * new one, which inherits a full bucket.
+ */
+static ip_slot_t* ip_slot(uint32_t ip, uint64_t now) {
+    // 0.0.0.0 never connects, so 0 can mark a free slot
+    uint32_t key = ip ? ip : 1;
+    uint32_t h = key * 2654435761u;
+    ip_slot_t* idle = NULL;
+    unsigned int idle_ip = 0;
+    for (int i = 0; i < MAX_PROBE; i++) {
+        ip_slot_t* slot = &ip_slots[(h + i) % RATE_IP_SLOTS];
+        unsigned int cur = atomic_load_explicit(&slot->ip, memory_order_acquire);
+        if (cur == key) {
+            return slot;
+        }
+        if (cur == 0) {
+            unsigned int expected = 0;
+            if (atomic_compare_exchange_strong(&slot->ip, &expected, key) || expected == key) {
+                return slot;
+            }
+        }
+        if (idle == NULL && bucket_idle(atomic_load_explicit(&slot->state, memory_order_relaxed), ip_rate_limit, now)) {
+            idle = slot;
+            idle_ip = cur;
+        }
+    }
+    if (idle && atomic_compare_exchange_strong(&idle->ip, &idle_ip, key)) {
+        return idle;
+    }
+    // Every neighbour is busy, fail open rather than punish a stranger
+    return NULL;
+}
+
+void admission_init(int max_conns, int conn_rate, int ip_rate) {
+    max_connections = max_conns;
+    conn_rate_limit = conn_rate;
+    ip_rate_limit = ip_rate;
+    atomic_store(&active_connections, 0);
+    uint64_t full = bucket_pack(now_ms(), bucket_full(ip_rate));
+    for (int i = 0; i < RATE_IP_SLOTS; i++) {
+        atomic_init(&ip_slots[i].ip, 0);
+        atomic_init(&ip_slots[i].state, full);
+    }
+}
+
+bool admission_enter() {
+    int n = atomic_fetch_add_explicit(&active_connections, 1, memory_order_relaxed);
+    if (max_connections && n >= max_connections) {
+        atomic_fetch_sub_explicit(&active_connections, 1, memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void admission_leave() {
+    atomic_fetch_sub_explicit(&active_connections, 1, memory_order_relaxed);
+}
+
+void admission_reject(int fd) {
+    message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msgtype = ERROR;
+    write(fd, &msg, sizeof(msg));
+    close(fd);
+}
+
+void rate_bucket_init(rate_bucket_t* bucket) {
+    *bucket = bucket_pack(now_ms(), bucket_full(conn_rate_limit));
+}
+
+bool admission_allow(rate_bucket_t* conn_bucket, uint32_t ip) {
+    uint64_t now = now_ms();
+
+    // Connection bucket is owned by the session, no atomics needed. It is only
+    // charged once the address allowed the message too.
+    uint64_t conn_next = *conn_bucket;
+    if (conn_rate_limit && !bucket_take(*conn_bucket, conn_rate_limit, now, &conn_next)) {
+        return false;
+    }
+
+    if (ip_rate_limit) {
+        ip_slot_t* slot = ip_slot(ip, now);
+        if (slot) {
+            uint64_t old = atomic_load_explicit(&slot->state, memory_order_relaxed);
+            uint64_t next;
+            do {
+                if (!bucket_take(old, ip_rate_limit, now, &next)) {
+                    return false;
+                }
+            } while (!atomic_compare_exchange_weak_explicit(&slot->state, &old, next,
+                        memory_order_relaxed, memory_order_relaxed));
+        }
+    }
+    *conn_bucket = conn_next;
+    return true;
+}
@@ -0,0 +1,252 @@
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zclient.h"
+
+/*
+ * ZotDonate_client, ZotDonate_Wclient and ZotDonate_Rclient, built from this
+ * file with CLIENT_ROLE set by the Makefile. Commands are read from stdin
+ * and submitted as soon as they are read, up to WINDOW of them in flight;
+ * replies are printed in command order as they arrive. A script piped into
+ * the client therefore costs one round trip per window, not per command.
+ */
+#define ROLE_MT 1  // ZotDonate_client, MT server
+#define ROLE_W 2   // ZotDonate_Wclient, RW server writer port
+#define ROLE_R 4   // ZotDonate_Rclient, RW server reader port
+#define ROLE_ALL (ROLE_MT | ROLE_W | ROLE_R)
+
+#ifndef CLIENT_ROLE
+#define CLIENT_ROLE ROLE_MT
+#endif
+
+#define USAGE_MSG "[-h] [-w WINDOW] SERVER_ADDR SERVER_PORT"\
+                  "\n  -h                 Displays this help menu and returns EXIT_SUCCESS"\
+                  "\n  -w WINDOW          Max requests in flight (default 4096, 1 waits for every reply)"\
+                  "\n  SERVER_ADDR        The IP address of the server to connect to"\
+                  "\n  SERVER_PORT        The port to connect to\n"
+
+#define LINE_MAX_LEN 256
+
+typedef struct {
+    const char* name;
+    const char* alias;
+    const char* alias2;
+    int roles;
+    int msgtype;   // -1 for local commands
+    int nargs;
+    const char* help;
+} command_t;
+
+static const command_t commands[] = {
+    {"/help", "/h", NULL, ROLE_ALL, -1, 0, "Lists available commands"},
+    {"/donate", "/d", NULL, ROLE_MT | ROLE_W, DONATE, 2, "charity_id amount: donate amount to the charity"},
+    {"/login", "/l", NULL, ROLE_MT | ROLE_W, LOGIN, 1, "donor_id: count later donations toward the donor"},
+    {"/cinfo", "/c", NULL, ROLE_MT | ROLE_R, CINFO, 1, "charity_id: information about the charity"},
+    {"/top", "/t", NULL, ROLE_MT | ROLE_R, TOP, 0, "3 largest total donations of a client"},
+    {"/stats", "/s", NULL, ROLE_R, STATS, 0, "charities with the highest and lowest donations"},
+    {"/logout", "/quit", "/q", ROLE_ALL, LOGOUT, 0, "log out and exit"},
+};
+
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+static zc_conn_t* conn;
+static int window = ZC_MAX_INFLIGHT;
+static bool input_open = true;
+static bool logged_out = false;
+
+static void print_help() {
+    for (size_t i = 0; i < NUM_COMMANDS; i++) {
+        if (commands[i].roles & CLIENT_ROLE) {
+            printf("%-10s %-6s %s\n", commands[i].name, commands[i].alias, commands[i].help);
+        }
+    }
+}
+
+// Replies arrive in command order, arg carries the charity of the request
+static void on_reply(const zc_reply_t* r, void* arg) {
+    const message_t* m = &r->msg;
+    int charity = (int) (intptr_t) arg;
+    if (r->status != ZC_OK) {
+        printf("Connection closed\n");
+        return;
+    }
+    switch (m->msgtype) {
+        case DONATE:
+            printf("Donated %lu to charity %d\n", m->msgdata.donation.amount, m->msgdata.donation.charity);
+            break;
+        case LOGIN:
+            printf("Logged in as donor %lu\n", m->msgdata.donation.amount);
+            break;
+        case CINFO:
+            printf("Charity %d: total %lu, top donation %lu, %u donations\n", charity, m->msgdata.charityInfo.totalDonationAmt,
+                   m->msgdata.charityInfo.topDonation, m->msgdata.charityInfo.numDonations);
+            break;
+        case TOP:
+            printf("Top donations: %lu %lu %lu\n", m->msgdata.maxDonations[0], m->msgdata.maxDonations[1], m->msgdata.maxDonations[2]);
+            break;
+        case STATS:
+            printf("Highest: charity %d (%lu), lowest: charity %d (%lu)\n", m->msgdata.stats.charityID_high, m->msgdata.stats.amount_high,
+                   m->msgdata.stats.charityID_low, m->msgdata.stats.amount_low);
+            break;
+        case LOGOUT:
+            printf("Logged out\n");
+            break;
+        default:
+            printf("Server error\n");
+            break;
+    }
+}
+
+// Local output waits for the replies before it, to keep everything in order
+static void print_in_order(const char* s) {
+    zc_drain(conn);
+    printf("%s", s);
+}
+
+static void submit(int msgtype, uint8_t charity, uint64_t amount) {
+    message_t msg = {0};
+    msg.msgtype = msgtype;
+    msg.msgdata.donation.charity = charity;
+    msg.msgdata.donation.amount = amount;
+    if (zc_submit(conn, &msg, on_reply, (void*) (intptr_t) charity)) {
+        printf("Connection closed\n");
+        exit(EXIT_FAILURE);
+    }
+    if (msgtype == LOGOUT) {
+        logged_out = true;
+        input_open = false;
+    }
+}
+
+static void run_command(char* line) {
+    char* argv[4];
+    int argc = 0;
+    for (char* tok = strtok(line, " \t\r\n"); tok && argc < 4; tok = strtok(NULL, " \t\r\n")) {
+        argv[argc++] = tok;
+    }
+    if (argc == 0) {
+        return;
+    }
+    for (size_t i = 0; i < NUM_COMMANDS; i++) {
+        const command_t* cmd = &commands[i];
+        if (strcmp(argv[0], cmd->name) && strcmp(argv[0], cmd->alias) && (cmd->alias2 == NULL || strcmp(argv[0], cmd->alias2))) {
+            continue;
+        }
+        if (!(cmd->roles & CLIENT_ROLE) || argc != cmd->nargs + 1) {
+            break;
+        }
+        if (cmd->msgtype < 0) {
+            zc_drain(conn);
+            print_help();
+            return;
+        }
+        uint8_t charity = 0;
+        uint64_t amount = 0;
+        if (cmd->msgtype == LOGIN) {
+            amount = strtoull(argv[1], NULL, 10);
+        } else if (cmd->nargs >= 1) {
+            charity = atoi(argv[1]);
+        }
+        if (cmd->nargs == 2) {
+            amount = strtoull(argv[2], NULL, 10);
+        }
+        submit(cmd->msgtype, charity, amount);
+        return;
+    }
+    print_in_order("Invalid command, /help lists them\n");
+}
+
+/*
+ * Run the complete lines in buf while the window has room.
+ * @return bytes consumed
+ */
+static size_t run_lines(char* buf, size_t len) {
+    size_t off = 0;
+    while (input_open && zc_inflight(conn) < window) {
+        char* nl = memchr(buf + off, '\n', len - off);
+        if (nl == NULL) {
+            break;
+        }
+        *nl = '\0';
+        run_command(buf + off);
+        off = nl - buf + 1;
+    }
+    return off;
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "hw:")) != -1) {
+        switch (opt) {
+            case 'h':
+                fprintf(stderr, "%s " USAGE_MSG, argv[0]);
+                exit(EXIT_SUCCESS);
+            case 'w':
+                window = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "%s " USAGE_MSG, argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind != 2 || window < 1 || window > ZC_MAX_INFLIGHT) {
+        fprintf(stderr, "%s " USAGE_MSG, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    conn = zc_connect(argv[optind], atoi(argv[optind + 1]), 0);
+    if (conn == NULL) {
+        printf("connect err\n");
+        exit(EXIT_FAILURE);
+    }
+    // Lines come out in order even when stdout is a pipe
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    char buf[LINE_MAX_LEN * 16];
+    size_t len = 0;
+    while (!conn->broken && (input_open || zc_inflight(conn))) {
+        size_t used = run_lines(buf, len);
+        memmove(buf, buf + used, len - used);
+        len -= used;
+
+        // Only read more input once the buffered lines have been sent
+        bool want_input = input_open && zc_inflight(conn) < window && memchr(buf, '\n', len) == NULL;
+        struct pollfd fds[2] = {{zc_fd(conn), zc_events(conn), 0}, {STDIN_FILENO, POLLIN, 0}};
+        if (zc_inflight(conn) == 0 && !want_input) {
+            continue;
+        }
+        if (poll(fds, want_input ? 2 : 1, -1) < 0 && errno != EINTR) {
+            break;
+        }
+        if (fds[0].revents && zc_poll(conn, 0) < 0) {
+            break;
+        }
+        if (want_input && fds[1].revents) {
+            ssize_t n = read(STDIN_FILENO, buf + len, sizeof(buf) - len - 1);
+            if (n > 0) {
+                len += n;
+                if (len == sizeof(buf) - 1 && memchr(buf, '\n', len) == NULL) {
+                    // A line longer than the buffer, drop it
+                    len = 0;
+                    print_in_order("Invalid command, /help lists them\n");
+                }
+            } else {
+                // End of input: run a last unterminated line, then log out
+                buf[len] = '\0';
+                run_command(buf);
+                len = 0;
+                input_open = false;
+            }
+        }
+        if (!input_open && !logged_out) {
+            submit(LOGOUT, 0, 0);
+        }
+    }
+    zc_drain(conn);
+    zc_close(conn);
+    return 0;
+}
@@ -0,0 +1,301 @@
+#include "core.h"
+#include "donormap.h"
+#include "protocol_ext.h"
+#include "rate.h"
+#include "sketch.h"
+#include "tseries.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// make SYNC=name bakes a default in, -s still overrides it
+#ifdef CORE_SYNC
+#define CORE_SYNC_DEFAULT CORE_SYNC
+#else
+#define CORE_SYNC_DEFAULT NULL
+#endif
+
+// What the processes of a prefork server share (core_share)
+typedef struct {
+    core_state_t state;
+    // One change counter per charity plus one for LOGOUTs, each on its own line
+    struct {
+        uint64_t v;
+    } __attribute__((aligned(CACHE_LINE))) versions[NUM_CHARITIES + 1];
+    int top_spin;
+} core_shared_t;
+
+static core_shared_t local;
+static core_shared_t* shared = &local;
+core_state_t* core_state = &local.state;
+int* core_top_spin = &local.top_spin;
+int core_lock_id = 1;
+
+static const sync_ops_t* strategies[] = {
+    &sync_global, &sync_charity, &sync_rwlock, &sync_rwpref, &sync_atomic, &sync_sharded, &sync_owner,
+};
+#define NUM_STRATEGIES (sizeof(strategies) / sizeof(strategies[0]))
+
+static const sync_ops_t* ops;
+core_journal_fn core_journal;
+
+static core_mark_t* (*mark_hook)();
+static __thread core_mark_t thread_mark;
+
+static uint64_t version_base;
+
+int core_init(const char* strategy, const char* fallback) {
+    if (strategy == NULL) {
+        strategy = CORE_SYNC_DEFAULT ? CORE_SYNC_DEFAULT : fallback;
+    }
+    ops = NULL;
+    for (int i = 0; i < NUM_STRATEGIES; i++) {
+        if (!strcmp(strategies[i]->name, strategy)) {
+            ops = strategies[i];
+        }
+    }
+    if (ops == NULL) {
+        return -1;
+    }
+    memset(core_state, 0, sizeof(*core_state));
+    // Nothing bumps a counter once per ns, so a version handed out by an
+    // earlier process can not come up again
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    version_base = now.tv_sec * 1000000000ull + now.tv_nsec;
+    memset(shared->versions, 0, sizeof(shared->versions));
+    ops->init();
+    donors_init();
+    rate_init();
+    ts_init();
+    sketch_init();
+    return 0;
+}
+
+void core_destroy() {
+    ops->destroy();
+    donors_destroy();
+    ts_destroy();
+    sketch_destroy();
+}
+
+void core_set_mark_hook(core_mark_t* (*hook)()) {
+    mark_hook = hook;
+}
+
+core_mark_t* core_mark() {
+    core_mark_t* m = mark_hook ? mark_hook() : NULL;
+    return m ? m : &thread_mark;
+}
+
+const char* core_strategy() {
+    return ops->name;
+}
+
+bool core_donate(int charity, uint64_t amount, uint64_t source) {
+    if (charity < 0 || charity >= NUM_CHARITIES) {
+        return false;
+    }
+    ops->donate(charity, amount);
+    if (!ops->async_versions) {
+        core_version_bump(charity);
+    }
+    if (core_journal) {
+        core_journal(DONATE, charity, amount, source);
+    }
+    rate_record(charity, amount);
+    sketch_record(charity, source, amount);
+    if (ts_enabled()) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        ts_append(charity, now.tv_sec * 1000ull + now.tv_nsec / 1000000, amount);
+    }
+    return true;
+}
+
+bool core_cinfo(int charity, charity_t* out) {
+    if (charity < 0 || charity >= NUM_CHARITIES) {
+        return false;
+    }
+    ops->cinfo(charity, out);
+    return true;
+}
+
+void core_top(uint64_t out[3]) {
+    ops->top(out);
+}
+
+void core_logout(uint64_t donation_total) {
+    ops->logout(donation_total);
+    core_version_bump(NUM_CHARITIES);
+    if (core_journal && donation_total) {
+        core_journal(LOGOUT, 0, donation_total, 0);
+    }
+}
+
+static void stats_from_totals(const uint64_t totals[NUM_CHARITIES], core_stats_t* out) {
+    out->charity_high = out->charity_low = 0;
+    out->amount_high = 0;
+    out->amount_low = UINT64_MAX;
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        if (totals[i] > out->amount_high) {
+            out->amount_high = totals[i];
+            out->charity_high = i;
+        }
+        if (totals[i] < out->amount_low) {
+            out->amount_low = totals[i];
+            out->charity_low = i;
+        }
+    }
+}
+
+void core_stats(core_stats_t* out) {
+    uint64_t totals[NUM_CHARITIES];
+    ops->totals(totals);
+    stats_from_totals(totals, out);
+}
+
+void core_snapshot(core_snapshot_t* out) {
+    ops->snapshot(out);
+    uint64_t totals[NUM_CHARITIES];
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        totals[i] = out->charities[i].totalDonationAmt;
+    }
+    stats_from_totals(totals, &out->stats);
+}
+
+int core_share() {
+    if (ops != &sync_atomic) {
+        return -1;
+    }
+    core_shared_t* mem = mmap(NULL, sizeof(core_shared_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        printf("core share mmap err\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(mem, shared, sizeof(core_shared_t));
+    shared = mem;
+    core_state = &mem->state;
+    core_top_spin = &mem->top_spin;
+    return 0;
+}
+
+void core_share_attach() {
+    core_lock_id = getpid();
+}
+
+bool core_share_recover(pid_t dead) {
+    int id = dead;
+    return __atomic_compare_exchange_n(core_top_spin, &id, 0, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+void core_client_connected() {
+    __atomic_fetch_add(&core_state->clientCnt, 1, __ATOMIC_RELAXED);
+}
+
+// Release pairs with the acquire loads below, the change is visible first
+void core_version_bump(int charity) {
+    __atomic_fetch_add(&shared->versions[charity].v, 1, __ATOMIC_RELEASE);
+}
+
+uint64_t core_version(int charity) {
+    return version_base + __atomic_load_n(&shared->versions[charity].v, __ATOMIC_ACQUIRE);
+}
+
+// Every counter only grows, so their sum is a version too
+uint64_t core_version_all() {
+    uint64_t sum = version_base;
+    for (int i = 0; i <= NUM_CHARITIES; i++) {
+        sum += __atomic_load_n(&shared->versions[i].v, __ATOMIC_ACQUIRE);
+    }
+    return sum;
+}
+
+size_t core_if_changed_reply(const message_t* req, char* buf) {
+    message_t reply = *req;
+    uint64_t seen = req->msgdata.donation.amount;
+    int charity = req->msgdata.donation.charity;
+    uint64_t version;
+    if (req->msgtype == CINFO_IF_CHANGED) {
+        if (charity >= NUM_CHARITIES) {
+            return 0;
+        }
+        version = core_version(charity);
+    } else {
+        version = core_version_all();
+    }
+    if (version == seen) {
+        buf[0] = NOT_MODIFIED;
+        return 1;
+    }
+
+    if (req->msgtype == CINFO_IF_CHANGED) {
+        core_cinfo(charity, &reply.msgdata.charityInfo);
+    } else if (req->msgtype == TOP_IF_CHANGED) {
+        core_top(reply.msgdata.maxDonations);
+    } else {
+        core_stats_t stats;
+        core_stats(&stats);
+        reply.msgdata.stats.charityID_high = stats.charity_high;
+        reply.msgdata.stats.charityID_low = stats.charity_low;
+        reply.msgdata.stats.amount_high = stats.amount_high;
+        reply.msgdata.stats.amount_low = stats.amount_low;
+    }
+    memcpy(buf, &reply, sizeof(reply));
+    memcpy(buf + sizeof(reply), &version, sizeof(version));
+    return IF_CHANGED_REPLY_MAX;
+}
+
+size_t core_cinfo_all_reply(const message_t* req, char* buf) {
+    message_t reply = *req;
+    reply.msgdata.donation.amount = sizeof(core_snapshot_t);
+    memcpy(buf, &reply, sizeof(reply));
+    core_snapshot_t snap;
+    core_snapshot(&snap);
+    memcpy(buf + sizeof(reply), &snap, sizeof(snap));
+    return CINFO_ALL_REPLY_MAX;
+}
+
+void core_export(core_state_t* out) {
+    ops->sync_out();
+    memcpy(out, core_state, sizeof(*out));
+}
+
+void core_import(const core_state_t* in) {
+    memcpy(core_state, in, sizeof(*core_state));
+    ops->sync_in();
+}
+
+void core_print_stats() {
+    core_state_t s;
+    core_export(&s);
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        printf("%d, %u, %lu, %lu\n", i, s.charities[i].numDonations, s.charities[i].topDonation, s.charities[i].totalDonationAmt);
+    }
+    fprintf(stderr, "%d\n%lu, %lu, %lu\n", s.clientCnt, s.maxDonations[0], s.maxDonations[1], s.maxDonations[2]);
+}
+
+void core_fold_top(uint64_t top[3], uint64_t donation_total) {
+    if (donation_total > top[0]) {
+        top[2] = top[1];
+        top[1] = top[0];
+        top[0] = donation_total;
+    } else if (donation_total > top[1]) {
+        top[2] = top[1];
+        top[1] = donation_total;
+    } else if (donation_total > top[2]) {
+        top[2] = donation_total;
+    }
+}
+
+void core_apply_donation(charity_t* c, uint64_t amount) {
+    c->numDonations++;
+    c->totalDonationAmt += amount;
+    if (amount > c->topDonation) {
+        c->topDonation = amount;
+    }
+}
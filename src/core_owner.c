@@ -0,0 +1,440 @@
+#define _GNU_SOURCE
+#include "core.h"
+#include "util.h"
+
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Shared-nothing strategy: every charity belongs to one owner thread pinned
+ * to its own CPU, and only the owner ever writes that charity. Session
+ * threads push (charity, amount) deltas into one single-producer ring per
+ * owner, the owner applies whatever is queued in a batch and publishes a
+ * seqlock snapshot that CINFO/STATS read without locking.
+ *
+ * A read waits until the owner has applied the deltas its session pushed
+ * (core_mark_t), so a session sees its own donations even after it moved to
+ * another worker thread; other sessions' donations show up as soon as the
+ * owner catches up, a read never waits for them. An idle owner is woken by a
+ * futex.
+ */
+
+#define MAX_OWNERS NUM_CHARITIES
+#define MAX_PRODUCERS 128
+#define RING_SIZE 1024  // power of 2
+#define RING_MASK (RING_SIZE - 1)
+#define OWNER_SPIN 256  // empty polls before an owner goes to sleep
+#define OWNER_SLEEP_MS 10
+
+typedef struct {
+    uint32_t charity;
+    uint64_t amount;
+} delta_t;
+
+typedef struct {
+    uint64_t head __attribute__((aligned(CACHE_LINE)));  // written by the producer
+    uint64_t tail __attribute__((aligned(CACHE_LINE)));  // written by the owner
+    delta_t deltas[RING_SIZE];
+} ring_t;
+
+typedef struct {
+    int in_use;
+    uint64_t token;  // identifies the thread holding it
+    ring_t rings[MAX_OWNERS];
+} producer_t;
+
+typedef struct {
+    int id;
+    pthread_t tid;
+    volatile int stop;
+    int sleeping __attribute__((aligned(CACHE_LINE)));  // futex word
+} __attribute__((aligned(CACHE_LINE))) owner_t;
+
+typedef struct {
+    uint32_t seq;  // odd while the owner is writing
+    charity_t charity;
+} __attribute__((aligned(CACHE_LINE))) snapshot_t;
+
+static owner_t owners[MAX_OWNERS];
+static int num_owners;
+static snapshot_t snapshots[NUM_CHARITIES];
+
+// Allocated on first use and kept for the life of the process, owners scan [0, num_producers)
+static producer_t* producers[MAX_PRODUCERS];
+static int num_producers;
+static pthread_mutex_t producers_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t next_token = 1;
+
+// Threads beyond MAX_PRODUCERS share this one under a mutex
+static producer_t* overflow;
+static pthread_mutex_t overflow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t top_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread producer_t* my_producer;
+static __thread uint64_t my_token;
+static pthread_key_t producer_key;
+static pthread_once_t producer_once = PTHREAD_ONCE_INIT;
+
+static int owner_of(int charity) {
+    return charity % num_owners;
+}
+
+static void futex_wait(int* addr, int val, int ms) {
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
+
+static void futex_wake(int* addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void wake_owner(owner_t* o) {
+    // Pairs with the fence in owner_thread before it re-checks the rings
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int one = 1;
+    if (__atomic_load_n(&o->sleeping, __ATOMIC_RELAXED) &&
+        __atomic_compare_exchange_n(&o->sleeping, &one, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        futex_wake(&o->sleeping);
+    }
+}
+
+/********************** snapshots **********/
+// Owner only
+static void publish(int charity) {
+    snapshot_t* s = &snapshots[charity];
+    charity_t* c = &core_state->charities[charity];
+    uint32_t seq = s->seq;
+    __atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&s->charity.totalDonationAmt, c->totalDonationAmt, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->charity.topDonation, c->topDonation, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->charity.numDonations, c->numDonations, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void read_snapshot(int charity, charity_t* out) {
+    snapshot_t* s = &snapshots[charity];
+    uint32_t before, after;
+    do {
+        before = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        out->totalDonationAmt = __atomic_load_n(&s->charity.totalDonationAmt, __ATOMIC_RELAXED);
+        out->topDonation = __atomic_load_n(&s->charity.topDonation, __ATOMIC_RELAXED);
+        out->numDonations = __atomic_load_n(&s->charity.numDonations, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+}
+
+/********************** owners *************/
+// @return number of deltas applied
+static int drain_ring(owner_t* o, ring_t* r) {
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = r->tail;
+    if (tail == head) {
+        return 0;
+    }
+    int dirty = 0;
+    for (uint64_t i = tail; i != head; i++) {
+        delta_t* d = &r->deltas[i & RING_MASK];
+        core_apply_donation(&core_state->charities[d->charity], d->amount);
+        dirty |= 1 << d->charity;
+    }
+    for (int c = 0; c < NUM_CHARITIES; c++) {
+        if (dirty & (1 << c)) {
+            publish(c);
+            core_version_bump(c);
+        }
+    }
+    // Only now may the producer reuse the slots and trust the snapshot
+    __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+    return head - tail;
+}
+
+static int drain_all(owner_t* o) {
+    int applied = 0;
+    int n = __atomic_load_n(&num_producers, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++) {
+        applied += drain_ring(o, &producers[i]->rings[o->id]);
+    }
+    if (overflow) {
+        applied += drain_ring(o, &overflow->rings[o->id]);
+    }
+    return applied;
+}
+
+static bool ring_pending(ring_t* r) {
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail;
+}
+
+static bool owner_pending(owner_t* o) {
+    int n = __atomic_load_n(&num_producers, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++) {
+        if (ring_pending(&producers[i]->rings[o->id])) {
+            return true;
+        }
+    }
+    return overflow && ring_pending(&overflow->rings[o->id]);
+}
+
+static void* owner_thread(void* vargp) {
+    owner_t* o = vargp;
+    int idle = 0;
+    while (!o->stop) {
+        if (drain_all(o)) {
+            idle = 0;
+            continue;
+        }
+        if (++idle < OWNER_SPIN) {
+            cpu_relax();
+            continue;
+        }
+        __atomic_store_n(&o->sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!owner_pending(o) && !o->stop) {
+            futex_wait(&o->sleeping, 1, OWNER_SLEEP_MS);
+        }
+        __atomic_store_n(&o->sleeping, 0, __ATOMIC_RELAXED);
+        idle = 0;
+    }
+    drain_all(o);
+    return NULL;
+}
+
+/********************** producers **********/
+// Gives up once the owners are stopping, a thread exiting at shutdown must not
+// hang, and once the rings were reset under a mark from before (core_init again)
+static void wait_ring_reached(ring_t* r, uint64_t pos, owner_t* o) {
+    while (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) < pos &&
+           __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= pos && !o->stop) {
+        wake_owner(o);
+        sched_yield();
+    }
+}
+
+static void wait_ring_drained(ring_t* r, owner_t* o) {
+    wait_ring_reached(r, __atomic_load_n(&r->head, __ATOMIC_ACQUIRE), o);
+}
+
+// Thread exit: hand the slot back once the owners have emptied it
+static void release_producer(void* p) {
+    producer_t* prod = p;
+    if (prod == NULL || prod->token != my_token) {
+        return;
+    }
+    for (int i = 0; i < num_owners; i++) {
+        wait_ring_drained(&prod->rings[i], &owners[i]);
+    }
+    __atomic_store_n(&prod->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void make_producer_key() {
+    pthread_key_create(&producer_key, release_producer);
+}
+
+static producer_t* new_producer() {
+    producer_t* p = aligned_alloc(CACHE_LINE, sizeof(producer_t));
+    if (p == NULL) {
+        printf("producer alloc err\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(p, 0, sizeof(producer_t));
+    return p;
+}
+
+static producer_t* claim_producer() {
+    uint64_t token = __atomic_fetch_add(&next_token, 1, __ATOMIC_RELAXED);
+    producer_t* p = NULL;
+    pthread_mutex_lock(&producers_lock);
+    for (int i = 0; i < num_producers && p == NULL; i++) {
+        if (!producers[i]->in_use) {
+            p = producers[i];
+        }
+    }
+    if (p == NULL && num_producers < MAX_PRODUCERS) {
+        p = new_producer();
+        producers[num_producers] = p;
+        __atomic_store_n(&num_producers, num_producers + 1, __ATOMIC_RELEASE);
+    }
+    if (p) {
+        p->in_use = 1;
+        p->token = token;
+    }
+    pthread_mutex_unlock(&producers_lock);
+
+    pthread_once(&producer_once, make_producer_key);
+    my_token = token;
+    my_producer = p ? p : overflow;
+    if (p) {
+        pthread_setspecific(producer_key, p);
+    }
+    return my_producer;
+}
+
+static producer_t* own_producer() {
+    if (my_producer == NULL || (my_producer != overflow && my_producer->token != my_token)) {
+        return claim_producer();
+    }
+    return my_producer;
+}
+
+// Records the position in the session's mark
+static void push(int charity, uint64_t amount) {
+    producer_t* p = own_producer();
+    int id = owner_of(charity);
+    owner_t* o = &owners[id];
+    ring_t* r = &p->rings[id];
+    if (p == overflow) {
+        pthread_mutex_lock(&overflow_lock);
+    }
+    uint64_t head = r->head;
+    while (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= RING_SIZE) {
+        wake_owner(o);
+        sched_yield();
+    }
+    r->deltas[head & RING_MASK].charity = charity;
+    r->deltas[head & RING_MASK].amount = amount;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    if (p == overflow) {
+        pthread_mutex_unlock(&overflow_lock);
+    }
+    core_mark_t* m = core_mark();
+    m->queue[id] = r;
+    m->pos[id] = head + 1;
+    wake_owner(o);
+}
+
+// Read-your-writes: wait for owner id to apply this session's deltas
+static void catch_up(int id) {
+    core_mark_t* m = core_mark();
+    if (m->queue[id]) {
+        wait_ring_reached(m->queue[id], m->pos[id], &owners[id]);
+        m->queue[id] = NULL;
+    }
+}
+
+// Everything pushed so far, by anyone
+static void drain_everything(int id) {
+    int n = __atomic_load_n(&num_producers, __ATOMIC_ACQUIRE);
+    for (int j = 0; j < n; j++) {
+        wait_ring_drained(&producers[j]->rings[id], &owners[id]);
+    }
+    wait_ring_drained(&overflow->rings[id], &owners[id]);
+}
+
+/********************** sync_ops ***********/
+static void owner_init() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    num_owners = cpus < MAX_OWNERS ? cpus : MAX_OWNERS;
+    memset(snapshots, 0, sizeof(snapshots));
+    if (overflow == NULL) {
+        overflow = new_producer();
+    }
+    overflow->in_use = 1;
+
+    // Keep SIGINT for the accept loop
+    for (int i = 0; i < num_owners; i++) {
+        owners[i].id = i;
+        owners[i].stop = 0;
+        owners[i].sleeping = 0;
+        spawn_thread(&owners[i].tid, owner_thread, &owners[i], "owner");
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(i % cpus, &set);
+        pthread_setaffinity_np(owners[i].tid, sizeof(set), &set);
+    }
+}
+
+static void owner_destroy() {
+    for (int i = 0; i < num_owners; i++) {
+        owners[i].stop = 1;
+        wake_owner(&owners[i]);
+        futex_wake(&owners[i].sleeping);
+        pthread_join(owners[i].tid, NULL);
+    }
+    // Every thread re-claims a producer after a new core_init
+    pthread_mutex_lock(&producers_lock);
+    for (int i = 0; i < num_producers; i++) {
+        producer_t* p = producers[i];
+        for (int j = 0; j < MAX_OWNERS; j++) {
+            p->rings[j].head = p->rings[j].tail = 0;
+        }
+        p->in_use = 0;
+        p->token = 0;
+    }
+    for (int j = 0; j < MAX_OWNERS; j++) {
+        overflow->rings[j].head = overflow->rings[j].tail = 0;
+    }
+    pthread_mutex_unlock(&producers_lock);
+}
+
+static void owner_donate(int charity, uint64_t amount) {
+    push(charity, amount);
+}
+
+static void owner_cinfo(int charity, charity_t* out) {
+    catch_up(owner_of(charity));
+    read_snapshot(charity, out);
+}
+
+static void owner_top(uint64_t out[3]) {
+    pthread_mutex_lock(&top_lock);
+    memcpy(out, core_state->maxDonations, sizeof(core_state->maxDonations));
+    pthread_mutex_unlock(&top_lock);
+}
+
+static void owner_logout(uint64_t donation_total) {
+    pthread_mutex_lock(&top_lock);
+    core_fold_top(core_state->maxDonations, donation_total);
+    pthread_mutex_unlock(&top_lock);
+}
+
+static void owner_totals(uint64_t out[NUM_CHARITIES]) {
+    charity_t c;
+    for (int i = 0; i < num_owners; i++) {
+        catch_up(i);
+    }
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        read_snapshot(i, &c);
+        out[i] = c.totalDonationAmt;
+    }
+}
+
+// Per charity only, each owner publishes on its own schedule
+static void owner_snapshot(core_snapshot_t* out) {
+    for (int i = 0; i < num_owners; i++) {
+        catch_up(i);
+    }
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        read_snapshot(i, &out->charities[i]);
+    }
+    owner_top(out->maxDonations);
+}
+
+// core_state is the owners' private copy, it is current once every ring is empty
+static void owner_sync_out() {
+    for (int i = 0; i < num_owners; i++) {
+        drain_everything(i);
+    }
+}
+
+static void owner_sync_in() {
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        publish(i);
+    }
+}
+
+const sync_ops_t sync_owner = {
+    "owner", owner_init, owner_destroy, owner_donate, owner_cinfo,
+    owner_top, owner_logout, owner_totals, owner_snapshot, owner_sync_out, owner_sync_in, true,
+};
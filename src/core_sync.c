@@ -0,0 +1,490 @@
+#include "core.h"
+#include "topo.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Locks hammered by different charities must not share a cache line
+typedef struct {
+    pthread_mutex_t lock;
+} __attribute__((aligned(CACHE_LINE))) padded_mutex_t;
+
+static void mutex_init(pthread_mutex_t* m) {
+    if (pthread_mutex_init(m, NULL)) {
+        printf("mutex init err\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void nothing() {}
+
+static void copy_totals(uint64_t out[NUM_CHARITIES]) {
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        out[i] = core_state->charities[i].totalDonationAmt;
+    }
+}
+
+static void copy_snapshot(core_snapshot_t* out) {
+    memcpy(out->charities, core_state->charities, sizeof(out->charities));
+    memcpy(out->maxDonations, core_state->maxDonations, sizeof(out->maxDonations));
+}
+
+/********************** global *************/
+static pthread_mutex_t global_lock;
+
+static void global_init() {
+    mutex_init(&global_lock);
+}
+
+static void global_destroy() {
+    pthread_mutex_destroy(&global_lock);
+}
+
+static void global_donate(int charity, uint64_t amount) {
+    pthread_mutex_lock(&global_lock);
+    core_apply_donation(&core_state->charities[charity], amount);
+    pthread_mutex_unlock(&global_lock);
+}
+
+static void global_cinfo(int charity, charity_t* out) {
+    pthread_mutex_lock(&global_lock);
+    *out = core_state->charities[charity];
+    pthread_mutex_unlock(&global_lock);
+}
+
+static void global_top(uint64_t out[3]) {
+    pthread_mutex_lock(&global_lock);
+    memcpy(out, core_state->maxDonations, sizeof(core_state->maxDonations));
+    pthread_mutex_unlock(&global_lock);
+}
+
+static void global_logout(uint64_t donation_total) {
+    pthread_mutex_lock(&global_lock);
+    core_fold_top(core_state->maxDonations, donation_total);
+    pthread_mutex_unlock(&global_lock);
+}
+
+static void global_totals(uint64_t out[NUM_CHARITIES]) {
+    pthread_mutex_lock(&global_lock);
+    copy_totals(out);
+    pthread_mutex_unlock(&global_lock);
+}
+
+static void global_snapshot(core_snapshot_t* out) {
+    pthread_mutex_lock(&global_lock);
+    copy_snapshot(out);
+    pthread_mutex_unlock(&global_lock);
+}
+
+const sync_ops_t sync_global = {
+    "global", global_init, global_destroy, global_donate, global_cinfo,
+    global_top, global_logout, global_totals, global_snapshot, nothing, nothing,
+};
+
+/********************** charity ************/
+static padded_mutex_t charity_locks[NUM_CHARITIES];
+static padded_mutex_t top_lock;
+
+static void charity_init() {
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        mutex_init(&charity_locks[i].lock);
+    }
+    mutex_init(&top_lock.lock);
+}
+
+static void charity_destroy() {
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        pthread_mutex_destroy(&charity_locks[i].lock);
+    }
+    pthread_mutex_destroy(&top_lock.lock);
+}
+
+static void charity_donate(int charity, uint64_t amount) {
+    pthread_mutex_lock(&charity_locks[charity].lock);
+    core_apply_donation(&core_state->charities[charity], amount);
+    pthread_mutex_unlock(&charity_locks[charity].lock);
+}
+
+static void charity_cinfo(int charity, charity_t* out) {
+    pthread_mutex_lock(&charity_locks[charity].lock);
+    *out = core_state->charities[charity];
+    pthread_mutex_unlock(&charity_locks[charity].lock);
+}
+
+static void charity_top(uint64_t out[3]) {
+    pthread_mutex_lock(&top_lock.lock);
+    memcpy(out, core_state->maxDonations, sizeof(core_state->maxDonations));
+    pthread_mutex_unlock(&top_lock.lock);
+}
+
+static void charity_logout(uint64_t donation_total) {
+    pthread_mutex_lock(&top_lock.lock);
+    core_fold_top(core_state->maxDonations, donation_total);
+    pthread_mutex_unlock(&top_lock.lock);
+}
+
+// Takes every charity lock in index order so the totals are from one instant
+static void charity_totals(uint64_t out[NUM_CHARITIES]) {
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        pthread_mutex_lock(&charity_locks[i].lock);
+    }
+    copy_totals(out);
+    for (int i = NUM_CHARITIES - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&charity_locks[i].lock);
+    }
+}
+
+static void charity_snapshot(core_snapshot_t* out) {
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        pthread_mutex_lock(&charity_locks[i].lock);
+    }
+    pthread_mutex_lock(&top_lock.lock);
+    copy_snapshot(out);
+    pthread_mutex_unlock(&top_lock.lock);
+    for (int i = NUM_CHARITIES - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&charity_locks[i].lock);
+    }
+}
+
+const sync_ops_t sync_charity = {
+    "charity", charity_init, charity_destroy, charity_donate, charity_cinfo,
+    charity_top, charity_logout, charity_totals, charity_snapshot, nothing, nothing,
+};
+
+/********************** rwlock *************/
+static pthread_rwlock_t rw_lock;
+
+static void rwlock_init() {
+    if (pthread_rwlock_init(&rw_lock, NULL)) {
+        printf("rwlock init err\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void rwlock_destroy() {
+    pthread_rwlock_destroy(&rw_lock);
+}
+
+static void rwlock_donate(int charity, uint64_t amount) {
+    pthread_rwlock_wrlock(&rw_lock);
+    core_apply_donation(&core_state->charities[charity], amount);
+    pthread_rwlock_unlock(&rw_lock);
+}
+
+static void rwlock_cinfo(int charity, charity_t* out) {
+    pthread_rwlock_rdlock(&rw_lock);
+    *out = core_state->charities[charity];
+    pthread_rwlock_unlock(&rw_lock);
+}
+
+static void rwlock_top(uint64_t out[3]) {
+    pthread_rwlock_rdlock(&rw_lock);
+    memcpy(out, core_state->maxDonations, sizeof(core_state->maxDonations));
+    pthread_rwlock_unlock(&rw_lock);
+}
+
+static void rwlock_logout(uint64_t donation_total) {
+    pthread_rwlock_wrlock(&rw_lock);
+    core_fold_top(core_state->maxDonations, donation_total);
+    pthread_rwlock_unlock(&rw_lock);
+}
+
+static void rwlock_totals(uint64_t out[NUM_CHARITIES]) {
+    pthread_rwlock_rdlock(&rw_lock);
+    copy_totals(out);
+    pthread_rwlock_unlock(&rw_lock);
+}
+
+static void rwlock_snapshot(core_snapshot_t* out) {
+    pthread_rwlock_rdlock(&rw_lock);
+    copy_snapshot(out);
+    pthread_rwlock_unlock(&rw_lock);
+}
+
+const sync_ops_t sync_rwlock = {
+    "rwlock", rwlock_init, rwlock_destroy, rwlock_donate, rwlock_cinfo,
+    rwlock_top, rwlock_logout, rwlock_totals, rwlock_snapshot, nothing, nothing,
+};
+
+/********************** rwpref *************/
+// The first reader in locks writers out, the last one out lets them back in
+static pthread_mutex_t readers_lock;
+static pthread_mutex_t writers_lock;
+static pthread_mutex_t max_donations_lock;
+static int readcnt;
+
+static void reader_lock() {
+    pthread_mutex_lock(&readers_lock);
+    readcnt++;
+    // specifically the FIRST one in, not just != 0
+    if (readcnt == 1) {
+        pthread_mutex_lock(&writers_lock);
+    }
+    pthread_mutex_unlock(&readers_lock);
+}
+
+static void reader_unlock() {
+    pthread_mutex_lock(&readers_lock);
+    readcnt--;
+    if (!readcnt) {
+        pthread_mutex_unlock(&writers_lock);
+    }
+    pthread_mutex_unlock(&readers_lock);
+}
+
+static void rwpref_init() {
+    mutex_init(&readers_lock);
+    mutex_init(&writers_lock);
+    mutex_init(&max_donations_lock);
+    readcnt = 0;
+}
+
+static void rwpref_destroy() {
+    pthread_mutex_destroy(&readers_lock);
+    pthread_mutex_destroy(&writers_lock);
+    pthread_mutex_destroy(&max_donations_lock);
+}
+
+static void rwpref_donate(int charity, uint64_t amount) {
+    pthread_mutex_lock(&writers_lock);
+    core_apply_donation(&core_state->charities[charity], amount);
+    pthread_mutex_unlock(&writers_lock);
+}
+
+static void rwpref_cinfo(int charity, charity_t* out) {
+    reader_lock();
+    *out = core_state->charities[charity];
+    reader_unlock();
+}
+
+static void rwpref_top(uint64_t out[3]) {
+    reader_lock();
+    pthread_mutex_lock(&max_donations_lock);
+    memcpy(out, core_state->maxDonations, sizeof(core_state->maxDonations));
+    pthread_mutex_unlock(&max_donations_lock);
+    reader_unlock();
+}
+
+// "act like a reader", the top 3 has its own lock
+static void rwpref_logout(uint64_t donation_total) {
+    reader_lock();
+    pthread_mutex_lock(&max_donations_lock);
+    core_fold_top(core_state->maxDonations, donation_total);
+    pthread_mutex_unlock(&max_donations_lock);
+    reader_unlock();
+}
+
+static void rwpref_totals(uint64_t out[NUM_CHARITIES]) {
+    reader_lock();
+    copy_totals(out);
+    reader_unlock();
+}
+
+static void rwpref_snapshot(core_snapshot_t* out) {
+    reader_lock();
+    pthread_mutex_lock(&max_donations_lock);
+    copy_snapshot(out);
+    pthread_mutex_unlock(&max_donations_lock);
+    reader_unlock();
+}
+
+const sync_ops_t sync_rwpref = {
+    "rwpref", rwpref_init, rwpref_destroy, rwpref_donate, rwpref_cinfo,
+    rwpref_top, rwpref_logout, rwpref_totals, rwpref_snapshot, nothing, nothing,
+};
+
+/********************** atomic *************/
+// A CINFO reply may mix fields from before and after a concurrent donation.
+// The top 3 lock holds its owner's core_lock_id, so a prefork supervisor can
+// free it after the owner crashed. Waiters only CAS it from 0, they never
+// overwrite the holder's id.
+static void spin_lock() {
+    int unlocked = 0;
+    while (!__atomic_compare_exchange_n(core_top_spin, &unlocked, core_lock_id, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        while (__atomic_load_n(core_top_spin, __ATOMIC_RELAXED)) {
+            cpu_relax();
+        }
+        unlocked = 0;
+    }
+}
+
+static void spin_unlock() {
+    __atomic_store_n(core_top_spin, 0, __ATOMIC_RELEASE);
+}
+
+static void atomic_init_ops() {
+    *core_top_spin = 0;
+}
+
+static void atomic_donate(int charity, uint64_t amount) {
+    charity_t* c = &core_state->charities[charity];
+    __atomic_fetch_add(&c->numDonations, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c->totalDonationAmt, amount, __ATOMIC_RELAXED);
+    uint64_t top = __atomic_load_n(&c->topDonation, __ATOMIC_RELAXED);
+    while (amount > top && !__atomic_compare_exchange_n(&c->topDonation, &top, amount, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void atomic_cinfo(int charity, charity_t* out) {
+    charity_t* c = &core_state->charities[charity];
+    out->totalDonationAmt = __atomic_load_n(&c->totalDonationAmt, __ATOMIC_RELAXED);
+    out->topDonation = __atomic_load_n(&c->topDonation, __ATOMIC_RELAXED);
+    out->numDonations = __atomic_load_n(&c->numDonations, __ATOMIC_RELAXED);
+}
+
+static void atomic_top(uint64_t out[3]) {
+    spin_lock();
+    memcpy(out, core_state->maxDonations, sizeof(core_state->maxDonations));
+    spin_unlock();
+}
+
+static void atomic_logout(uint64_t donation_total) {
+    // Most connections do not make the top 3, skip the lock for them
+    if (donation_total <= __atomic_load_n(&core_state->maxDonations[2], __ATOMIC_RELAXED)) {
+        return;
+    }
+    spin_lock();
+    core_fold_top(core_state->maxDonations, donation_total);
+    spin_unlock();
+}
+
+static void atomic_totals(uint64_t out[NUM_CHARITIES]) {
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        out[i] = __atomic_load_n(&core_state->charities[i].totalDonationAmt, __ATOMIC_RELAXED);
+    }
+}
+
+static void atomic_snapshot(core_snapshot_t* out) {
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        atomic_cinfo(i, &out->charities[i]);
+    }
+    atomic_top(out->maxDonations);
+}
+
+const sync_ops_t sync_atomic = {
+    "atomic", atomic_init_ops, nothing, atomic_donate, atomic_cinfo,
+    atomic_top, atomic_logout, atomic_totals, atomic_snapshot, nothing, nothing,
+};
+
+/********************** sharded ************/
+// Donations only touch the calling thread's shard, reads sum all of them.
+// In the NUMA-aware mode shard i lives on node i % nodes and a thread only
+// takes shards of the node it runs on.
+#define NUM_SHARDS 16
+
+typedef struct {
+    pthread_mutex_t lock;
+    charity_t charities[NUM_CHARITIES];
+} __attribute__((aligned(CACHE_LINE))) shard_t;
+
+static shard_t* shards[NUM_SHARDS];
+static int shard_nodes;
+static int next_shard[TOPO_MAX_NODES];
+static __thread int my_shard = -1;
+
+static shard_t* own_shard() {
+    if (my_shard < 0) {
+        int node = topo_current_node() % shard_nodes;
+        int per_node = (NUM_SHARDS - node + shard_nodes - 1) / shard_nodes;
+        my_shard = node + shard_nodes * (__atomic_fetch_add(&next_shard[node], 1, __ATOMIC_RELAXED) % per_node);
+    }
+    return shards[my_shard];
+}
+
+static void sharded_init() {
+    shard_nodes = topo_nodes() < NUM_SHARDS ? topo_nodes() : NUM_SHARDS;
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        shards[i] = topo_alloc(sizeof(shard_t), i % shard_nodes);
+        if (shards[i] == NULL) {
+            printf("shard alloc err\n");
+            exit(EXIT_FAILURE);
+        }
+        mutex_init(&shards[i]->lock);
+    }
+    mutex_init(&top_lock.lock);
+}
+
+static void sharded_destroy() {
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        pthread_mutex_destroy(&shards[i]->lock);
+        topo_free(shards[i], sizeof(shard_t));
+    }
+    pthread_mutex_destroy(&top_lock.lock);
+}
+
+static void sharded_donate(int charity, uint64_t amount) {
+    shard_t* s = own_shard();
+    pthread_mutex_lock(&s->lock);
+    core_apply_donation(&s->charities[charity], amount);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void sharded_cinfo(int charity, charity_t* out) {
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i]->lock);
+        charity_t* c = &shards[i]->charities[charity];
+        out->numDonations += c->numDonations;
+        out->totalDonationAmt += c->totalDonationAmt;
+        if (c->topDonation > out->topDonation) {
+            out->topDonation = c->topDonation;
+        }
+        pthread_mutex_unlock(&shards[i]->lock);
+    }
+}
+
+static void sharded_totals(uint64_t out[NUM_CHARITIES]) {
+    memset(out, 0, sizeof(uint64_t) * NUM_CHARITIES);
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i]->lock);
+        for (int j = 0; j < NUM_CHARITIES; j++) {
+            out[j] += shards[i]->charities[j].totalDonationAmt;
+        }
+        pthread_mutex_unlock(&shards[i]->lock);
+    }
+}
+
+static void sharded_sync_out() {
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        sharded_cinfo(i, &core_state->charities[i]);
+    }
+}
+
+// Everything imported lands in shard 0
+static void sharded_sync_in() {
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        memset(shards[i]->charities, 0, sizeof(shards[i]->charities));
+    }
+    memcpy(shards[0]->charities, core_state->charities, sizeof(shards[0]->charities));
+}
+
+// Every shard lock at once, unlike the totals
+static void sharded_snapshot(core_snapshot_t* out) {
+    memset(out->charities, 0, sizeof(out->charities));
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i]->lock);
+    }
+    pthread_mutex_lock(&top_lock.lock);
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        for (int j = 0; j < NUM_CHARITIES; j++) {
+            charity_t* c = &shards[i]->charities[j];
+            out->charities[j].numDonations += c->numDonations;
+            out->charities[j].totalDonationAmt += c->totalDonationAmt;
+            if (c->topDonation > out->charities[j].topDonation) {
+                out->charities[j].topDonation = c->topDonation;
+            }
+        }
+    }
+    memcpy(out->maxDonations, core_state->maxDonations, sizeof(out->maxDonations));
+    pthread_mutex_unlock(&top_lock.lock);
+    for (int i = NUM_SHARDS - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&shards[i]->lock);
+    }
+}
+
+const sync_ops_t sync_sharded = {
+    "sharded", sharded_init, sharded_destroy, sharded_donate, sharded_cinfo,
+    charity_top, charity_logout, sharded_totals, sharded_snapshot, sharded_sync_out, sharded_sync_in,
+};
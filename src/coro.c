@@ -0,0 +1,501 @@
+#define _GNU_SOURCE
+#include "coro.h"
+#include "topo.h"
+#include "wsdeque.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+#define RUN_BATCH 64       // coroutines run between two epoll polls
+#define IDLE_POLL_MS 10    // idle workers re-check for stealable work this often
+
+// coro_t.wake: no wake pending, one pending, switched out by coro_suspend()
+enum { WAKE_NONE, WAKE_PENDING, WAKE_PARKED };
+
+typedef struct worker worker_t;
+
+typedef struct coro {
+    ucontext_t ctx;
+    void* stack;        // mmap'd, lowest page is a guard page
+    coro_fn fn;
+    void* arg;
+    int wait_fd;        // fd to park on once switched out, -1 for a plain yield
+    uint32_t wait_events;
+    bool registered;    // wait_fd already added to home->epfd
+    bool suspending;    // switched out by coro_suspend(), not to be requeued
+    atomic_int wake;
+    bool done;
+    worker_t* home;
+    void* local;        // coro_local()
+    struct coro* next;  // inbox link
+} coro_t;
+
+struct worker {
+    pthread_t tid;
+    int epfd;
+    int wakefd;               // eventfd, kicks the worker out of epoll_wait
+    pthread_mutex_t lock;     // protects inbox, coroutines spawned by other threads
+    coro_t* inbox_head;
+    coro_t* inbox_tail;
+    ws_deque_t deque;         // runnable coroutines, idle workers steal from the top
+    atomic_int idle;          // parked in epoll_wait with nothing to run
+    unsigned int seed;        // victim selection
+    unsigned long steals;
+    int node;                 // worker i runs on node i % topo_nodes()
+    ucontext_t sched_ctx;
+    coro_t* current;
+};
+
+static worker_t* workers;
+static int num_workers;
+static unsigned int next_worker;
+static unsigned int next_on_node[TOPO_MAX_NODES];
+static volatile int stopping;
+static volatile int steal_enabled = 1;
+static int busy_poll_us;
+static bool pin_cpus;
+
+static __thread worker_t* self;
+
+// Not inlined so the TLS slot is re-read after every context switch
+static __attribute__((noinline)) worker_t* current_worker() {
+    return self;
+}
+
+static void kick(worker_t* w) {
+    uint64_t one = 1;
+    write(w->wakefd, &one, sizeof(one));
+}
+
+// From any thread, the home worker picks c up on its next round
+static void send_home(coro_t* c) {
+    worker_t* w = c->home;
+    pthread_mutex_lock(&w->lock);
+    c->next = NULL;
+    if (w->inbox_tail) {
+        w->inbox_tail->next = c;
+    } else {
+        w->inbox_head = c;
+    }
+    w->inbox_tail = c;
+    pthread_mutex_unlock(&w->lock);
+    kick(w);
+}
+
+// Wake one idle worker so it can steal from w
+static void wake_idle(worker_t* w) {
+    if (!steal_enabled) {
+        return;
+    }
+    for (int i = 0; i < num_workers; i++) {
+        worker_t* other = &workers[i];
+        if (other != w && atomic_exchange(&other->idle, 0)) {
+            kick(other);
+            return;
+        }
+    }
+}
+
+// Victims on the worker's own node first, a session that crosses nodes
+// leaves its memory behind
+static coro_t* steal_work(worker_t* w) {
+    if (!steal_enabled || num_workers < 2) {
+        return NULL;
+    }
+    int start = rand_r(&w->seed) % num_workers;
+    for (int remote = 0; remote < (topo_nodes() > 1 ? 2 : 1); remote++) {
+        for (int i = 0; i < num_workers; i++) {
+            worker_t* victim = &workers[(start + i) % num_workers];
+            if (victim == w || (topo_nodes() > 1 && (victim->node != w->node) != remote)) {
+                continue;
+            }
+            void* x;
+            do {
+                x = ws_steal(&victim->deque);
+            } while (x == WS_ABORT);
+            if (x) {
+                w->steals++;
+                return x;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void coro_free(coro_t* c) {
+    munmap(c->stack, CORO_STACK_SIZE);
+    free(c);
+}
+
+static void coro_entry() {
+    coro_t* c = current_worker()->current;
+    c->fn(c->arg);
+    c->done = true;
+    swapcontext(&c->ctx, &current_worker()->sched_ctx);
+}
+
+// Switch back to the scheduler, parking on fd (or just yielding if fd < 0)
+static void coro_park(int fd, uint32_t events) {
+    worker_t* w = current_worker();
+    coro_t* c = w->current;
+    c->wait_fd = fd;
+    c->wait_events = events;
+    swapcontext(&c->ctx, &w->sched_ctx);
+    c->wait_fd = -1;
+}
+
+// Called on the worker stack after c switched out
+static void coro_after_switch(worker_t* w, coro_t* c) {
+    if (c->done) {
+        coro_free(c);
+        return;
+    }
+    if (c->suspending) {
+        c->suspending = false;
+        // Only now off its stack; a wake that came in meanwhile runs it again
+        int none = WAKE_NONE;
+        if (!atomic_compare_exchange_strong(&c->wake, &none, WAKE_PARKED)) {
+            atomic_store(&c->wake, WAKE_NONE);
+            ws_push(&w->deque, c);
+        }
+        return;
+    }
+    if (c->wait_fd < 0) {
+        ws_push(&w->deque, c);
+        return;
+    }
+    // Only armed once c is off its stack, so no other thread can resume it early.
+    // The fd always goes back to the home worker's epoll set, a stolen session
+    // returns to its home once it blocks.
+    struct epoll_event ev;
+    ev.events = c->wait_events | EPOLLONESHOT;
+    ev.data.ptr = c;
+    int op = c->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(c->home->epfd, op, c->wait_fd, &ev) == -1) {
+        // fd is unusable, let the coroutine see the error from read/write
+        ws_push(&w->deque, c);
+        return;
+    }
+    c->registered = true;
+}
+
+static void run_coro(worker_t* w, coro_t* c) {
+    w->current = c;
+    swapcontext(&w->sched_ctx, &c->ctx);
+    w->current = NULL;
+    coro_after_switch(w, c);
+}
+
+static void drain_inbox(worker_t* w) {
+    pthread_mutex_lock(&w->lock);
+    coro_t* c = w->inbox_head;
+    w->inbox_head = w->inbox_tail = NULL;
+    pthread_mutex_unlock(&w->lock);
+    while (c) {
+        coro_t* next = c->next;
+        ws_push(&w->deque, c);
+        c = next;
+    }
+}
+
+// @return events seen, the wakeup included
+static int poll_events(worker_t* w, int timeout) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+    int ready = 0;
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.ptr == NULL) {
+            uint64_t cnt;
+            read(w->wakefd, &cnt, sizeof(cnt));
+        } else {
+            ws_push(&w->deque, events[i].data.ptr);
+            ready++;
+        }
+    }
+    // More ready sessions than this worker can run right now
+    if (ready > 1) {
+        wake_idle(w);
+    }
+    return n;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Spin on epoll before sleeping in it. @return true if something arrived
+static bool busy_poll(worker_t* w) {
+    uint64_t deadline = now_ns() + busy_poll_us * 1000ull;
+    while (!stopping && now_ns() < deadline) {
+        if (poll_events(w, 0) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void* worker_main(void* vargp) {
+    worker_t* w = vargp;
+    self = w;
+    // Coroutine stacks are first touched here, so they end up on this node too
+    topo_pin_self(w->node);
+    if (pin_cpus) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET((w - workers) % sysconf(_SC_NPROCESSORS_ONLN), &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    while (!stopping) {
+        drain_inbox(w);
+        for (int i = 0; i < RUN_BATCH && !stopping; i++) {
+            // Local work is consumed from the top as well, so sessions are
+            // served in the order they became ready and a yield goes to the back
+            coro_t* c;
+            do {
+                c = ws_steal(&w->deque);
+            } while (c == WS_ABORT);
+            if (!c) {
+                c = steal_work(w);
+            }
+            if (!c) {
+                break;
+            }
+            run_coro(w, c);
+        }
+
+        if (ws_size(&w->deque) > 0) {
+            poll_events(w, 0);
+        } else if (busy_poll_us && busy_poll(w)) {
+            continue;
+        } else {
+            atomic_store(&w->idle, 1);
+            poll_events(w, steal_enabled ? IDLE_POLL_MS : -1);
+            atomic_store(&w->idle, 0);
+        }
+    }
+    return NULL;
+}
+
+void coro_sched_init(int nworkers) {
+    stopping = 0;
+    num_workers = nworkers;
+    workers = calloc(nworkers, sizeof(worker_t));
+    for (int i = 0; i < nworkers; i++) {
+        worker_t* w = &workers[i];
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        w->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (w->epfd == -1 || w->wakefd == -1) {
+            printf("coro worker init err\n");
+            exit(EXIT_FAILURE);
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wakefd, &ev);
+        pthread_mutex_init(&w->lock, NULL);
+        ws_deque_init(&w->deque, 256);
+        w->seed = i + 1;
+        w->node = i % topo_nodes();
+    }
+    // Workers block SIGINT so it keeps interrupting the accept loop
+    for (int i = 0; i < nworkers; i++) {
+        spawn_thread(&workers[i].tid, worker_main, &workers[i], "coro worker");
+    }
+}
+
+void coro_sched_shutdown() {
+    stopping = 1;
+    for (int i = 0; i < num_workers; i++) {
+        kick(&workers[i]);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i].tid, NULL);
+        close(workers[i].epfd);
+        close(workers[i].wakefd);
+        pthread_mutex_destroy(&workers[i].lock);
+        ws_deque_destroy(&workers[i].deque);
+    }
+    // Coroutines still parked at this point are abandoned with the process
+    free(workers);
+    workers = NULL;
+    num_workers = 0;
+}
+
+int coro_spawn(coro_fn fn, void* arg) {
+    if (!num_workers) {
+        return -1;
+    }
+    return coro_spawn_on(__atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED) % num_workers, fn, arg);
+}
+
+int coro_worker_on_node(int node) {
+    int nodes = topo_nodes();
+    node %= nodes;
+    int on_node = (num_workers - node + nodes - 1) / nodes;
+    if (on_node <= 0) {
+        return -1;
+    }
+    return node + nodes * (__atomic_fetch_add(&next_on_node[node], 1, __ATOMIC_RELAXED) % on_node);
+}
+
+int coro_spawn_on(int worker, coro_fn fn, void* arg) {
+    if (worker < 0 || worker >= num_workers) {
+        return -1;
+    }
+    coro_t* c = calloc(1, sizeof(coro_t));
+    if (!c) {
+        return -1;
+    }
+    c->stack = mmap(NULL, CORO_STACK_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (c->stack == MAP_FAILED) {
+        free(c);
+        return -1;
+    }
+    mprotect(c->stack, getpagesize(), PROT_NONE);
+
+    getcontext(&c->ctx);
+    c->ctx.uc_stack.ss_sp = c->stack;
+    c->ctx.uc_stack.ss_size = CORO_STACK_SIZE;
+    c->ctx.uc_link = NULL;
+    makecontext(&c->ctx, coro_entry, 0);
+    c->fn = fn;
+    c->arg = arg;
+    c->wait_fd = -1;
+
+    c->home = &workers[worker];
+    send_home(c);
+    return 0;
+}
+
+void coro_set_busy_poll(int us) {
+    busy_poll_us = us;
+}
+
+void coro_set_cpu_pinning(int enabled) {
+    pin_cpus = enabled;
+}
+
+void coro_set_stealing(int enabled) {
+    steal_enabled = enabled;
+}
+
+unsigned long coro_steal_count() {
+    unsigned long total = 0;
+    for (int i = 0; i < num_workers; i++) {
+        total += workers[i].steals;
+    }
+    return total;
+}
+
+int coro_running() {
+    worker_t* w = current_worker();
+    return w && w->current;
+}
+
+void** coro_local() {
+    worker_t* w = current_worker();
+    return w && w->current ? &w->current->local : NULL;
+}
+
+void coro_yield() {
+    if (coro_running()) {
+        coro_park(-1, 0);
+    }
+}
+
+void* coro_self() {
+    worker_t* w = current_worker();
+    return w ? w->current : NULL;
+}
+
+void coro_suspend() {
+    worker_t* w = current_worker();
+    if (!w || !w->current) {
+        return;
+    }
+    coro_t* c = w->current;
+    if (atomic_load(&c->wake) == WAKE_PENDING) {
+        atomic_store(&c->wake, WAKE_NONE);
+        return;
+    }
+    c->suspending = true;
+    coro_park(-1, 0);
+}
+
+void coro_wake(void* handle) {
+    coro_t* c = handle;
+    if (atomic_exchange(&c->wake, WAKE_PENDING) == WAKE_PARKED) {
+        atomic_store(&c->wake, WAKE_NONE);
+        send_home(c);
+    }
+}
+
+int coro_set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * One read()/write() and its errno. A park can resume the coroutine on
+ * another worker, and __errno_location() is declared const, so the caller's
+ * frame could keep the old thread's errno address across it; here it is
+ * looked up fresh every time.
+ */
+static __attribute__((noipa)) ssize_t io_once(int fd, void* buf, size_t count, bool writing, int* err) {
+    ssize_t n = writing ? write(fd, buf, count) : read(fd, buf, count);
+    *err = n < 0 ? errno : 0;
+    return n;
+}
+
+ssize_t coro_read(int fd, void* buf, size_t count) {
+    if (!coro_running()) {
+        return read(fd, buf, count);
+    }
+    while (1) {
+        int err;
+        ssize_t n = io_once(fd, buf, count, false, &err);
+        if (n >= 0 || (err != EAGAIN && err != EWOULDBLOCK)) {
+            return n;
+        }
+        coro_park(fd, EPOLLIN);
+    }
+}
+
+ssize_t coro_write(int fd, const void* buf, size_t count) {
+    if (!coro_running()) {
+        return write(fd, buf, count);
+    }
+    size_t done = 0;
+    while (done < count) {
+        int err;
+        ssize_t n = io_once(fd, (char*) buf + done, count - done, true, &err);
+        if (n > 0) {
+            done += n;
+        } else if (n == -1 && (err == EAGAIN || err == EWOULDBLOCK)) {
+            coro_park(fd, EPOLLOUT);
+        } else {
+            return done ? (ssize_t) done : n;
+        }
+    }
+    return done;
+}
@@ -0,0 +1,246 @@
+#include "donormap.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core.h"
+
+typedef struct {
+    uint64_t key;  // 0 while free
+    uint64_t total;
+} donor_slot_t;
+
+typedef struct donor_table {
+    size_t mask;                // slots - 1
+    size_t used;
+    struct donor_table* prev;   // retired tables, still read by lookups in flight
+    donor_slot_t slots[];
+} donor_table_t;
+
+// Each stripe is a table of its own, for the donors whose hash picks it
+typedef struct {
+    pthread_mutex_t lock;
+    donor_table_t* table;
+} __attribute__((aligned(CACHE_LINE))) donor_stripe_t;
+
+static donor_stripe_t stripes[DONOR_STRIPES];
+
+// Top donors, threshold is the lowest total on a full list
+static donor_total_t top[MAX_TOP_DONORS];
+static int top_len;
+static uint64_t top_threshold;
+static pthread_mutex_t top_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t hash(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+static donor_table_t* table_new(size_t slots) {
+    donor_table_t* t = calloc(1, sizeof(donor_table_t) + slots * sizeof(donor_slot_t));
+    if (t == NULL) {
+        printf("donor table alloc err\n");
+        exit(EXIT_FAILURE);
+    }
+    t->mask = slots - 1;
+    return t;
+}
+
+// High bits pick the stripe, low bits the slot
+static donor_stripe_t* stripe_of(uint64_t donor) {
+    return &stripes[hash(donor) >> 58];
+}
+
+// @return the donor's slot, claimed if create is set (stripe lock held); NULL if absent
+static donor_slot_t* probe(donor_table_t* t, uint64_t donor, bool create) {
+    size_t i = hash(donor) & t->mask;
+    for (size_t n = 0; n <= t->mask; n++, i = (i + 1) & t->mask) {
+        donor_slot_t* s = &t->slots[i];
+        uint64_t key = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+        if (key == donor) {
+            return s;
+        }
+        if (key == 0) {
+            if (!create) {
+                return NULL;
+            }
+            __atomic_store_n(&s->key, donor, __ATOMIC_RELEASE);
+            __atomic_store_n(&t->used, t->used + 1, __ATOMIC_RELAXED);
+            return s;
+        }
+    }
+    return NULL;
+}
+
+// Stripe lock held, only its own donors move and the other stripes keep going
+static void resize(donor_stripe_t* st) {
+    donor_table_t* old = st->table;
+    size_t slots = old->mask + 1;
+    donor_table_t* t = table_new(slots * 2);
+    for (size_t i = 0; i < slots; i++) {
+        if (old->slots[i].key) {
+            donor_slot_t* s = probe(t, old->slots[i].key, true);
+            s->total = old->slots[i].total;
+        }
+    }
+    t->prev = old;
+    __atomic_store_n(&st->table, t, __ATOMIC_RELEASE);
+}
+
+static void top_update(uint64_t donor, uint64_t total) {
+    if (total <= __atomic_load_n(&top_threshold, __ATOMIC_RELAXED)) {
+        return;
+    }
+    pthread_mutex_lock(&top_lock);
+    int i, min = 0;
+    for (i = 0; i < top_len && top[i].donor != donor; i++) {
+        if (top[i].total < top[min].total) {
+            min = i;
+        }
+    }
+    if (i < top_len) {
+        if (total > top[i].total) {
+            top[i].total = total;
+        }
+    } else if (top_len < MAX_TOP_DONORS) {
+        top[top_len].donor = donor;
+        top[top_len].total = total;
+        top_len++;
+    } else if (total > top[min].total) {
+        top[min].donor = donor;
+        top[min].total = total;
+    }
+    if (top_len == MAX_TOP_DONORS) {
+        uint64_t lowest = top[0].total;
+        for (i = 1; i < top_len; i++) {
+            if (top[i].total < lowest) {
+                lowest = top[i].total;
+            }
+        }
+        __atomic_store_n(&top_threshold, lowest, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&top_lock);
+}
+
+void donors_init() {
+    for (int i = 0; i < DONOR_STRIPES; i++) {
+        if (pthread_mutex_init(&stripes[i].lock, NULL)) {
+            printf("mutex init err\n");
+            exit(EXIT_FAILURE);
+        }
+        stripes[i].table = table_new(DONOR_INITIAL_SLOTS / DONOR_STRIPES);
+    }
+    top_len = 0;
+    top_threshold = 0;
+}
+
+void donors_destroy() {
+    for (int i = 0; i < DONOR_STRIPES; i++) {
+        donor_table_t* t = stripes[i].table;
+        while (t) {
+            donor_table_t* prev = t->prev;
+            free(t);
+            t = prev;
+        }
+        stripes[i].table = NULL;
+        pthread_mutex_destroy(&stripes[i].lock);
+    }
+}
+
+void donors_add(uint64_t donor, uint64_t amount) {
+    if (donor == 0) {
+        return;
+    }
+    donor_stripe_t* st = stripe_of(donor);
+    pthread_mutex_lock(&st->lock);
+    // Grown before it fills, so there is always a free slot
+    donor_slot_t* s = probe(st->table, donor, true);
+    uint64_t total = __atomic_add_fetch(&s->total, amount, __ATOMIC_RELAXED);
+    if (st->table->used * 10 > (st->table->mask + 1) * 7) {
+        resize(st);
+    }
+    pthread_mutex_unlock(&st->lock);
+
+    top_update(donor, total);
+}
+
+uint64_t donors_get(uint64_t donor) {
+    if (donor == 0) {
+        return 0;
+    }
+    donor_table_t* t = __atomic_load_n(&stripe_of(donor)->table, __ATOMIC_ACQUIRE);
+    donor_slot_t* s = probe(t, donor, false);
+    return s ? __atomic_load_n(&s->total, __ATOMIC_RELAXED) : 0;
+}
+
+static int cmp_total(const void* a, const void* b) {
+    uint64_t x = ((const donor_total_t*) a)->total, y = ((const donor_total_t*) b)->total;
+    return x < y ? 1 : -(x > y);
+}
+
+int donors_top(donor_total_t* out, int n) {
+    donor_total_t copy[MAX_TOP_DONORS];
+    pthread_mutex_lock(&top_lock);
+    int len = top_len;
+    memcpy(copy, top, sizeof(donor_total_t) * len);
+    pthread_mutex_unlock(&top_lock);
+
+    qsort(copy, len, sizeof(donor_total_t), cmp_total);
+    if (n > len) {
+        n = len;
+    }
+    memcpy(out, copy, sizeof(donor_total_t) * n);
+    return n;
+}
+
+size_t donors_top_reply(const message_t* req, char* buf) {
+    message_t reply = *req;
+    uint64_t n = req->msgdata.donation.amount;
+    if (n == 0 || n > MAX_TOP_DONORS) {
+        n = MAX_TOP_DONORS;
+    }
+    donor_total_t* entries = (donor_total_t*) (buf + sizeof(message_t));
+    int len = donors_top(entries, n);
+    reply.msgdata.donation.amount = len * sizeof(donor_total_t);
+    memcpy(buf, &reply, sizeof(message_t));
+    return sizeof(message_t) + reply.msgdata.donation.amount;
+}
+
+size_t donors_count() {
+    size_t n = 0;
+    for (int i = 0; i < DONOR_STRIPES; i++) {
+        donor_table_t* t = __atomic_load_n(&stripes[i].table, __ATOMIC_ACQUIRE);
+        n += __atomic_load_n(&t->used, __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+donor_total_t* donors_export(size_t* n) {
+    donor_total_t* out = malloc(sizeof(donor_total_t) * (donors_count() + 1));
+    size_t len = 0;
+    for (int j = 0; j < DONOR_STRIPES; j++) {
+        donor_table_t* t = stripes[j].table;
+        for (size_t i = 0; i <= t->mask; i++) {
+            if (t->slots[i].key) {
+                out[len].donor = t->slots[i].key;
+                out[len].total = t->slots[i].total;
+                len++;
+            }
+        }
+    }
+    *n = len;
+    return out;
+}
+
+void donors_import(const donor_total_t* in, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        donors_add(in[i].donor, in[i].total);
+    }
+}
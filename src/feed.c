@@ -0,0 +1,215 @@
+#include "feed.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "protocol_ext.h"
+#include "util.h"
+
+typedef struct {
+    int refs;  // feed_lock held
+    size_t len;
+    char data[sizeof(message_t) + sizeof(feed_update_t)];
+} feed_buf_t;
+
+typedef struct {
+    int fd;
+    uint64_t interval_ms;
+    uint64_t next_due_ms;
+    uint64_t seq;          // newest update queued for this subscriber
+    feed_buf_t* current;   // being written, sent bytes in off
+    size_t off;
+    feed_buf_t* pending;   // newest update behind current, replaced not queued
+    bool dead;             // a send failed, wait for the handler to unsubscribe
+} feed_sub_t;
+
+static pthread_mutex_t feed_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t feed_cond = PTHREAD_COND_INITIALIZER;
+static feed_sub_t* subs;
+static int num_subs;
+static int subs_cap;
+static feed_buf_t* latest;
+static bool stopping;
+static bool running;
+static pthread_t feed_tid;
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static void buf_release(feed_buf_t* b) {
+    if (b && --b->refs == 0) {
+        free(b);
+    }
+}
+
+static feed_buf_t* encode(const feed_update_t* u) {
+    feed_buf_t* b = malloc(sizeof(feed_buf_t));
+    if (b == NULL) {
+        printf("feed alloc err\n");
+        exit(EXIT_FAILURE);
+    }
+    message_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msgtype = SUBSCRIBE;
+    hdr.msgdata.donation.amount = sizeof(feed_update_t);
+    memcpy(b->data, &hdr, sizeof(hdr));
+    memcpy(b->data + sizeof(hdr), u, sizeof(*u));
+    b->len = sizeof(b->data);
+    b->refs = 1;
+    return b;
+}
+
+// feed_lock held. Write as much as the socket takes without blocking.
+static void flush(feed_sub_t* s) {
+    while (s->current && !s->dead) {
+        ssize_t n = send(s->fd, s->current->data + s->off, s->current->len - s->off, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                s->dead = true;
+            }
+            return;
+        }
+        s->off += n;
+        if (s->off == s->current->len) {
+            buf_release(s->current);
+            s->current = s->pending;
+            s->pending = NULL;
+            s->off = 0;
+        }
+    }
+}
+
+// feed_lock held
+static void fan_out(uint64_t now, uint64_t seq) {
+    for (int i = 0; i < num_subs; i++) {
+        feed_sub_t* s = &subs[i];
+        if (latest && s->seq < seq && now >= s->next_due_ms) {
+            latest->refs++;
+            if (s->current == NULL) {
+                s->current = latest;
+                s->off = 0;
+            } else {
+                // Whatever was waiting is superseded
+                buf_release(s->pending);
+                s->pending = latest;
+            }
+            s->seq = seq;
+            s->next_due_ms = now + s->interval_ms;
+        }
+        flush(s);
+    }
+}
+
+static void* feed_thread(void* arg) {
+    feed_update_t cur;
+    uint64_t seq = 0;
+    uint64_t version = 0;
+
+    pthread_mutex_lock(&feed_lock);
+    while (!stopping) {
+        bool watched = num_subs > 0;
+        pthread_mutex_unlock(&feed_lock);
+        // Only snapshot (and take the strategy's locks) when something changed
+        // and someone is subscribed, the first subscriber still finds it changed
+        uint64_t v = watched ? core_version_all() : version;
+        if (v != version) {
+            version = v;
+            memset(&cur, 0, sizeof(cur));
+            core_snapshot(&cur.state);
+            cur.seq = ++seq;
+            feed_buf_t* b = encode(&cur);
+            pthread_mutex_lock(&feed_lock);
+            buf_release(latest);
+            latest = b;
+        } else {
+            pthread_mutex_lock(&feed_lock);
+        }
+        uint64_t now = now_ms();
+        fan_out(now, seq);
+
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += FEED_TICK_MS * 1000000L;
+        until.tv_sec += until.tv_nsec / 1000000000L;
+        until.tv_nsec %= 1000000000L;
+        while (!stopping && pthread_cond_timedwait(&feed_cond, &feed_lock, &until) != ETIMEDOUT) {
+        }
+    }
+    pthread_mutex_unlock(&feed_lock);
+    return NULL;
+}
+
+void feed_start() {
+    stopping = false;
+    // Signals are for the accept loop, not the publisher
+    spawn_thread(&feed_tid, feed_thread, NULL, "feed");
+    running = true;
+}
+
+void feed_stop() {
+    if (!running) {
+        return;
+    }
+    pthread_mutex_lock(&feed_lock);
+    stopping = true;
+    pthread_cond_signal(&feed_cond);
+    pthread_mutex_unlock(&feed_lock);
+    pthread_join(feed_tid, NULL);
+    running = false;
+
+    pthread_mutex_lock(&feed_lock);
+    for (int i = 0; i < num_subs; i++) {
+        buf_release(subs[i].current);
+        buf_release(subs[i].pending);
+    }
+    free(subs);
+    subs = NULL;
+    num_subs = subs_cap = 0;
+    buf_release(latest);
+    latest = NULL;
+    pthread_mutex_unlock(&feed_lock);
+}
+
+void feed_subscribe(int fd, uint64_t interval_ms) {
+    pthread_mutex_lock(&feed_lock);
+    if (num_subs == subs_cap) {
+        subs_cap = subs_cap ? subs_cap * 2 : 64;
+        subs = realloc(subs, subs_cap * sizeof(feed_sub_t));
+        if (subs == NULL) {
+            printf("feed realloc err\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    feed_sub_t* s = &subs[num_subs++];
+    memset(s, 0, sizeof(*s));
+    s->fd = fd;
+    s->interval_ms = interval_ms;
+    pthread_mutex_unlock(&feed_lock);
+}
+
+bool feed_unsubscribe(int fd) {
+    bool boundary = true;
+    pthread_mutex_lock(&feed_lock);
+    for (int i = 0; i < num_subs; i++) {
+        if (subs[i].fd == fd) {
+            boundary = !subs[i].dead && subs[i].off == 0;
+            buf_release(subs[i].current);
+            buf_release(subs[i].pending);
+            subs[i] = subs[--num_subs];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&feed_lock);
+    return boundary;
+}
@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+#include "lifecycle.h"
+#include "donormap.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HANDOFF_ENV "ZOTDONATE_HANDOFF_FD"
+#define FORCE_GRACE_MS 1000  // after forcing sockets closed, how long to wait for handlers
+
+volatile sig_atomic_t draining = 0;
+volatile sig_atomic_t restart_requested = 0;
+int restarted = 0;
+
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sessions_cond;
+static pthread_once_t sessions_once = PTHREAD_ONCE_INIT;
+static bool* session_open;  // indexed by fd
+static int session_cap;
+static int num_sessions;
+
+void restart_handler(int sig) {
+    restart_requested = 1;
+}
+
+void wakeup_handler(int sig) {
+}
+
+static void sessions_init() {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sessions_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+void session_register(int fd) {
+    pthread_once(&sessions_once, sessions_init);
+    pthread_mutex_lock(&sessions_lock);
+    if (fd >= session_cap) {
+        int cap = session_cap ? session_cap : 64;
+        while (cap <= fd) {
+            cap *= 2;
+        }
+        session_open = realloc(session_open, cap * sizeof(bool));
+        if (session_open == NULL) {
+            printf("session registry realloc err\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(session_open + session_cap, 0, (cap - session_cap) * sizeof(bool));
+        session_cap = cap;
+    }
+    if (!session_open[fd]) {
+        session_open[fd] = true;
+        num_sessions++;
+    }
+    // Accepted after the drain started, do not let it read anything new
+    if (draining) {
+        shutdown(fd, SHUT_RD);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+void session_unregister(int fd) {
+    pthread_once(&sessions_once, sessions_init);
+    pthread_mutex_lock(&sessions_lock);
+    if (fd >= 0 && fd < session_cap && session_open[fd]) {
+        session_open[fd] = false;
+        num_sessions--;
+        pthread_cond_broadcast(&sessions_cond);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+int session_count() {
+    pthread_mutex_lock(&sessions_lock);
+    int n = num_sessions;
+    pthread_mutex_unlock(&sessions_lock);
+    return n;
+}
+
+// sessions_lock held
+static void shutdown_sessions(int how) {
+    for (int fd = 0; fd < session_cap; fd++) {
+        if (session_open[fd]) {
+            shutdown(fd, how);
+        }
+    }
+}
+
+// sessions_lock held, false once the deadline passed with sessions left
+static bool wait_sessions(const struct timespec* deadline) {
+    while (num_sessions > 0) {
+        if (pthread_cond_timedwait(&sessions_cond, &sessions_lock, deadline) == ETIMEDOUT) {
+            return num_sessions == 0;
+        }
+    }
+    return true;
+}
+
+static struct timespec deadline_after(uint64_t ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+int drain_sessions(uint64_t deadline_ms) {
+    pthread_once(&sessions_once, sessions_init);
+    draining = 1;
+
+    pthread_mutex_lock(&sessions_lock);
+    // Readers see EOF after the requests already received, replies still go out
+    shutdown_sessions(SHUT_RD);
+    struct timespec deadline = deadline_after(deadline_ms);
+    int forced = 0;
+    if (!wait_sessions(&deadline)) {
+        // Stuck writing to a client that stopped reading
+        forced = num_sessions;
+        shutdown_sessions(SHUT_RDWR);
+        deadline = deadline_after(FORCE_GRACE_MS);
+        wait_sessions(&deadline);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+    return forced;
+}
+
+int restart_inherited_fd() {
+    const char* env = getenv(HANDOFF_ENV);
+    if (env == NULL) {
+        return -1;
+    }
+    int fd = atoi(env);
+    unsetenv(HANDOFF_ENV);
+    restarted = 1;
+    // Started through /proc/self/exe, which would otherwise be its name in ps
+    prctl(PR_SET_NAME, program_invocation_short_name);
+    return fd;
+}
+
+// @return pid of the new process, channel to it in *channel, or -1
+static pid_t restart_spawn(char* argv[], int* channel) {
+    int sp[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == -1) {
+        return -1;
+    }
+    // Set up the environment before fork, the child may only use async-signal-safe calls
+    char fdbuf[16];
+    snprintf(fdbuf, sizeof(fdbuf), "%d", 3);
+    setenv(HANDOFF_ENV, fdbuf, 1);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Only the handoff channel survives, client sockets must not leak into the new image
+        if (sp[1] != 3 && dup2(sp[1], 3) == -1) {
+            _exit(EXIT_FAILURE);
+        }
+        close_range(4, ~0U, 0);
+        // argv[0] may be relative to a cwd that changed, or the binary replaced
+        execv("/proc/self/exe", argv);
+        _exit(EXIT_FAILURE);
+    }
+    unsetenv(HANDOFF_ENV);
+    close(sp[1]);
+    if (pid == -1) {
+        close(sp[0]);
+        return -1;
+    }
+    *channel = sp[0];
+    return pid;
+}
+
+// Listeners per SCM_RIGHTS message, far below the kernel's SCM_MAX_FD; a
+// steered server has one per worker, so they go in as many as it takes
+#define RESTART_FDS_PER_MSG 64
+
+static int restart_send_listeners(int channel, const int* fds, int n) {
+    char byte = 'L';
+    char control[CMSG_SPACE(sizeof(int) * RESTART_FDS_PER_MSG)];
+    for (int sent = 0; sent < n; sent += RESTART_FDS_PER_MSG) {
+        int k = n - sent < RESTART_FDS_PER_MSG ? n - sent : RESTART_FDS_PER_MSG;
+        struct iovec iov = {&byte, 1};
+        memset(control, 0, sizeof(control));
+
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * k);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * k);
+        memcpy(CMSG_DATA(cmsg), fds + sent, sizeof(int) * k);
+        if (sendmsg(channel, &msg, 0) != 1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int restart_recv_listeners(int channel, int* fds, int n) {
+    char byte;
+    char control[CMSG_SPACE(sizeof(int) * RESTART_FDS_PER_MSG)];
+    for (int got = 0; got < n; got += RESTART_FDS_PER_MSG) {
+        int k = n - got < RESTART_FDS_PER_MSG ? n - got : RESTART_FDS_PER_MSG;
+        struct iovec iov = {&byte, 1};
+
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(channel, &msg, MSG_CMSG_CLOEXEC) != 1) {
+            return -1;
+        }
+        // The old process must have run with as many listeners
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * k)) {
+            return -1;
+        }
+        memcpy(fds + got, CMSG_DATA(cmsg), sizeof(int) * k);
+    }
+    return 0;
+}
+
+int restart_ack(int channel) {
+    char byte = 'A';
+    return write(channel, &byte, 1) == 1 ? 0 : -1;
+}
+
+static int wait_ack(int channel) {
+    struct pollfd pfd = {channel, POLLIN, 0};
+    int n;
+    do {
+        n = poll(&pfd, 1, RESTART_ACK_MS);
+    } while (n < 0 && errno == EINTR);
+    char byte;
+    return n == 1 && read(channel, &byte, 1) == 1 && byte == 'A' ? 0 : -1;
+}
+
+int restart_handoff(char* argv[], const int* fds, int n) {
+    int channel;
+    pid_t pid = restart_spawn(argv, &channel);
+    if (pid < 0) {
+        return -1;
+    }
+    // A child whose exec failed closes the channel, the wait ends right away
+    if (restart_send_listeners(channel, fds, n) || wait_ack(channel)) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(channel);
+        return -1;
+    }
+    return channel;
+}
+
+int restart_send_state(int channel) {
+    core_state_t state;
+    core_export(&state);
+    size_t n;
+    donor_total_t* donors = donors_export(&n);
+    uint64_t count = n;
+    int err = write_all(channel, &state, sizeof(state)) || write_all(channel, &count, sizeof(count)) ||
+              write_all(channel, donors, sizeof(donor_total_t) * n);
+    free(donors);
+    return err ? -1 : 0;
+}
+
+int restart_recv_state(int channel, uint64_t drain_ms) {
+    uint64_t wait_ms = drain_ms + RESTART_STATE_SLACK_MS;
+    struct timeval tv = {wait_ms / 1000, (wait_ms % 1000) * 1000};
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (setsockopt(channel, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))) {
+        return -1;
+    }
+    core_state_t state;
+    uint64_t count;
+    if (read_all(channel, &state, sizeof(state)) || read_all(channel, &count, sizeof(count))) {
+        return -1;
+    }
+    donor_total_t* donors = malloc(sizeof(donor_total_t) * (count + 1));
+    if (donors == NULL || read_all(channel, donors, sizeof(donor_total_t) * count)) {
+        free(donors);
+        return -1;
+    }
+    core_import(&state);
+    donors_import(donors, count);
+    free(donors);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Restart accept gap %ld ms.\n",
+           (long) ((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000));
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include "mux.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MUX_INITIAL_CAP 16
+
+static uint32_t slot_of(const mux_table_t* t, uint32_t id) {
+    // Fibonacci hashing, gateways tend to hand out sequential ids
+    return (uint32_t) (id * 2654435769u) & (t->cap - 1);
+}
+
+static session_t* alloc_slots(uint32_t cap) {
+    session_t* slots = calloc(cap, sizeof(session_t));
+    if (slots == NULL) {
+        printf("mux table alloc err\n");
+        exit(EXIT_FAILURE);
+    }
+    return slots;
+}
+
+void mux_init(mux_table_t* t) {
+    t->cap = MUX_INITIAL_CAP;
+    t->count = 0;
+    t->slots = alloc_slots(t->cap);
+}
+
+void mux_destroy(mux_table_t* t) {
+    free(t->slots);
+    t->slots = NULL;
+    t->cap = t->count = 0;
+}
+
+static session_t* place(mux_table_t* t, uint32_t id) {
+    uint32_t i = slot_of(t, id);
+    while (t->slots[i].used && t->slots[i].id != id) {
+        i = (i + 1) & (t->cap - 1);
+    }
+    return &t->slots[i];
+}
+
+// Doubles at 50% load, probes stay short
+static void grow(mux_table_t* t) {
+    session_t* old = t->slots;
+    uint32_t old_cap = t->cap;
+    t->cap *= 2;
+    t->slots = alloc_slots(t->cap);
+    for (uint32_t i = 0; i < old_cap; i++) {
+        if (old[i].used) {
+            *place(t, old[i].id) = old[i];
+        }
+    }
+    free(old);
+}
+
+session_t* mux_get(mux_table_t* t, uint32_t id) {
+    session_t* s = place(t, id);
+    if (s->used) {
+        return s;
+    }
+    if (t->count == MUX_MAX_SESSIONS) {
+        return NULL;
+    }
+    if ((t->count + 1) * 2 > t->cap) {
+        grow(t);
+        s = place(t, id);
+    }
+    s->used = true;
+    s->id = id;
+    s->donation_total = 0;
+    s->donor = 0;
+    rate_bucket_init(&s->rate_bucket);
+    memset(&s->mark, 0, sizeof(s->mark));
+    t->count++;
+    return s;
+}
+
+// Backward-shift deletion, no tombstones
+void mux_remove(mux_table_t* t, uint32_t id) {
+    session_t* s = place(t, id);
+    if (!s->used) {
+        return;
+    }
+    uint32_t mask = t->cap - 1;
+    uint32_t hole = s - t->slots;
+    uint32_t i = hole;
+    while (1) {
+        i = (i + 1) & mask;
+        if (!t->slots[i].used) {
+            break;
+        }
+        uint32_t home = slot_of(t, t->slots[i].id);
+        // Move it back unless its home lies cyclically in (hole, i]
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            t->slots[hole] = t->slots[i];
+            hole = i;
+        }
+    }
+    t->slots[hole].used = false;
+    t->count--;
+}
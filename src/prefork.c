@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+#include "prefork.h"
+#include "core.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static int worker_index = -1;
+static volatile sig_atomic_t stopping;
+
+static void stop_handler(int sig) {
+    stopping = 1;
+}
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+// @return the child's pid in the supervisor, 0 in the child
+static pid_t spawn(int index, pid_t supervisor) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        printf("prefork fork err\n");
+        return -1;
+    }
+    if (pid == 0) {
+        // Never outlive the supervisor, whose exit frees nothing the workers need
+        // but leaves nobody to restart them
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != supervisor) {
+            exit(EXIT_FAILURE);
+        }
+        worker_index = index;
+        core_share_attach();
+        // The server installs its own handlers
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+    }
+    return pid;
+}
+
+int prefork_start(int procs) {
+    pid_t supervisor = getpid();
+    pid_t* pids = calloc(procs, sizeof(pid_t));
+    uint64_t* started = calloc(procs, sizeof(uint64_t));
+    if (pids == NULL || started == NULL) {
+        printf("prefork alloc err\n");
+        exit(EXIT_FAILURE);
+    }
+    struct sigaction stop_action = {{0}};
+    stop_action.sa_handler = stop_handler;
+    if (sigaction(SIGINT, &stop_action, NULL) == -1 || sigaction(SIGTERM, &stop_action, NULL) == -1) {
+        printf("signal handler failed to install\n");
+        exit(EXIT_FAILURE);
+    }
+    // Workers are replaced one by one, the supervisor itself never restarts
+    signal(SIGUSR2, SIG_IGN);
+
+    for (int i = 0; i < procs; i++) {
+        pids[i] = spawn(i, supervisor);
+        if (pids[i] == 0) {
+            free(pids);
+            free(started);
+            return i;
+        }
+        started[i] = now_ms();
+    }
+    printf("Supervising %d workers.\n", procs);
+
+    int alive = procs;
+    bool forwarded = false;
+    while (alive) {
+        if (stopping && !forwarded) {
+            for (int i = 0; i < procs; i++) {
+                if (pids[i] > 0) {
+                    kill(pids[i], SIGINT);
+                }
+            }
+            forwarded = true;
+        }
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        int i = 0;
+        while (i < procs && pids[i] != pid) {
+            i++;
+        }
+        if (i == procs) {
+            continue;
+        }
+        pids[i] = -1;
+        alive--;
+        if (core_share_recover(pid)) {
+            printf("worker %d died holding the top 3 lock, released\n", i);
+        }
+        bool crashed = WIFSIGNALED(status) || WEXITSTATUS(status) != 0;
+        if (stopping || !crashed) {
+            continue;
+        }
+        if (WIFSIGNALED(status)) {
+            printf("worker %d (pid %d) killed by signal %d, restarting\n", i, pid, WTERMSIG(status));
+        } else {
+            printf("worker %d (pid %d) exited with %d, restarting\n", i, pid, WEXITSTATUS(status));
+        }
+        // A worker that can not even start must not turn into a fork loop
+        if (now_ms() - started[i] < PREFORK_BACKOFF_MS) {
+            usleep(PREFORK_BACKOFF_MS * 1000);
+        }
+        pids[i] = spawn(i, supervisor);
+        if (pids[i] == 0) {
+            free(pids);
+            free(started);
+            return i;
+        }
+        if (pids[i] > 0) {
+            started[i] = now_ms();
+            alive++;
+        }
+    }
+    free(pids);
+    free(started);
+    return -1;
+}
+
+int prefork_worker() {
+    return worker_index;
+}
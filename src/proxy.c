@@ -0,0 +1,480 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "core.h"
+#include "part.h"
+#include "protocol_ext.h"
+#include "zclient.h"
+#include "util.h"
+
+/*
+ * ZotDonate_proxy, the front of a partitioned cluster (part.h). Clients
+ * speak the MT server protocol (DONATE, CINFO, TOP, STATS, LOGOUT). Each
+ * worker thread runs one poll loop over its own SO_REUSEPORT listener, its
+ * clients and its pipelined connections to every partition (zclient.h).
+ * A client may pipeline up to PROXY_WINDOW requests; each takes a reply
+ * slot, partition replies fill or merge into the slot, and slots are sent
+ * back in request order.
+ */
+#define USAGE_MSG "ZotDonate_proxy [-h] [-w WORKERS] [-c CONNS] PORT_NUMBER PARTITION..."\
+                  "\n  -h                 Displays this help menu and returns EXIT_SUCCESS."\
+                  "\n  -w WORKERS         Proxy threads, each with its own listener and partition connections (default 1)."\
+                  "\n  -c CONNS           Connections from each worker to each partition (default 2)."\
+                  "\n  PORT_NUMBER        Port number to listen on."\
+                  "\n  PARTITION          HOST:PORT of partition 0, 1, ... as started with -P IDX/N.\n"
+
+#define PROXY_WINDOW 256
+#define PROXY_TICK_MS 100
+
+struct client;
+
+typedef struct {
+    struct client* c;
+    message_t msg;   // the request, then the reply being built
+    int waiting;     // partition replies still due
+    int merged;      // partition replies already merged
+    bool failed;
+    bool silent;     // LOGOUT, nothing is sent back
+    bool fold_due;   // LOGOUT, fold the total once every earlier request is done
+} slot_t;
+
+typedef struct client {
+    int fd;
+    uint64_t id;
+    uint64_t donation_total;
+    char in[sizeof(message_t)];
+    size_t in_len;
+    slot_t slots[PROXY_WINDOW];
+    uint32_t head, count;
+    char out[PROXY_WINDOW * sizeof(message_t)];
+    size_t out_len, out_off;
+    bool closing;  // LOGOUT or EOF, nothing more is read
+    bool dead;     // the socket failed, replies are dropped
+} client_t;
+
+typedef struct {
+    int listen_fd;
+    zc_pool_t** pools;  // one per partition
+    client_t** clients;
+    int num_clients, clients_cap;
+    pthread_t tid;
+} worker_t;
+
+static int port;
+static int num_parts;
+static char** part_addrs;
+static int conns_per_part = 2;
+static volatile sig_atomic_t stopping;
+static uint64_t next_client_id;
+
+/********************** replies *************/
+static void client_send(client_t* c) {
+    while (!c->dead && c->out_off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                c->dead = true;
+            }
+            return;
+        }
+        c->out_off += n;
+    }
+    c->out_off = c->out_len = 0;
+}
+
+static void route(worker_t* w, slot_t* s, int part, const message_t* req);
+
+// Send the finished slots at the head, in request order
+static void client_flush(worker_t* w, client_t* c) {
+    while (c->count) {
+        slot_t* s = &c->slots[c->head];
+        if (s->fold_due) {
+            // Every earlier DONATE has settled, the total is final
+            s->fold_due = false;
+            if (c->donation_total) {
+                message_t fold = {0};
+                fold.msgtype = FOLD_TOTAL;
+                fold.msgdata.donation.amount = c->donation_total;
+                route(w, s, c->id % num_parts, &fold);
+            }
+        }
+        if (s->waiting) {
+            break;
+        }
+        if (!s->silent) {
+            if (s->failed) {
+                s->msg.msgtype = ERROR;
+            }
+            memcpy(c->out + c->out_len, &s->msg, sizeof(message_t));
+            c->out_len += sizeof(message_t);
+        }
+        c->head = (c->head + 1) % PROXY_WINDOW;
+        c->count--;
+    }
+    client_send(c);
+}
+
+static void fold_top(uint64_t top[3], uint64_t v) {
+    if (v > top[0]) {
+        top[2] = top[1];
+        top[1] = top[0];
+        top[0] = v;
+    } else if (v > top[1]) {
+        top[2] = top[1];
+        top[1] = v;
+    } else if (v > top[2]) {
+        top[2] = v;
+    }
+}
+
+// Ties go to the lower charity index, like core_stats()
+static void merge_stats(message_t* into, const message_t* part) {
+    if (part->msgdata.stats.amount_high > into->msgdata.stats.amount_high ||
+        (part->msgdata.stats.amount_high == into->msgdata.stats.amount_high &&
+         part->msgdata.stats.charityID_high < into->msgdata.stats.charityID_high)) {
+        into->msgdata.stats.amount_high = part->msgdata.stats.amount_high;
+        into->msgdata.stats.charityID_high = part->msgdata.stats.charityID_high;
+    }
+    if (part->msgdata.stats.amount_low < into->msgdata.stats.amount_low ||
+        (part->msgdata.stats.amount_low == into->msgdata.stats.amount_low &&
+         part->msgdata.stats.charityID_low < into->msgdata.stats.charityID_low)) {
+        into->msgdata.stats.amount_low = part->msgdata.stats.amount_low;
+        into->msgdata.stats.charityID_low = part->msgdata.stats.charityID_low;
+    }
+}
+
+static void on_part_reply(const zc_reply_t* r, void* arg) {
+    slot_t* s = arg;
+    client_t* c = s->c;
+    s->waiting--;
+    if (r->status != ZC_OK || r->msg.msgtype == ERROR) {
+        s->failed = true;
+    } else {
+        switch (s->msg.msgtype) {
+            case DONATE:
+                c->donation_total += r->msg.msgdata.donation.amount;
+                s->msg = r->msg;
+                break;
+            case CINFO:
+                s->msg = r->msg;
+                break;
+            case TOP:
+                for (int i = 0; i < 3; i++) {
+                    fold_top(s->msg.msgdata.maxDonations, r->msg.msgdata.maxDonations[i]);
+                }
+                break;
+            case STATS:
+                if (s->merged == 0) {
+                    s->msg = r->msg;
+                } else {
+                    merge_stats(&s->msg, &r->msg);
+                }
+                break;
+        }
+        s->merged++;
+    }
+}
+
+static void route(worker_t* w, slot_t* s, int part, const message_t* req) {
+    s->waiting++;
+    if (zc_pool_submit(w->pools[part], req, on_part_reply, s)) {
+        s->waiting--;
+        s->failed = true;
+    }
+}
+
+/********************** requests ************/
+static void handle(worker_t* w, client_t* c, const message_t* msg) {
+    slot_t* s = &c->slots[(c->head + c->count) % PROXY_WINDOW];
+    c->count++;
+    memset(s, 0, sizeof(*s));
+    s->c = c;
+    s->msg = *msg;
+    switch (msg->msgtype) {
+        case DONATE:
+        case CINFO:
+            if (msg->msgdata.donation.charity >= NUM_CHARITIES) {
+                s->failed = true;
+            } else {
+                route(w, s, PART_OF(msg->msgdata.donation.charity, num_parts), msg);
+            }
+            break;
+        case TOP:
+            memset(&s->msg.msgdata, 0, sizeof(s->msg.msgdata));
+            // fall through
+        case STATS:
+            for (int p = 0; p < num_parts; p++) {
+                route(w, s, p, msg);
+            }
+            break;
+        case LOGOUT:
+            s->silent = true;
+            s->fold_due = true;
+            c->closing = true;
+            break;
+        default:
+            s->failed = true;
+            break;
+    }
+}
+
+static void client_read(worker_t* w, client_t* c) {
+    while (!c->closing && c->count < PROXY_WINDOW) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, MSG_DONTWAIT);
+        if (n <= 0) {
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                // Like the MT server, a donor that just disconnects is not folded
+                c->closing = true;
+            }
+            break;
+        }
+        c->in_len += n;
+        if (c->in_len == sizeof(message_t)) {
+            c->in_len = 0;
+            handle(w, c, (message_t*) c->in);
+        }
+    }
+    client_flush(w, c);
+}
+
+static void accept_clients(worker_t* w) {
+    while (1) {
+        int fd = accept4(w->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        client_t* c = calloc(1, sizeof(client_t));
+        if (c == NULL) {
+            printf("proxy alloc err\n");
+            exit(EXIT_FAILURE);
+        }
+        c->fd = fd;
+        c->id = __atomic_fetch_add(&next_client_id, 1, __ATOMIC_RELAXED);
+        if (w->num_clients == w->clients_cap) {
+            w->clients_cap = w->clients_cap ? w->clients_cap * 2 : 64;
+            w->clients = realloc(w->clients, w->clients_cap * sizeof(client_t*));
+            if (w->clients == NULL) {
+                printf("proxy alloc err\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        w->clients[w->num_clients++] = c;
+    }
+}
+
+// Free clients that are done: every reply settled and sent (or unsendable)
+static void sweep(worker_t* w) {
+    for (int i = 0; i < w->num_clients;) {
+        client_t* c = w->clients[i];
+        if (c->closing && c->count == 0 && (c->dead || c->out_off == c->out_len)) {
+            close(c->fd);
+            free(c);
+            w->clients[i] = w->clients[--w->num_clients];
+        } else {
+            i++;
+        }
+    }
+}
+
+/********************** workers *************/
+static int listen_init() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    int one = 1;
+    // One listener per worker, the kernel spreads the connections
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if (fd < 0 || bind(fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(fd, 128)) {
+        printf("proxy listen err\n");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+static void* worker_loop(void* arg) {
+    worker_t* w = arg;
+    int max_fds = 0;
+    struct pollfd* pfds = NULL;
+    void** owners = NULL;
+    while (!stopping) {
+        int need = 1 + w->num_clients + num_parts * conns_per_part;
+        if (need > max_fds) {
+            max_fds = need * 2;
+            pfds = realloc(pfds, max_fds * sizeof(struct pollfd));
+            owners = realloc(owners, max_fds * sizeof(void*));
+            if (pfds == NULL || owners == NULL) {
+                printf("proxy alloc err\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        int n = 0;
+        pfds[n++] = (struct pollfd) {w->listen_fd, POLLIN, 0};
+        int first_client = n;
+        for (int i = 0; i < w->num_clients; i++) {
+            client_t* c = w->clients[i];
+            short ev = 0;
+            // A client that has not taken its replies is not read from
+            if (!c->closing && c->count < PROXY_WINDOW && c->out_off == c->out_len) {
+                ev |= POLLIN;
+            }
+            if (!c->dead && c->out_off < c->out_len) {
+                ev |= POLLOUT;
+            }
+            owners[n] = c;
+            pfds[n++] = (struct pollfd) {ev ? c->fd : -1, ev, 0};
+        }
+        int first_conn = n;
+        for (int p = 0; p < num_parts; p++) {
+            zc_pool_t* pool = w->pools[p];
+            for (int i = 0; i < pool->size; i++) {
+                zc_conn_t* zc = pool->conns[i];
+                // Idle ones too, to notice a partition that went away
+                if (zc && !zc->broken) {
+                    owners[n] = zc;
+                    pfds[n++] = (struct pollfd) {zc_fd(zc), zc_events(zc), 0};
+                }
+            }
+        }
+        if (poll(pfds, n, PROXY_TICK_MS) <= 0) {
+            continue;
+        }
+        if (pfds[0].revents & POLLIN) {
+            accept_clients(w);
+        }
+        for (int i = first_client; i < first_conn; i++) {
+            client_t* c = owners[i];
+            if (pfds[i].revents & POLLOUT) {
+                client_send(c);
+            }
+            if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                client_read(w, c);
+            }
+        }
+        for (int i = first_conn; i < n; i++) {
+            if (pfds[i].revents) {
+                zc_service(owners[i], pfds[i].revents);
+            }
+        }
+        // Replies that arrived may complete slots of any client
+        for (int i = 0; i < w->num_clients; i++) {
+            client_flush(w, w->clients[i]);
+        }
+        sweep(w);
+    }
+    free(pfds);
+    free(owners);
+    return NULL;
+}
+
+static zc_pool_t* open_part(int p) {
+    char host[256];
+    const char* colon = strrchr(part_addrs[p], ':');
+    if (colon == NULL || colon - part_addrs[p] >= sizeof(host)) {
+        fprintf(stderr, USAGE_MSG);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(host, part_addrs[p], colon - part_addrs[p]);
+    host[colon - part_addrs[p]] = '\0';
+    zc_pool_t* pool = zc_pool_open(host, atoi(colon + 1), conns_per_part, 0);
+    if (pool == NULL) {
+        printf("partition %d connect err\n", p);
+        exit(EXIT_FAILURE);
+    }
+    return pool;
+}
+
+void sigint_handler(int sig) {
+    stopping = 1;
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    int num_workers = 1;
+    while ((opt = getopt(argc, argv, "hw:c:")) != -1) {
+        switch (opt) {
+            case 'h':
+                fprintf(stderr, USAGE_MSG);
+                exit(EXIT_SUCCESS);
+            case 'w':
+                num_workers = atoi(optarg);
+                break;
+            case 'c':
+                conns_per_part = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, USAGE_MSG);
+                exit(EXIT_FAILURE);
+        }
+    }
+    num_parts = argc - optind - 1;
+    if (num_parts < 1 || num_parts > PART_MAX || num_workers < 1 || conns_per_part < 1) {
+        fprintf(stderr, USAGE_MSG);
+        exit(EXIT_FAILURE);
+    }
+    port = atoi(argv[optind]);
+    part_addrs = &argv[optind + 1];
+
+    struct sigaction myaction = {{0}};
+    myaction.sa_handler = sigint_handler;
+    if (sigaction(SIGINT, &myaction, NULL) == -1 || sigaction(SIGTERM, &myaction, NULL) == -1) {
+        printf("signal handler failed to install\n");
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    worker_t* workers = calloc(num_workers, sizeof(worker_t));
+    if (workers == NULL) {
+        printf("proxy alloc err\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        workers[i].listen_fd = listen_init();
+        workers[i].pools = malloc(num_parts * sizeof(zc_pool_t*));
+        if (workers[i].pools == NULL) {
+            printf("proxy alloc err\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int p = 0; p < num_parts; p++) {
+            workers[i].pools[p] = open_part(p);
+        }
+    }
+    printf("Proxying port %d to %d partitions with %d workers.\n", port, num_parts, num_workers);
+
+    // Workers leave SIGINT to the main thread, which only waits for it
+    for (int i = 0; i < num_workers; i++) {
+        spawn_thread(&workers[i].tid, worker_loop, &workers[i], "proxy");
+    }
+    while (!stopping) {
+        pause();
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i].tid, NULL);
+        close(workers[i].listen_fd);
+        // Closing a pool fails its pending requests, whose callbacks still
+        // write into the clients' slots, so the clients go last
+        for (int p = 0; p < num_parts; p++) {
+            zc_pool_close(workers[i].pools[p]);
+        }
+        free(workers[i].pools);
+        for (int j = 0; j < workers[i].num_clients; j++) {
+            close(workers[i].clients[j]->fd);
+            free(workers[i].clients[j]);
+        }
+        free(workers[i].clients);
+    }
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,463 @@
+#include "qos.h"
+#include "timerwheel.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct qos_waiter {
+    struct qos_waiter* next;
+    atomic_bool granted;  // the slot was handed over
+    uint64_t start_ns;
+    uint64_t deadline_ns;
+    void* coro;           // coroutine parked instead of waiting on cond
+} qos_waiter_t;
+
+typedef struct {
+    qos_waiter_t* head;
+    qos_waiter_t* tail;
+    int weight;
+    int current;  // smooth weighted round-robin credit
+    pthread_cond_t cond;
+} qos_queue_t;
+
+typedef struct {
+    atomic_ulong served, queued, late, cached, rejected;
+} qos_counters_t;
+
+// What a degraded observer read is answered from. The versions are read
+// before the snapshot, so the data is at least as new as they say.
+typedef struct {
+    uint64_t version_all;
+    uint64_t versions[NUM_CHARITIES];
+    core_snapshot_t snap;
+} qos_cache_t;
+
+static const char* class_names[QOS_CLASSES] = {"donor", "observer", "admin"};
+
+static int slots;  // 0: QoS is off
+static uint64_t target_ns;
+static atomic_int in_service;
+static atomic_int waiting;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static qos_queue_t queues[QOS_CLASSES];
+static qos_counters_t counters[QOS_CLASSES];
+
+static atomic_int level;
+static int calm_ticks;
+static unsigned long level_ticks[QOS_SHED + 1];
+static atomic_ulong donor_done, donor_late;  // this tick
+static tw_timer_t tick_timer;
+
+static qos_cache_t cache;
+static atomic_ulong cache_seq;  // odd while the tick is writing
+
+static void* (*coro_self_fn)();
+static void (*coro_suspend_fn)();
+static void (*coro_wake_fn)(void*);
+static bool stopped;  // lock held, parked coroutines stop waiting
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int qos_class_of(uint8_t msgtype) {
+    switch (msgtype) {
+        case DONATE:
+        case LOGIN:
+        case LOGOUT:
+        case FOLD_TOTAL:
+            return QOS_DONOR;
+        case REPL_STATUS:
+        case MUX_HELLO:
+            return QOS_ADMIN;
+        default:
+            return QOS_OBSERVER;
+    }
+}
+
+// Lock held, nothing is queued in every class that is passed over
+static qos_queue_t* pick_queue() {
+    qos_queue_t* best = NULL;
+    int total = 0;
+    for (int i = 0; i < QOS_CLASSES; i++) {
+        qos_queue_t* q = &queues[i];
+        if (q->head == NULL) {
+            continue;
+        }
+        q->current += q->weight;
+        total += q->weight;
+        if (best == NULL || q->current > best->current) {
+            best = q;
+        }
+    }
+    best->current -= total;
+    return best;
+}
+
+// Lock held. Hand every free slot to a waiter, waiters never take one themselves.
+static void dispatch() {
+    while (atomic_load(&waiting) > 0) {
+        int n = atomic_load(&in_service);
+        if (n >= slots) {
+            return;
+        }
+        if (!atomic_compare_exchange_weak(&in_service, &n, n + 1)) {
+            continue;
+        }
+        qos_queue_t* q = pick_queue();
+        qos_waiter_t* w = q->head;
+        q->head = w->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+        atomic_fetch_sub(&waiting, 1);
+        atomic_store(&w->granted, true);
+        if (w->coro) {
+            coro_wake_fn(w->coro);
+        } else {
+            pthread_cond_broadcast(&q->cond);
+        }
+    }
+}
+
+// Lock held. Parked coroutines have no timed wait, this checks their deadlines.
+static void wake_coroutines(uint64_t now, bool all) {
+    for (int i = 0; i < QOS_CLASSES; i++) {
+        for (qos_waiter_t* w = queues[i].head; w; w = w->next) {
+            if (w->coro && (all || now >= w->deadline_ns)) {
+                coro_wake_fn(w->coro);
+            }
+        }
+    }
+}
+
+// Lock held, w was not granted
+static void unlink_waiter(qos_queue_t* q, qos_waiter_t* w) {
+    qos_waiter_t* prev = NULL;
+    for (qos_waiter_t* cur = q->head; cur; prev = cur, cur = cur->next) {
+        if (cur != w) {
+            continue;
+        }
+        if (prev) {
+            prev->next = w->next;
+        } else {
+            q->head = w->next;
+        }
+        if (q->tail == w) {
+            q->tail = prev;
+        }
+        atomic_fetch_sub(&waiting, 1);
+        return;
+    }
+}
+
+static bool wait_slot(qos_ticket_t* t) {
+    qos_queue_t* q = &queues[t->cls];
+    qos_waiter_t w;
+    w.next = NULL;
+    atomic_init(&w.granted, false);
+    w.start_ns = t->start_ns;
+    uint64_t deadline = t->start_ns + (t->cls == QOS_OBSERVER ? QOS_OBSERVER_WAIT_MS : QOS_MAX_WAIT_MS) * 1000000ull;
+    w.deadline_ns = deadline;
+    w.coro = coro_self_fn ? coro_self_fn() : NULL;
+
+    pthread_mutex_lock(&lock);
+    if (q->tail) {
+        q->tail->next = &w;
+    } else {
+        q->head = &w;
+    }
+    q->tail = &w;
+    atomic_fetch_add(&waiting, 1);
+    atomic_fetch_add_explicit(&counters[t->cls].queued, 1, memory_order_relaxed);
+    // A slot freed between the fast path and the enqueue is not lost
+    dispatch();
+    if (w.coro) {
+        // Only the coroutine is parked, its worker runs the other sessions.
+        // A grant or the tick wakes it, both under the lock, so w is still
+        // queued (or just granted) whenever it is woken.
+        while (!atomic_load(&w.granted) && !stopped && now_ns() < deadline) {
+            pthread_mutex_unlock(&lock);
+            coro_suspend_fn();
+            pthread_mutex_lock(&lock);
+        }
+    } else {
+        struct timespec ts = {deadline / 1000000000ull, deadline % 1000000000ull};
+        while (!atomic_load(&w.granted)) {
+            if (pthread_cond_timedwait(&q->cond, &lock, &ts) == ETIMEDOUT) {
+                break;
+            }
+        }
+    }
+    bool granted = atomic_load(&w.granted);
+    if (!granted) {
+        unlink_waiter(q, &w);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (granted) {
+        return true;
+    }
+    if (t->cls == QOS_OBSERVER) {
+        return false;
+    }
+    // Donations are never turned away, they go over the limit
+    atomic_fetch_add(&in_service, 1);
+    return true;
+}
+
+bool qos_enter(qos_ticket_t* t, uint8_t msgtype) {
+    t->held = false;
+    if (!slots) {
+        return true;
+    }
+    t->cls = qos_class_of(msgtype);
+    t->start_ns = now_ns();
+    if (t->cls == QOS_OBSERVER && atomic_load_explicit(&level, memory_order_relaxed) == QOS_SHED) {
+        atomic_fetch_add_explicit(&counters[t->cls].rejected, 1, memory_order_relaxed);
+        return false;
+    }
+    // Nobody queued and a slot free
+    bool got = false;
+    if (atomic_load(&waiting) == 0) {
+        int n = atomic_load(&in_service);
+        while (!got && n < slots) {
+            got = atomic_compare_exchange_weak(&in_service, &n, n + 1);
+        }
+    }
+    if (!got && !wait_slot(t)) {
+        atomic_fetch_add_explicit(&counters[t->cls].rejected, 1, memory_order_relaxed);
+        return false;
+    }
+    t->held = true;
+    return true;
+}
+
+void qos_leave(qos_ticket_t* t) {
+    if (!t->held) {
+        return;
+    }
+    t->held = false;
+    bool late = now_ns() - t->start_ns > target_ns;
+    atomic_fetch_add_explicit(&counters[t->cls].served, 1, memory_order_relaxed);
+    if (late) {
+        atomic_fetch_add_explicit(&counters[t->cls].late, 1, memory_order_relaxed);
+    }
+    if (t->cls == QOS_DONOR) {
+        atomic_fetch_add_explicit(&donor_done, 1, memory_order_relaxed);
+        if (late) {
+            atomic_fetch_add_explicit(&donor_late, 1, memory_order_relaxed);
+        }
+    }
+    atomic_fetch_sub(&in_service, 1);
+    if (atomic_load(&waiting) > 0) {
+        pthread_mutex_lock(&lock);
+        dispatch();
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+// Wheel thread, the only writer
+static void refresh_cache() {
+    uint64_t all = core_version_all();
+    if (cache_seq && all == cache.version_all) {
+        return;
+    }
+    qos_cache_t next;
+    next.version_all = all;
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        next.versions[i] = core_version(i);
+    }
+    core_snapshot(&next.snap);
+
+    unsigned long seq = atomic_load_explicit(&cache_seq, memory_order_relaxed);
+    atomic_store_explicit(&cache_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&cache, &next, sizeof(cache));
+    atomic_store_explicit(&cache_seq, seq + 2, memory_order_release);
+}
+
+static void read_cache(qos_cache_t* out) {
+    while (1) {
+        unsigned long seq = atomic_load_explicit(&cache_seq, memory_order_acquire);
+        if (seq & 1) {
+            continue;
+        }
+        memcpy(out, &cache, sizeof(*out));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&cache_seq, memory_order_relaxed) == seq) {
+            return;
+        }
+    }
+}
+
+static uint64_t tick(tw_timer_t* t) {
+    unsigned long done = atomic_exchange(&donor_done, 0);
+    unsigned long late = atomic_exchange(&donor_late, 0);
+    // p99 over the target
+    bool over = late * 100 > done;
+    // Starved donors finish nothing, the oldest queued one counts too
+    pthread_mutex_lock(&lock);
+    uint64_t now = now_ns();
+    qos_waiter_t* oldest = queues[QOS_DONOR].head;
+    if (oldest && now - oldest->start_ns > target_ns) {
+        over = true;
+    }
+    wake_coroutines(now, false);
+    pthread_mutex_unlock(&lock);
+
+    int cur = atomic_load(&level);
+    int next = cur;
+    if (over) {
+        calm_ticks = 0;
+        if (cur < QOS_SHED) {
+            next = cur + 1;
+        }
+    } else if (cur > QOS_NORMAL && ++calm_ticks >= QOS_CALM_TICKS) {
+        calm_ticks = 0;
+        next = cur - 1;
+    }
+    // The cache is current before the first read is sent to it
+    if (next >= QOS_STALE) {
+        refresh_cache();
+    }
+    atomic_store(&level, next);
+    level_ticks[next]++;
+    return QOS_TICK_MS;
+}
+
+void qos_init(int target_us, int max_slots) {
+    if (target_us <= 0) {
+        return;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    slots = max_slots > 0 ? max_slots : 2 * (cpus > 0 ? cpus : 1);
+    target_ns = target_us * 1000ull;
+    int weights[QOS_CLASSES] = {QOS_WEIGHT_DONOR, QOS_WEIGHT_OBSERVER, QOS_WEIGHT_ADMIN};
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    for (int i = 0; i < QOS_CLASSES; i++) {
+        memset(&queues[i], 0, sizeof(queues[i]));
+        queues[i].weight = weights[i];
+        pthread_cond_init(&queues[i].cond, &attr);
+    }
+    pthread_condattr_destroy(&attr);
+    stopped = false;
+
+    tw_init();
+    tw_timer_init(&tick_timer, tick, NULL);
+    tw_arm(&tick_timer, QOS_TICK_MS);
+}
+
+void qos_stop() {
+    if (slots) {
+        tw_cancel(&tick_timer);
+        // Without the tick nothing would time parked coroutines out
+        pthread_mutex_lock(&lock);
+        stopped = true;
+        wake_coroutines(0, true);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+bool qos_enabled() {
+    return slots != 0;
+}
+
+int qos_level() {
+    return atomic_load_explicit(&level, memory_order_relaxed);
+}
+
+void qos_set_coroutines(void* (*self)(), void (*suspend)(), void (*wake)(void*)) {
+    coro_self_fn = self;
+    coro_suspend_fn = suspend;
+    coro_wake_fn = wake;
+}
+
+static void stats_reply(message_t* reply, const core_stats_t* stats) {
+    reply->msgdata.stats.charityID_high = stats->charity_high;
+    reply->msgdata.stats.charityID_low = stats->charity_low;
+    reply->msgdata.stats.amount_high = stats->amount_high;
+    reply->msgdata.stats.amount_low = stats->amount_low;
+}
+
+size_t qos_cached_reply(const message_t* req, char* buf) {
+    if (atomic_load_explicit(&level, memory_order_relaxed) < QOS_STALE) {
+        return 0;
+    }
+    int charity = req->msgdata.donation.charity;
+    bool per_charity = req->msgtype == CINFO || req->msgtype == CINFO_IF_CHANGED;
+    switch (req->msgtype) {
+        case CINFO:
+        case TOP:
+        case STATS:
+        case CINFO_ALL:
+        case CINFO_IF_CHANGED:
+        case TOP_IF_CHANGED:
+        case STATS_IF_CHANGED:
+            break;
+        default:
+            return 0;
+    }
+    // Left to the live path to answer ERROR
+    if (per_charity && charity >= NUM_CHARITIES) {
+        return 0;
+    }
+
+    qos_cache_t c;
+    read_cache(&c);
+    atomic_fetch_add_explicit(&counters[QOS_OBSERVER].cached, 1, memory_order_relaxed);
+    message_t reply = *req;
+    size_t len = sizeof(message_t);
+    switch (req->msgtype) {
+        case CINFO_ALL:
+            reply.msgdata.donation.amount = sizeof(core_snapshot_t);
+            memcpy(buf + sizeof(reply), &c.snap, sizeof(c.snap));
+            len = CINFO_ALL_REPLY_MAX;
+            break;
+        case CINFO_IF_CHANGED:
+        case TOP_IF_CHANGED:
+        case STATS_IF_CHANGED: {
+            uint64_t version = per_charity ? c.versions[charity] : c.version_all;
+            if (version == req->msgdata.donation.amount) {
+                buf[0] = NOT_MODIFIED;
+                return 1;
+            }
+            memcpy(buf + sizeof(reply), &version, sizeof(version));
+            len = IF_CHANGED_REPLY_MAX;
+            break;
+        }
+        default:
+            break;
+    }
+    if (req->msgtype == CINFO || req->msgtype == CINFO_IF_CHANGED) {
+        reply.msgdata.charityInfo = c.snap.charities[charity];
+    } else if (req->msgtype == TOP || req->msgtype == TOP_IF_CHANGED) {
+        memcpy(reply.msgdata.maxDonations, c.snap.maxDonations, sizeof(reply.msgdata.maxDonations));
+    } else if (req->msgtype == STATS || req->msgtype == STATS_IF_CHANGED) {
+        stats_reply(&reply, &c.snap.stats);
+    }
+    memcpy(buf, &reply, sizeof(reply));
+    return len;
+}
+
+void qos_print_stats() {
+    if (!slots) {
+        return;
+    }
+    for (int i = 0; i < QOS_CLASSES; i++) {
+        qos_counters_t* c = &counters[i];
+        printf("qos %s: %lu served, %lu queued, %lu over target, %lu cached, %lu rejected\n", class_names[i],
+               atomic_load(&c->served), atomic_load(&c->queued), atomic_load(&c->late),
+               atomic_load(&c->cached), atomic_load(&c->rejected));
+    }
+    printf("qos ticks: %lu normal, %lu stale, %lu shed\n", level_ticks[QOS_NORMAL], level_ticks[QOS_STALE], level_ticks[QOS_SHED]);
+}
@@ -0,0 +1,65 @@
+#include "rate.h"
+
+#include <string.h>
+#include <time.h>
+
+#include "core.h"
+
+#define RATE_MASK (RATE_SLOTS - 1)
+
+static const uint64_t window_secs[RATE_WINDOWS] = {60, 300, 3600};
+
+static uint64_t buckets[RATE_SHARDS][NUM_CHARITIES][RATE_SLOTS];
+static int next_shard;
+static __thread int my_shard = -1;
+static uint64_t cleared_through;  // last second whose buckets are zeroed
+static uint64_t start_sec;
+
+static uint64_t now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec - start_sec;
+}
+
+void rate_init() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    start_sec = ts.tv_sec;
+    memset(buckets, 0, sizeof(buckets));
+    // A fresh ring is all zero, everything up to the far side of the window is clean
+    cleared_through = RATE_SLOTS - 1;
+}
+
+void rate_record(int charity, uint64_t amount) {
+    if (my_shard < 0) {
+        my_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) & (RATE_SHARDS - 1);
+    }
+    __atomic_fetch_add(&buckets[my_shard][charity][now_sec() & RATE_MASK], amount, __ATOMIC_RELAXED);
+}
+
+void rate_query(int charity, uint64_t out[RATE_WINDOWS]) {
+    uint64_t now = now_sec();
+    uint64_t sum = 0;
+    uint64_t secs = 0;
+    for (int w = 0; w < RATE_WINDOWS; w++) {
+        for (; secs < window_secs[w] && secs <= now; secs++) {
+            for (int s = 0; s < RATE_SHARDS; s++) {
+                sum += __atomic_load_n(&buckets[s][charity][(now - secs) & RATE_MASK], __ATOMIC_RELAXED);
+            }
+        }
+        out[w] = sum;
+    }
+}
+
+// Only one caller at a time (the timer wheel thread)
+void rate_advance() {
+    uint64_t target = now_sec() + RATE_CLEAR_AHEAD;
+    while (cleared_through < target) {
+        cleared_through++;
+        for (int s = 0; s < RATE_SHARDS; s++) {
+            for (int i = 0; i < NUM_CHARITIES; i++) {
+                __atomic_store_n(&buckets[s][i][cleared_through & RATE_MASK], 0, __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
@@ -0,0 +1,512 @@
+#define _GNU_SOURCE
+#include "repl.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "protocol_ext.h"
+#include "util.h"
+
+/********************** journal *************/
+// Vyukov-style bounded queue: a slot is free for position p when turn == p,
+// and holds the record for p once turn == p + 1
+typedef struct {
+    uint64_t turn;
+    repl_record_t rec;
+} journal_slot_t;
+
+static journal_slot_t* journal;
+static struct {
+    uint64_t v;
+} __attribute__((aligned(CACHE_LINE))) journal_head;
+
+static void journal_append(uint8_t type, int charity, uint64_t amount, uint64_t source) {
+    uint64_t pos = __atomic_fetch_add(&journal_head.v, 1, __ATOMIC_RELAXED);
+    journal_slot_t* s = &journal[pos & (REPL_JOURNAL_SLOTS - 1)];
+    // Full: the shipper frees a slot within a tick
+    while (__atomic_load_n(&s->turn, __ATOMIC_ACQUIRE) != pos) {
+        cpu_relax();
+    }
+    s->rec.type = type;
+    s->rec.charity = charity;
+    s->rec.amount = amount;
+    s->rec.source = source;
+    __atomic_store_n(&s->turn, pos + 1, __ATOMIC_RELEASE);
+}
+
+/********************** primary *************/
+typedef struct {
+    int fd;
+    bool streaming;  // hello received
+    bool dead;
+    repl_hello_t hello;
+    size_t hello_got;
+    char* out;       // queued, sent from off
+    size_t len, off, cap;
+} follower_t;
+
+static follower_t* followers;
+static int num_followers, followers_cap;
+static int repl_listen_fd = -1;
+static uint64_t epoch;
+static uint64_t shipped;        // last sequence number drained from the journal
+static core_snapshot_t shadow;  // charities and top 3 as of shipped
+static repl_record_t* history;  // record s at history[(s - 1) % REPL_HISTORY]
+static volatile bool primary_stopping;
+static bool primary_running;
+static pthread_t primary_tid;
+
+static void queue(follower_t* f, const void* buf, size_t len) {
+    if (f->dead) {
+        return;
+    }
+    if (f->len - f->off + len > REPL_MAX_BACKLOG) {
+        // Too far behind, it reconnects and catches up from the history
+        printf("replication follower %d too slow, dropped\n", f->fd);
+        f->dead = true;
+        return;
+    }
+    if (f->off && f->len + len > f->cap) {
+        memmove(f->out, f->out + f->off, f->len - f->off);
+        f->len -= f->off;
+        f->off = 0;
+    }
+    if (f->len + len > f->cap) {
+        f->cap = f->cap ? f->cap : 64 * 1024;
+        while (f->cap < f->len + len) {
+            f->cap *= 2;
+        }
+        f->out = realloc(f->out, f->cap);
+        if (f->out == NULL) {
+            printf("repl alloc err\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(f->out + f->len, buf, len);
+    f->len += len;
+}
+
+static void flush(follower_t* f) {
+    while (!f->dead && f->off < f->len) {
+        ssize_t n = send(f->fd, f->out + f->off, f->len - f->off, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                f->dead = true;
+            }
+            return;
+        }
+        f->off += n;
+    }
+}
+
+static void queue_header(follower_t* f, uint32_t kind, uint32_t count, uint64_t seq) {
+    repl_header_t h = {kind, count, epoch, seq, wall_ns()};
+    queue(f, &h, sizeof(h));
+}
+
+// Records first..last from the history, in batches
+static void queue_history(follower_t* f, uint64_t first, uint64_t last) {
+    while (first <= last) {
+        uint64_t at = (first - 1) % REPL_HISTORY;
+        uint64_t n = last - first + 1;
+        n = n < REPL_BATCH_MAX ? n : REPL_BATCH_MAX;
+        n = n < REPL_HISTORY - at ? n : REPL_HISTORY - at;
+        queue_header(f, REPL_BATCH, n, first);
+        queue(f, &history[at], n * sizeof(repl_record_t));
+        first += n;
+    }
+}
+
+static void handshake(follower_t* f) {
+    const repl_hello_t* h = &f->hello;
+    f->streaming = true;
+    if (h->epoch == epoch && h->seq <= shipped && shipped - h->seq <= REPL_HISTORY) {
+        printf("replication follower %d catching up from %lu\n", f->fd, h->seq);
+        queue_history(f, h->seq + 1, shipped);
+    } else {
+        printf("replication follower %d gets a snapshot at %lu\n", f->fd, shipped);
+        queue_header(f, REPL_SNAPSHOT, 0, shipped);
+        queue(f, &shadow, sizeof(shadow));
+    }
+}
+
+// Read the hello, later input (or EOF) only means the follower is gone
+static void follower_input(follower_t* f) {
+    if (f->streaming) {
+        char b[64];
+        ssize_t n = recv(f->fd, b, sizeof(b), MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            f->dead = true;
+        }
+        return;
+    }
+    ssize_t n = recv(f->fd, (char*) &f->hello + f->hello_got, sizeof(f->hello) - f->hello_got, MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        f->dead = true;
+        return;
+    }
+    if (n > 0 && (f->hello_got += n) == sizeof(f->hello)) {
+        handshake(f);
+    }
+}
+
+static void shadow_apply(const repl_record_t* r) {
+    if (r->type == DONATE) {
+        core_apply_donation(&shadow.charities[r->charity], r->amount);
+    } else {
+        core_fold_top(shadow.maxDonations, r->amount);
+    }
+}
+
+// Move what the journal holds into the history and to every follower
+static int ship() {
+    repl_record_t batch[REPL_BATCH_MAX];
+    int total = 0;
+    while (1) {
+        int n = 0;
+        uint64_t first = shipped + 1;
+        while (n < REPL_BATCH_MAX) {
+            journal_slot_t* s = &journal[shipped & (REPL_JOURNAL_SLOTS - 1)];
+            if (__atomic_load_n(&s->turn, __ATOMIC_ACQUIRE) != shipped + 1) {
+                break;
+            }
+            batch[n] = s->rec;
+            __atomic_store_n(&s->turn, shipped + REPL_JOURNAL_SLOTS, __ATOMIC_RELEASE);
+            shadow_apply(&batch[n]);
+            history[shipped % REPL_HISTORY] = batch[n];
+            shipped++;
+            n++;
+        }
+        if (n == 0) {
+            return total;
+        }
+        for (int i = 0; i < num_followers; i++) {
+            if (followers[i].streaming) {
+                queue_header(&followers[i], REPL_BATCH, n, first);
+                queue(&followers[i], batch, n * sizeof(repl_record_t));
+            }
+        }
+        total += n;
+    }
+}
+
+static void accept_followers() {
+    while (1) {
+        int fd = accept4(repl_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (num_followers == followers_cap) {
+            followers_cap = followers_cap ? followers_cap * 2 : 8;
+            followers = realloc(followers, followers_cap * sizeof(follower_t));
+            if (followers == NULL) {
+                printf("repl alloc err\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memset(&followers[num_followers], 0, sizeof(follower_t));
+        followers[num_followers++].fd = fd;
+    }
+}
+
+static void remove_dead() {
+    for (int i = 0; i < num_followers;) {
+        if (followers[i].dead) {
+            close(followers[i].fd);
+            free(followers[i].out);
+            followers[i] = followers[--num_followers];
+        } else {
+            i++;
+        }
+    }
+}
+
+static void* primary_thread(void* arg) {
+    uint64_t last_sent = wall_ns();
+    while (1) {
+        bool stopping = primary_stopping;
+        struct pollfd pfds[1 + num_followers];
+        pfds[0] = (struct pollfd) {repl_listen_fd, POLLIN, 0};
+        for (int i = 0; i < num_followers; i++) {
+            follower_t* f = &followers[i];
+            pfds[1 + i] = (struct pollfd) {f->fd, POLLIN | (f->off < f->len ? POLLOUT : 0), 0};
+        }
+        poll(pfds, 1 + num_followers, stopping ? 0 : REPL_TICK_MS);
+        int polled = num_followers;
+        for (int i = 0; i < polled; i++) {
+            if (pfds[1 + i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                follower_input(&followers[i]);
+            }
+        }
+        if (pfds[0].revents & POLLIN) {
+            accept_followers();
+        }
+        if (ship()) {
+            last_sent = wall_ns();
+        } else if (wall_ns() - last_sent >= REPL_HEARTBEAT_MS * 1000000ull) {
+            for (int i = 0; i < num_followers; i++) {
+                if (followers[i].streaming) {
+                    queue_header(&followers[i], REPL_BATCH, 0, shipped + 1);
+                }
+            }
+            last_sent = wall_ns();
+        }
+        for (int i = 0; i < num_followers; i++) {
+            flush(&followers[i]);
+        }
+        remove_dead();
+        // One last pass after the stop so nothing journaled stays behind
+        if (stopping) {
+            return NULL;
+        }
+    }
+}
+
+void repl_primary_start(int port) {
+    journal = malloc(sizeof(journal_slot_t) * REPL_JOURNAL_SLOTS);
+    history = malloc(sizeof(repl_record_t) * REPL_HISTORY);
+    if (journal == NULL || history == NULL) {
+        printf("repl alloc err\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint64_t i = 0; i < REPL_JOURNAL_SLOTS; i++) {
+        journal[i].turn = i;
+    }
+    journal_head.v = 0;
+    shipped = 0;
+    epoch = wall_ns();
+    // Nothing else runs yet, so the shadow starts exact
+    core_snapshot(&shadow);
+
+    repl_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    int one = 1;
+    setsockopt(repl_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (repl_listen_fd < 0 || bind(repl_listen_fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(repl_listen_fd, 16)) {
+        printf("replication listen err\n");
+        exit(EXIT_FAILURE);
+    }
+    primary_stopping = false;
+    core_journal = journal_append;
+    spawn_thread(&primary_tid, primary_thread, NULL, "repl");
+    primary_running = true;
+}
+
+void repl_primary_stop() {
+    if (!primary_running) {
+        return;
+    }
+    core_journal = NULL;
+    primary_stopping = true;
+    pthread_join(primary_tid, NULL);
+    primary_running = false;
+    for (int i = 0; i < num_followers; i++) {
+        close(followers[i].fd);
+        free(followers[i].out);
+    }
+    free(followers);
+    followers = NULL;
+    num_followers = followers_cap = 0;
+    close(repl_listen_fd);
+    repl_listen_fd = -1;
+    free(journal);
+    free(history);
+}
+
+/********************** follower ************/
+static char* primary_host;
+static int primary_port;
+static int follow_fd = -1;
+static pthread_mutex_t follow_lock = PTHREAD_MUTEX_INITIALIZER;  // follow_fd vs stop
+static volatile bool follow_stopping;
+static bool following;
+static pthread_t follow_tid;
+static uint64_t follow_epoch;
+static uint64_t applied;    // atomic, last sequence number applied
+static uint64_t lag_us;     // atomic
+static bool connected;      // atomic
+
+static int connect_primary() {
+    char service[16];
+    snprintf(service, sizeof(service), "%d", primary_port);
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* res;
+    if (getaddrinfo(primary_host, service, &hints, &res)) {
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen)) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        return -1;
+    }
+    // Heartbeats keep a live primary well inside the timeout
+    struct timeval tv = {REPL_TIMEOUT_MS / 1000, (REPL_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    repl_hello_t hello = {follow_epoch, applied};
+    if (write_all(fd, &hello, sizeof(hello))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void load_snapshot(const core_snapshot_t* snap) {
+    core_state_t st;
+    core_export(&st);
+    memcpy(st.charities, snap->charities, sizeof(st.charities));
+    memcpy(st.maxDonations, snap->maxDonations, sizeof(st.maxDonations));
+    core_import(&st);
+}
+
+static void apply(const repl_record_t* r, int n) {
+    for (int i = 0; i < n; i++) {
+        if (r[i].type == DONATE) {
+            core_donate(r[i].charity, r[i].amount, r[i].source);
+        } else {
+            core_logout(r[i].amount);
+        }
+    }
+}
+
+/*
+ * Apply the stream on fd until it breaks.
+ * @return false if the primary answered with a snapshot, which can only be
+ *         loaded by a fresh process
+ */
+static bool follow_stream(int fd) {
+    repl_record_t batch[REPL_BATCH_MAX];
+    repl_header_t h;
+    while (!read_all(fd, &h, sizeof(h))) {
+        if (h.kind == REPL_SNAPSHOT) {
+            return false;
+        }
+        if (h.kind != REPL_BATCH || h.epoch != follow_epoch || h.seq != applied + 1 || h.count > REPL_BATCH_MAX ||
+            read_all(fd, batch, h.count * sizeof(repl_record_t))) {
+            break;
+        }
+        apply(batch, h.count);
+        __atomic_store_n(&applied, applied + h.count, __ATOMIC_RELAXED);
+        uint64_t now = wall_ns();
+        __atomic_store_n(&lag_us, now > h.sent_ns ? (now - h.sent_ns) / 1000 : 0, __ATOMIC_RELAXED);
+    }
+    return true;
+}
+
+static void* follow_thread(void* arg) {
+    while (!follow_stopping) {
+        pthread_mutex_lock(&follow_lock);
+        int fd = follow_fd;
+        pthread_mutex_unlock(&follow_lock);
+        if (fd >= 0) {
+            __atomic_store_n(&connected, true, __ATOMIC_RELAXED);
+            bool resumable = follow_stream(fd);
+            __atomic_store_n(&connected, false, __ATOMIC_RELAXED);
+            pthread_mutex_lock(&follow_lock);
+            close(follow_fd);
+            follow_fd = -1;
+            pthread_mutex_unlock(&follow_lock);
+            if (!resumable) {
+                printf("replication history lost, restarting to load a snapshot\n");
+                kill(getpid(), SIGUSR2);
+                return NULL;
+            }
+            if (!follow_stopping) {
+                printf("replication stream lost at %lu, reconnecting\n", applied);
+            }
+        }
+        if (follow_stopping) {
+            break;
+        }
+        usleep(REPL_RETRY_MS * 1000);
+        fd = connect_primary();
+        pthread_mutex_lock(&follow_lock);
+        if (follow_stopping && fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+        follow_fd = fd;
+        pthread_mutex_unlock(&follow_lock);
+    }
+    return NULL;
+}
+
+void repl_follow_start(const char* primary) {
+    const char* colon = strrchr(primary, ':');
+    if (colon == NULL || (primary_port = atoi(colon + 1)) <= 0) {
+        printf("replication primary must be HOST:PORT\n");
+        exit(EXIT_FAILURE);
+    }
+    primary_host = strndup(primary, colon - primary);
+    follow_epoch = 0;
+    applied = 0;
+    int fd = connect_primary();
+    repl_header_t h;
+    core_snapshot_t snap;
+    if (fd < 0 || read_all(fd, &h, sizeof(h)) || h.kind != REPL_SNAPSHOT || read_all(fd, &snap, sizeof(snap))) {
+        printf("replication connect err\n");
+        exit(EXIT_FAILURE);
+    }
+    load_snapshot(&snap);
+    follow_epoch = h.epoch;
+    applied = h.seq;
+    printf("Following %s from %lu.\n", primary, applied);
+
+    follow_fd = fd;
+    follow_stopping = false;
+    following = true;
+    spawn_thread(&follow_tid, follow_thread, NULL, "repl");
+}
+
+void repl_follow_stop() {
+    if (!following) {
+        return;
+    }
+    pthread_mutex_lock(&follow_lock);
+    follow_stopping = true;
+    if (follow_fd >= 0) {
+        shutdown(follow_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&follow_lock);
+    pthread_join(follow_tid, NULL);
+    free(primary_host);
+}
+
+bool repl_is_follower() {
+    return following;
+}
+
+void repl_status_reply(message_t* msg) {
+    uint64_t* out = msg->msgdata.maxDonations;
+    if (following) {
+        out[0] = __atomic_load_n(&applied, __ATOMIC_RELAXED);
+        out[1] = __atomic_load_n(&lag_us, __ATOMIC_RELAXED);
+        out[2] = __atomic_load_n(&connected, __ATOMIC_RELAXED);
+    } else {
+        // The shipper owns these, a slightly stale value is fine here
+        out[0] = __atomic_load_n(&shipped, __ATOMIC_RELAXED);
+        out[1] = 0;
+        out[2] = __atomic_load_n(&num_followers, __ATOMIC_RELAXED);
+    }
+}
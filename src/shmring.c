@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include "shmring.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SHM_MASK (SHM_RING_BYTES - 1)
+#define SHM_HANDSHAKE_FDS 3  // memfd, server eventfd, client eventfd
+
+int shm_default_spin() {
+    return sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_DEFAULT_SPIN : 0;
+}
+
+/********************** handshake ***********/
+static int unix_addr(const char* path, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int shm_listen(const char* path) {
+    struct sockaddr_un addr;
+    if (unix_addr(path, &addr)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(fd, 64)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static shm_conn_t* conn_new(shm_region_t* region, int sock, int server_efd, int client_efd, bool server, int spin) {
+    shm_conn_t* c = malloc(sizeof(shm_conn_t));
+    if (c == NULL) {
+        printf("shm conn alloc err\n");
+        exit(EXIT_FAILURE);
+    }
+    c->region = region;
+    c->sock = sock;
+    c->spin = spin;
+    if (server) {
+        c->in = &region->requests;
+        c->out = &region->replies;
+        c->my_waiting = &region->server_waiting;
+        c->peer_waiting = &region->client_waiting;
+        c->my_efd = server_efd;
+        c->peer_efd = client_efd;
+    } else {
+        c->in = &region->replies;
+        c->out = &region->requests;
+        c->my_waiting = &region->client_waiting;
+        c->peer_waiting = &region->server_waiting;
+        c->my_efd = client_efd;
+        c->peer_efd = server_efd;
+    }
+    return c;
+}
+
+shm_conn_t* shm_accept(int listen_fd, int spin) {
+    int sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (sock < 0) {
+        return NULL;
+    }
+    int fds[SHM_HANDSHAKE_FDS];
+    fds[0] = memfd_create("zotdonate-shm", MFD_CLOEXEC);
+    fds[1] = eventfd(0, EFD_CLOEXEC);
+    fds[2] = eventfd(0, EFD_CLOEXEC);
+    shm_region_t* region = MAP_FAILED;
+    if (fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0 && ftruncate(fds[0], sizeof(shm_region_t)) == 0) {
+        region = mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    }
+
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    char ctrl[CMSG_SPACE(sizeof(fds))];
+    struct msghdr mh = {0};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctrl;
+    mh.msg_controllen = sizeof(ctrl);
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    if (region == MAP_FAILED || sendmsg(sock, &mh, MSG_NOSIGNAL) != 1) {
+        if (region != MAP_FAILED) {
+            munmap(region, sizeof(shm_region_t));
+        }
+        for (int i = 0; i < SHM_HANDSHAKE_FDS; i++) {
+            if (fds[i] >= 0) {
+                close(fds[i]);
+            }
+        }
+        close(sock);
+        return NULL;
+    }
+    // The mapping keeps the memory alive
+    close(fds[0]);
+    return conn_new(region, sock, fds[1], fds[2], true, spin);
+}
+
+shm_conn_t* shm_connect(const char* path, int spin) {
+    struct sockaddr_un addr;
+    if (unix_addr(path, &addr)) {
+        return NULL;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return NULL;
+    }
+    if (connect(sock, (struct sockaddr*) &addr, sizeof(addr))) {
+        close(sock);
+        return NULL;
+    }
+    int fds[SHM_HANDSHAKE_FDS];
+    char byte;
+    struct iovec iov = {&byte, 1};
+    char ctrl[CMSG_SPACE(sizeof(fds))];
+    struct msghdr mh = {0};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctrl;
+    mh.msg_controllen = sizeof(ctrl);
+    struct cmsghdr* cm;
+    // The server refuses with a plain close (or an ERROR message) when it is full
+    if (recvmsg(sock, &mh, MSG_CMSG_CLOEXEC) != 1 || (cm = CMSG_FIRSTHDR(&mh)) == NULL ||
+        cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        close(sock);
+        return NULL;
+    }
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+    shm_region_t* region = mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (region == MAP_FAILED) {
+        close(fds[1]);
+        close(fds[2]);
+        close(sock);
+        return NULL;
+    }
+    return conn_new(region, sock, fds[1], fds[2], false, spin);
+}
+
+void shm_close(shm_conn_t* c) {
+    munmap(c->region, sizeof(shm_region_t));
+    close(c->my_efd);
+    close(c->peer_efd);
+    close(c->sock);
+    free(c);
+}
+
+/********************** rings ***************/
+static bool readable(shm_conn_t* c) {
+    return __atomic_load_n(&c->in->head, __ATOMIC_ACQUIRE) != c->in->tail;
+}
+
+static bool writable(shm_conn_t* c) {
+    return c->out->head - __atomic_load_n(&c->out->tail, __ATOMIC_ACQUIRE) < SHM_RING_BYTES;
+}
+
+// Nothing is ever sent on the socket after the handshake, readable means EOF
+static bool peer_gone(shm_conn_t* c) {
+    char b;
+    ssize_t n = recv(c->sock, &b, 1, MSG_DONTWAIT | MSG_PEEK);
+    return n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+// Pairs with the fence in await(): either the peer sees our update or we see its flag
+static void wake_peer(shm_conn_t* c) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(c->peer_waiting, __ATOMIC_RELAXED)) {
+        uint64_t one = 1;
+        write(c->peer_efd, &one, sizeof(one));
+    }
+}
+
+// Spin, then sleep until ready() holds. @return false once the peer is gone
+static bool await(shm_conn_t* c, bool (*ready)(shm_conn_t*)) {
+    for (int i = 0; i < c->spin; i++) {
+        if (ready(c)) {
+            return true;
+        }
+        cpu_relax();
+    }
+    while (1) {
+        __atomic_store_n(c->my_waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (ready(c)) {
+            __atomic_store_n(c->my_waiting, 0, __ATOMIC_RELAXED);
+            return true;
+        }
+        struct pollfd fds[2] = {{c->my_efd, POLLIN, 0}, {c->sock, POLLIN | POLLRDHUP, 0}};
+        int n = poll(fds, 2, -1);
+        __atomic_store_n(c->my_waiting, 0, __ATOMIC_RELAXED);
+        if (n < 0 && errno != EINTR) {
+            return false;
+        }
+        if (n > 0 && (fds[0].revents & POLLIN)) {
+            uint64_t v;
+            read(c->my_efd, &v, sizeof(v));
+        }
+        // Whatever is already in the ring still gets delivered
+        if (ready(c)) {
+            return true;
+        }
+        if (n > 0 && fds[1].revents && peer_gone(c)) {
+            return false;
+        }
+    }
+}
+
+ssize_t shm_read(shm_conn_t* c, void* buf, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (!await(c, readable)) {
+        return 0;
+    }
+    shm_ring_t* r = c->in;
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = r->tail;
+    size_t n = head - tail < len ? head - tail : len;
+    size_t at = tail & SHM_MASK;
+    size_t first = SHM_RING_BYTES - at < n ? SHM_RING_BYTES - at : n;
+    memcpy(buf, r->data + at, first);
+    memcpy((char*) buf + first, r->data, n - first);
+    __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+    wake_peer(c);
+    return n;
+}
+
+ssize_t shm_write(shm_conn_t* c, const void* buf, size_t len) {
+    shm_ring_t* r = c->out;
+    size_t done = 0;
+    while (done < len) {
+        if (!await(c, writable)) {
+            return -1;
+        }
+        uint64_t head = r->head;
+        size_t space = SHM_RING_BYTES - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+        size_t n = len - done < space ? len - done : space;
+        size_t at = head & SHM_MASK;
+        size_t first = SHM_RING_BYTES - at < n ? SHM_RING_BYTES - at : n;
+        memcpy(r->data + at, (const char*) buf + done, first);
+        memcpy(r->data, (const char*) buf + done + first, n - first);
+        __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+        wake_peer(c);
+        done += n;
+    }
+    return done;
+}
@@ -0,0 +1,229 @@
+#include "sketch.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core.h"
+
+#define HLL_REGS (1 << SKETCH_HLL_BITS)
+// Bucket 0 holds zero amounts, bucket k + 1 amounts in (gamma^(k-1), gamma^k]
+#define DD_BUCKETS 2240
+
+typedef struct {
+    uint8_t hll[HLL_REGS];
+    uint64_t dd[DD_BUCKETS];
+} sketch_row_t;
+
+typedef struct {
+    sketch_row_t rows[NUM_CHARITIES];
+} sketch_set_t;
+
+static sketch_set_t* slots[SKETCH_MAX_THREADS];
+static bool slot_used[SKETCH_MAX_THREADS];
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Threads past SKETCH_MAX_THREADS, and the copies of threads that exited
+static sketch_set_t shared;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double gamma_log;
+static uint64_t generation;  // bumped by sketch_init, stale thread slots are re-claimed
+
+static __thread int my_slot = -1;
+static __thread sketch_row_t query_row;  // sketch_query's merge target, it never yields
+static __thread uint64_t my_generation;
+static pthread_key_t slot_key;
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+
+// splitmix64 finalizer, donor ids and addresses are far from uniform
+static uint64_t mix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+static int dd_index(uint64_t amount) {
+    if (amount == 0) {
+        return 0;
+    }
+    int k = (int) ceil(log((double) amount) / gamma_log);
+    return k + 1 < DD_BUCKETS ? k + 1 : DD_BUCKETS - 1;
+}
+
+static uint64_t dd_value(int index) {
+    if (index == 0) {
+        return 0;
+    }
+    // Midpoint in relative terms, within alpha of every amount in the bucket
+    double v = 2 * exp((index - 1) * gamma_log) / (exp(gamma_log) + 1);
+    return v < 18446744073709551615.0 ? (uint64_t) llround(v) : UINT64_MAX;
+}
+
+// Only the owning thread writes a slot, relaxed atomics keep merges tear-free
+static void record(sketch_set_t* s, int charity, uint64_t h, uint64_t amount) {
+    sketch_row_t* row = &s->rows[charity];
+    uint8_t* reg = &row->hll[h >> (64 - SKETCH_HLL_BITS)];
+    uint64_t rest = h << SKETCH_HLL_BITS;
+    uint8_t rank = rest ? __builtin_clzll(rest) + 1 : 64 - SKETCH_HLL_BITS + 1;
+    if (rank > __atomic_load_n(reg, __ATOMIC_RELAXED)) {
+        __atomic_store_n(reg, rank, __ATOMIC_RELAXED);
+    }
+    uint64_t* bucket = &row->dd[dd_index(amount)];
+    __atomic_store_n(bucket, __atomic_load_n(bucket, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+static void merge(sketch_row_t* into, const sketch_row_t* from) {
+    for (int i = 0; i < HLL_REGS; i++) {
+        uint8_t r = __atomic_load_n(&from->hll[i], __ATOMIC_RELAXED);
+        if (r > into->hll[i]) {
+            into->hll[i] = r;
+        }
+    }
+    for (int i = 0; i < DD_BUCKETS; i++) {
+        into->dd[i] += __atomic_load_n(&from->dd[i], __ATOMIC_RELAXED);
+    }
+}
+
+// pthread key destructor: fold the exiting thread's copy into shared
+static void release_slot(void* arg) {
+    if (my_generation != generation || my_slot < 0) {
+        return;
+    }
+    pthread_mutex_lock(&slots_lock);
+    pthread_mutex_lock(&shared_lock);
+    for (int c = 0; c < NUM_CHARITIES; c++) {
+        merge(&shared.rows[c], &slots[my_slot]->rows[c]);
+    }
+    pthread_mutex_unlock(&shared_lock);
+    memset(slots[my_slot], 0, sizeof(sketch_set_t));
+    slot_used[my_slot] = false;
+    pthread_mutex_unlock(&slots_lock);
+    my_slot = -1;
+}
+
+static void make_slot_key() {
+    pthread_key_create(&slot_key, release_slot);
+}
+
+static void claim_slot() {
+    pthread_once(&slot_once, make_slot_key);
+    my_generation = generation;
+    my_slot = SKETCH_MAX_THREADS;
+    pthread_mutex_lock(&slots_lock);
+    for (int i = 0; i < SKETCH_MAX_THREADS; i++) {
+        if (!slot_used[i]) {
+            if (slots[i] == NULL) {
+                slots[i] = calloc(1, sizeof(sketch_set_t));
+                if (slots[i] == NULL) {
+                    printf("sketch alloc err\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            slot_used[i] = true;
+            my_slot = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&slots_lock);
+    if (my_slot < SKETCH_MAX_THREADS) {
+        // Any non-NULL value, the destructor only looks at the thread-locals
+        pthread_setspecific(slot_key, slots[my_slot]);
+    }
+}
+
+void sketch_init() {
+    gamma_log = log((1 + SKETCH_DD_ALPHA) / (1 - SKETCH_DD_ALPHA));
+    pthread_mutex_lock(&slots_lock);
+    for (int i = 0; i < SKETCH_MAX_THREADS; i++) {
+        if (slots[i]) {
+            memset(slots[i], 0, sizeof(sketch_set_t));
+        }
+        slot_used[i] = false;
+    }
+    memset(&shared, 0, sizeof(shared));
+    generation++;
+    pthread_mutex_unlock(&slots_lock);
+}
+
+// Quiescent only, like core_destroy
+void sketch_destroy() {
+    pthread_mutex_lock(&slots_lock);
+    for (int i = 0; i < SKETCH_MAX_THREADS; i++) {
+        free(slots[i]);
+        slots[i] = NULL;
+        slot_used[i] = false;
+    }
+    generation++;
+    pthread_mutex_unlock(&slots_lock);
+}
+
+void sketch_record(int charity, uint64_t source, uint64_t amount) {
+    if (my_slot < 0 || my_generation != generation) {
+        claim_slot();
+    }
+    uint64_t h = mix(source);
+    if (my_slot == SKETCH_MAX_THREADS) {
+        pthread_mutex_lock(&shared_lock);
+        record(&shared, charity, h, amount);
+        pthread_mutex_unlock(&shared_lock);
+        return;
+    }
+    record(slots[my_slot], charity, h, amount);
+}
+
+static uint64_t hll_estimate(const uint8_t* regs) {
+    double sum = 0;
+    int zeros = 0;
+    for (int i = 0; i < HLL_REGS; i++) {
+        sum += ldexp(1.0, -regs[i]);
+        zeros += regs[i] == 0;
+    }
+    double m = HLL_REGS;
+    double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    // Linear counting is more accurate while many registers are still empty
+    if (e <= 2.5 * m && zeros) {
+        e = m * log(m / zeros);
+    }
+    return (uint64_t) llround(e);
+}
+
+void sketch_query(int charity, int permille, sketch_result_t* out) {
+    // Only this charity's row of every copy
+    sketch_row_t* merged = &query_row;
+    memset(merged, 0, sizeof(sketch_row_t));
+    pthread_mutex_lock(&slots_lock);
+    for (int i = 0; i < SKETCH_MAX_THREADS; i++) {
+        if (slot_used[i]) {
+            merge(merged, &slots[i]->rows[charity]);
+        }
+    }
+    pthread_mutex_lock(&shared_lock);
+    merge(merged, &shared.rows[charity]);
+    pthread_mutex_unlock(&shared_lock);
+    pthread_mutex_unlock(&slots_lock);
+
+    const uint64_t* dd = merged->dd;
+    uint64_t count = 0;
+    for (int i = 0; i < DD_BUCKETS; i++) {
+        count += dd[i];
+    }
+    out->count = count;
+    out->distinct = hll_estimate(merged->hll);
+    out->quantile = 0;
+    if (count) {
+        uint64_t rank = (count - 1) * permille / 1000;
+        uint64_t seen = 0;
+        for (int i = 0; i < DD_BUCKETS; i++) {
+            seen += dd[i];
+            if (seen > rank) {
+                out->quantile = dd_value(i);
+                break;
+            }
+        }
+    }
+}
@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+#include "socktune.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/filter.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static const sock_profile_t profiles[] = {
+    {"default", false, false, 0, 0, 0, 0, false},
+    {"latency", true, true, 0, 50, 0, 1024, true},
+    {"throughput", false, false, 1, 0, 1 << 20, 4096, true},
+};
+#define NUM_PROFILES (sizeof(profiles) / sizeof(profiles[0]))
+
+const sock_profile_t* sock_profile = &profiles[0];
+
+int socktune_select(const char* name) {
+    for (int i = 0; i < NUM_PROFILES; i++) {
+        if (!strcmp(profiles[i].name, name)) {
+            sock_profile = &profiles[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Best effort, an option the kernel does not have (or needs privileges for)
+// leaves the socket as it was
+static void set_int(int fd, int level, int name, int value) {
+    setsockopt(fd, level, name, &value, sizeof(value));
+}
+
+void socktune_listener(int fd) {
+    const sock_profile_t* p = sock_profile;
+    if (p->nodelay) {
+        set_int(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+    }
+    if (p->defer_accept_secs) {
+        set_int(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, p->defer_accept_secs);
+    }
+    // Before listen(), the window scale is fixed by the SYN
+    if (p->buf_bytes) {
+        set_int(fd, SOL_SOCKET, SO_RCVBUF, p->buf_bytes);
+        set_int(fd, SOL_SOCKET, SO_SNDBUF, p->buf_bytes);
+    }
+}
+
+int socktune_worker_spin_us() {
+    // Spinning on the only CPU just delays whoever would send the next event
+    return sysconf(_SC_NPROCESSORS_ONLN) > 1 ? sock_profile->busy_poll_us : 0;
+}
+
+int socktune_backlog(int fallback) {
+    return sock_profile->backlog ? sock_profile->backlog : fallback;
+}
+
+void socktune_client(int fd) {
+    const sock_profile_t* p = sock_profile;
+    if (p->nodelay) {
+        set_int(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+    }
+    if (p->quickack) {
+        set_int(fd, IPPROTO_TCP, TCP_QUICKACK, 1);
+    }
+    if (p->busy_poll_us) {
+        set_int(fd, SOL_SOCKET, SO_BUSY_POLL, p->busy_poll_us);
+    }
+}
+
+void socktune_after_read(int fd) {
+    if (sock_profile->quickack) {
+        set_int(fd, IPPROTO_TCP, TCP_QUICKACK, 1);
+    }
+}
+
+int socktune_steer(const int* fds, int n) {
+    // A = receiving CPU; A %= n; return A, the index of the socket in the group
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, n},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+    // socktune_accept() polls them all and must not block on one that lost its connection
+    for (int i = 0; i < n; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    }
+    return setsockopt(fds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+int socktune_accept(const int* fds, int n, int* which, struct sockaddr* addr, socklen_t* addr_len) {
+    if (n == 1) {
+        *which = 0;
+        return accept(fds[0], addr, addr_len);
+    }
+    struct pollfd pfds[n];
+    for (int i = 0; i < n; i++) {
+        pfds[i].fd = fds[i];
+        pfds[i].events = POLLIN;
+    }
+    while (1) {
+        if (poll(pfds, n, -1) < 0) {
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+            // Non-blocking, the connection may be gone again by now
+            int fd = accept4(fds[i], addr, addr_len, 0);
+            if (fd >= 0) {
+                *which = i;
+                return fd;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+                return -1;
+            }
+        }
+    }
+}
@@ -0,0 +1,132 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "statpage.h"
+
+/*
+ * ZotDonate_stat, reads a server's stats page (statpage.h) without talking
+ * to the server. Prints it once, or every -i SECS, as a table or in the
+ * Prometheus text format (-e) for an agent to scrape or forward.
+ */
+#define USAGE_MSG "ZotDonate_stat [-h] [-i SECS] [-e] NAME"\
+                  "\n  -h                 Displays this help menu and returns EXIT_SUCCESS."\
+                  "\n  -i SECS            Print again every SECS seconds until interrupted."\
+                  "\n  -e                 Prometheus text format instead of a table."\
+                  "\n  NAME               Stats page the server was started with (-S NAME), /dev/shm/NAME.\n"
+
+static const char* window_names[RATE_WINDOWS] = {"1m", "5m", "1h"};
+
+static uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// A consistent copy, retried while the server is writing. @return -1 if it never published
+static int read_page(const statpage_t* p, statpage_t* out) {
+    if (__atomic_load_n(&p->magic, __ATOMIC_ACQUIRE) != STATPAGE_MAGIC) {
+        return -1;
+    }
+    uint64_t before, after;
+    do {
+        before = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE);
+        memcpy(out, p, sizeof(statpage_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&p->seq, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+    return 0;
+}
+
+static void print_table(const statpage_t* s) {
+    uint64_t now = now_ns();
+    printf("pid %d  strategy %s  up %.0fs  updated %.1fs ago  updates %lu\n", s->pid, s->strategy,
+           (now - s->started_ns) / 1e9, (now - s->updated_ns) / 1e9, s->updates);
+    printf("clients %d  sessions %d\n", s->clientCnt, s->sessions);
+    printf("charity  donations          top        total           1m           5m           1h\n");
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        printf("%7d %10u %12lu %12lu", i, s->charities[i].numDonations, s->charities[i].topDonation, s->charities[i].totalDonationAmt);
+        for (int w = 0; w < RATE_WINDOWS; w++) {
+            printf(" %12lu", s->rates[i][w]);
+        }
+        printf("\n");
+    }
+    printf("top 3: %lu, %lu, %lu\n\n", s->maxDonations[0], s->maxDonations[1], s->maxDonations[2]);
+}
+
+static void print_exposition(const statpage_t* s) {
+    printf("zotdonate_clients_total %d\n", s->clientCnt);
+    printf("zotdonate_sessions %d\n", s->sessions);
+    printf("zotdonate_updated_seconds %.3f\n", s->updated_ns / 1e9);
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        printf("zotdonate_donations_total{charity=\"%d\"} %u\n", i, s->charities[i].numDonations);
+        printf("zotdonate_donated_total{charity=\"%d\"} %lu\n", i, s->charities[i].totalDonationAmt);
+        printf("zotdonate_top_donation{charity=\"%d\"} %lu\n", i, s->charities[i].topDonation);
+        for (int w = 0; w < RATE_WINDOWS; w++) {
+            printf("zotdonate_donated_window{charity=\"%d\",window=\"%s\"} %lu\n", i, window_names[w], s->rates[i][w]);
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        printf("zotdonate_top_connection{rank=\"%d\"} %lu\n", i + 1, s->maxDonations[i]);
+    }
+    printf("\n");
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    int interval = 0;
+    int exposition = 0;
+    while ((opt = getopt(argc, argv, "hi:e")) != -1) {
+        switch (opt) {
+            case 'h':
+                fprintf(stderr, USAGE_MSG);
+                exit(EXIT_SUCCESS);
+            case 'i':
+                interval = atoi(optarg);
+                break;
+            case 'e':
+                exposition = 1;
+                break;
+            default:
+                fprintf(stderr, USAGE_MSG);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind != 1 || interval < 0) {
+        fprintf(stderr, USAGE_MSG);
+        exit(EXIT_FAILURE);
+    }
+    char name[256];
+    snprintf(name, sizeof(name), "/%s", argv[optind]);
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        printf("no stats page %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    const statpage_t* page = mmap(NULL, sizeof(statpage_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        printf("stats page mmap err\n");
+        exit(EXIT_FAILURE);
+    }
+
+    statpage_t s;
+    do {
+        if (read_page(page, &s)) {
+            printf("stats page not published yet\n");
+            exit(EXIT_FAILURE);
+        }
+        if (exposition) {
+            print_exposition(&s);
+        } else {
+            print_table(&s);
+        }
+        fflush(stdout);
+    } while (interval && !sleep(interval));
+    return 0;
+}
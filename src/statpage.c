@@ -0,0 +1,102 @@
+#include "statpage.h"
+#include "lifecycle.h"
+#include "timerwheel.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static statpage_t* page;
+static statpage_t next;  // what the timer builds, copied into the page
+static char page_name[256];
+static tw_timer_t publish_timer;
+static uint64_t seen_versions[NUM_CHARITIES];
+static uint64_t seen_all;
+
+static uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// A page left by an earlier process keeps its size, readers that still map
+// it never see it shrink
+static void copy_in() {
+    uint64_t seq = page->seq;
+    __atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    // magic and seq stay as they are
+    memcpy((char*) page + 2 * sizeof(uint64_t), (char*) &next + 2 * sizeof(uint64_t), sizeof(statpage_t) - 2 * sizeof(uint64_t));
+    __atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Wheel thread, the only writer
+static uint64_t publish(tw_timer_t* t) {
+    uint64_t all = core_version_all();
+    if (all != seen_all) {
+        seen_all = all;
+        for (int i = 0; i < NUM_CHARITIES; i++) {
+            uint64_t v = core_version(i);
+            if (v != seen_versions[i]) {
+                seen_versions[i] = v;
+                core_cinfo(i, &next.charities[i]);
+            }
+        }
+        core_top(next.maxDonations);
+        next.version = all;
+        next.updated_ns = now_ns();
+        next.updates++;
+    }
+    next.clientCnt = __atomic_load_n(&core_state->clientCnt, __ATOMIC_RELAXED);
+    next.sessions = session_count();
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        rate_query(i, next.rates[i]);
+    }
+    copy_in();
+    return STATPAGE_TICK_MS;
+}
+
+void statpage_start(const char* name) {
+    snprintf(page_name, sizeof(page_name), "/%s", name);
+    int fd = shm_open(page_name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(statpage_t))) {
+        printf("stats page open err\n");
+        exit(EXIT_FAILURE);
+    }
+    page = mmap(NULL, sizeof(statpage_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        printf("stats page mmap err\n");
+        exit(EXIT_FAILURE);
+    }
+    // Left odd by a process that died while writing
+    page->seq &= ~1ull;
+    memset(&next, 0, sizeof(next));
+    next.pid = getpid();
+    snprintf(next.strategy, sizeof(next.strategy), "%s", core_strategy());
+    next.started_ns = now_ns();
+    seen_all = 0;
+    memset(seen_versions, 0, sizeof(seen_versions));
+    publish(NULL);
+    __atomic_store_n(&page->magic, STATPAGE_MAGIC, __ATOMIC_RELEASE);
+
+    tw_init();
+    tw_timer_init(&publish_timer, publish, NULL);
+    tw_arm(&publish_timer, STATPAGE_TICK_MS);
+}
+
+void statpage_stop(int unlink_page) {
+    if (page == NULL) {
+        return;
+    }
+    tw_cancel(&publish_timer);
+    munmap(page, sizeof(statpage_t));
+    page = NULL;
+    if (unlink_page) {
+        shm_unlink(page_name);
+    }
+}
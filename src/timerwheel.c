@@ -0,0 +1,274 @@
+#include "timerwheel.h"
+#include "rate.h"
+#include "tseries.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_MAX_TICKS ((1ull << (TW_LEVELS * TW_SLOT_BITS)) - 1)
+
+// Each slot is the sentinel of a circular doubly linked list
+static tw_timer_t slots[TW_LEVELS][TW_SLOTS];
+static uint64_t now_tick;
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t callback_done = PTHREAD_COND_INITIALIZER;
+static tw_timer_t* running;  // whose callback the wheel thread is in, NULL between them
+static pthread_t wheel_tid;
+static volatile int wheel_running;
+
+static uint64_t idle_timeout_ms;
+static uint64_t request_timeout_ms;
+static tw_timer_t rate_timer;
+
+static void list_add(tw_timer_t* head, tw_timer_t* t) {
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void list_del(tw_timer_t* t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+// Wheel lock held
+static void tw_insert(tw_timer_t* t) {
+    if (t->expires <= now_tick) {
+        t->expires = now_tick + 1;
+    }
+    uint64_t delta = t->expires - now_tick;
+    if (delta > TW_MAX_TICKS) {
+        t->expires = now_tick + TW_MAX_TICKS;
+        delta = TW_MAX_TICKS;
+    }
+    int level = 0;
+    while (level < TW_LEVELS - 1 && delta >= (1ull << ((level + 1) * TW_SLOT_BITS))) {
+        level++;
+    }
+    int idx = (t->expires >> (level * TW_SLOT_BITS)) & TW_MASK;
+    list_add(&slots[level][idx], t);
+    t->pending = true;
+}
+
+// Wheel lock held, move every timer of a higher level slot down
+static void tw_cascade(int level, int idx) {
+    tw_timer_t* head = &slots[level][idx];
+    while (head->next != head) {
+        tw_timer_t* t = head->next;
+        list_del(t);
+        tw_insert(t);
+    }
+}
+
+// Wheel lock held, dropped around every callback
+static void tw_tick() {
+    now_tick++;
+    for (int level = 1; level < TW_LEVELS; level++) {
+        if (now_tick & ((1ull << (level * TW_SLOT_BITS)) - 1)) {
+            break;
+        }
+        tw_cascade(level, (now_tick >> (level * TW_SLOT_BITS)) & TW_MASK);
+    }
+
+    tw_timer_t* head = &slots[0][now_tick & TW_MASK];
+    while (head->next != head) {
+        tw_timer_t* t = head->next;
+        list_del(t);
+        t->pending = false;
+        running = t;
+        pthread_mutex_unlock(&wheel_lock);
+        uint64_t again = t->cb(t);
+        pthread_mutex_lock(&wheel_lock);
+        // Armed from outside meanwhile, that deadline wins
+        if (again && !t->pending) {
+            t->expires = now_tick + (again + TW_TICK_MS - 1) / TW_TICK_MS;
+            tw_insert(t);
+        }
+        running = NULL;
+        pthread_cond_broadcast(&callback_done);
+    }
+}
+
+static uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void* wheel_thread(void* vargp) {
+    uint64_t start = monotonic_ms();
+    struct timespec tick = {0, TW_TICK_MS * 1000000L};
+    while (wheel_running) {
+        nanosleep(&tick, NULL);
+        // Catch up if the thread was descheduled for more than one tick
+        uint64_t target = (monotonic_ms() - start) / TW_TICK_MS;
+        pthread_mutex_lock(&wheel_lock);
+        while (now_tick < target) {
+            tw_tick();
+        }
+        pthread_mutex_unlock(&wheel_lock);
+    }
+    return NULL;
+}
+
+void tw_init() {
+    if (wheel_running) {
+        return;
+    }
+    for (int level = 0; level < TW_LEVELS; level++) {
+        for (int i = 0; i < TW_SLOTS; i++) {
+            slots[level][i].next = slots[level][i].prev = &slots[level][i];
+        }
+    }
+    now_tick = 0;
+    wheel_running = 1;
+
+    // Keep SIGINT for the accept loop
+    spawn_thread(&wheel_tid, wheel_thread, NULL, "timer wheel");
+}
+
+void tw_shutdown() {
+    if (!wheel_running) {
+        return;
+    }
+    wheel_running = 0;
+    pthread_join(wheel_tid, NULL);
+}
+
+void tw_timer_init(tw_timer_t* t, tw_callback cb, void* data) {
+    t->next = t->prev = NULL;
+    t->expires = 0;
+    t->cb = cb;
+    t->data = data;
+    t->pending = false;
+}
+
+void tw_arm(tw_timer_t* t, uint64_t ms) {
+    pthread_mutex_lock(&wheel_lock);
+    if (t->pending) {
+        list_del(t);
+    }
+    t->expires = now_tick + (ms + TW_TICK_MS - 1) / TW_TICK_MS;
+    tw_insert(t);
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+void tw_cancel(tw_timer_t* t) {
+    pthread_mutex_lock(&wheel_lock);
+    // Its callback may re-arm it on the way out
+    while (running == t) {
+        pthread_cond_wait(&callback_done, &wheel_lock);
+    }
+    if (t->pending) {
+        list_del(t);
+        t->pending = false;
+    }
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+static uint64_t coarse_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t conn_timer_fire(tw_timer_t* t) {
+    conn_timer_t* ct = t->data;
+    uint64_t deadline = atomic_load(&ct->deadline);
+    if (deadline == 0) {
+        // The session sees armed clear or this sees its new deadline
+        atomic_store(&ct->armed, false);
+        deadline = atomic_load(&ct->deadline);
+        if (deadline == 0) {
+            return 0;
+        }
+        atomic_store(&ct->armed, true);
+    }
+    uint64_t now = coarse_ms();
+    if (deadline > now) {
+        return deadline - now;
+    }
+    atomic_store(&ct->expired, true);
+    atomic_store(&ct->armed, false);
+    shutdown(ct->fd, SHUT_RDWR);
+    return 0;
+}
+
+void conn_timeouts_init(uint64_t idle_ms, uint64_t request_ms) {
+    idle_timeout_ms = idle_ms;
+    request_timeout_ms = request_ms;
+    if (idle_ms || request_ms) {
+        tw_init();
+    }
+}
+
+void conn_timeouts_shutdown() {
+    tw_shutdown();
+}
+
+void conn_timer_init(conn_timer_t* ct, int fd) {
+    tw_timer_init(&ct->timer, conn_timer_fire, ct);
+    ct->fd = fd;
+    atomic_init(&ct->expired, false);
+    atomic_init(&ct->deadline, 0);
+    atomic_init(&ct->armed, false);
+}
+
+static void conn_timer_set(conn_timer_t* ct, uint64_t ms) {
+    if (ms == 0) {
+        atomic_store_explicit(&ct->deadline, 0, memory_order_relaxed);
+        return;
+    }
+    atomic_store(&ct->deadline, coarse_ms() + ms);
+    if (atomic_load(&ct->armed) || !wheel_running || atomic_load(&ct->expired)) {
+        return;
+    }
+    pthread_mutex_lock(&wheel_lock);
+    if (!ct->timer.pending) {
+        ct->timer.expires = now_tick + (ms + TW_TICK_MS - 1) / TW_TICK_MS;
+        tw_insert(&ct->timer);
+    }
+    atomic_store(&ct->armed, true);
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+void conn_timer_idle(conn_timer_t* ct) {
+    conn_timer_set(ct, idle_timeout_ms);
+}
+
+void conn_timer_request(conn_timer_t* ct) {
+    conn_timer_set(ct, request_timeout_ms);
+}
+
+void conn_timer_stop(conn_timer_t* ct) {
+    atomic_store(&ct->deadline, 0);
+    // Always through tw_cancel, a firing timer may be re-arming itself right now
+    if (wheel_running) {
+        tw_cancel(&ct->timer);
+    }
+    atomic_store(&ct->armed, false);
+}
+
+bool conn_timer_expired(conn_timer_t* ct) {
+    return atomic_load(&ct->expired);
+}
+
+static uint64_t rate_timer_fire(tw_timer_t* t) {
+    rate_advance();
+    ts_trim();
+    return RATE_TICK_MS;
+}
+
+void rate_timer_start() {
+    tw_init();
+    rate_advance();
+    tw_timer_init(&rate_timer, rate_timer_fire, NULL);
+    tw_arm(&rate_timer, RATE_TICK_MS);
+}
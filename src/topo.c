@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+#include "topo.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define NODE_DIR "/sys/devices/system/node"
+#define MPOL_PREFERRED 1
+
+static bool enabled;
+static int num_nodes = 1;
+static cpu_set_t node_cpus[TOPO_MAX_NODES];
+static int node_id[TOPO_MAX_NODES];  // kernel id of each node, for mbind
+static int cpu_node[CPU_SETSIZE];
+
+// "0-3,8-11" style list, sets the bits in *set. @return -1 if unreadable
+static int read_list(const char* path, cpu_set_t* set) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    char buf[4096];
+    if (fgets(buf, sizeof(buf), f) == NULL) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    CPU_ZERO(set);
+    for (char* p = buf; *p && *p != '\n';) {
+        char* end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p) {
+            return -1;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+        }
+        for (long i = lo; i <= hi && i < CPU_SETSIZE; i++) {
+            CPU_SET(i, set);
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+int topo_init() {
+    cpu_set_t online;
+    num_nodes = 1;
+    node_id[0] = 0;
+    memset(cpu_node, 0, sizeof(cpu_node));
+    if (read_list(NODE_DIR "/online", &online)) {
+        // No NUMA information, every CPU is on node 0
+        sched_getaffinity(0, sizeof(node_cpus[0]), &node_cpus[0]);
+    } else {
+        // Online ids can have gaps, e.g. "0,2-3"
+        num_nodes = 0;
+        for (int id = 0; id < TOPO_MAX_NODES; id++) {
+            if (!CPU_ISSET(id, &online)) {
+                continue;
+            }
+            int n = num_nodes++;
+            char path[64];
+            snprintf(path, sizeof(path), NODE_DIR "/node%d/cpulist", id);
+            if (read_list(path, &node_cpus[n])) {
+                CPU_ZERO(&node_cpus[n]);
+            }
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &node_cpus[n])) {
+                    cpu_node[cpu] = n;
+                }
+            }
+            node_id[n] = id;
+        }
+        if (num_nodes == 0) {
+            num_nodes = 1;
+            node_id[0] = 0;
+            sched_getaffinity(0, sizeof(node_cpus[0]), &node_cpus[0]);
+        }
+    }
+    enabled = true;
+    return num_nodes;
+}
+
+bool topo_enabled() {
+    return enabled;
+}
+
+int topo_nodes() {
+    return num_nodes;
+}
+
+int topo_node_of_cpu(int cpu) {
+    return cpu >= 0 && cpu < CPU_SETSIZE ? cpu_node[cpu] : 0;
+}
+
+int topo_current_node() {
+    return enabled ? topo_node_of_cpu(sched_getcpu()) : 0;
+}
+
+int topo_cpus_on_node(int node) {
+    return CPU_COUNT(&node_cpus[node % num_nodes]);
+}
+
+void topo_pin_self(int node) {
+    if (enabled && CPU_COUNT(&node_cpus[node % num_nodes])) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &node_cpus[node % num_nodes]);
+    }
+}
+
+void topo_pin_attr(pthread_attr_t* attr, int node) {
+    if (enabled && CPU_COUNT(&node_cpus[node % num_nodes])) {
+        pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &node_cpus[node % num_nodes]);
+    }
+}
+
+void* topo_alloc(size_t size, int node) {
+    node %= num_nodes;
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    if (enabled && num_nodes > 1) {
+        // Before the first touch, so every page is allocated there
+        int id = node_id[node];
+        unsigned long mask[TOPO_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+        mask[id / (8 * sizeof(unsigned long))] |= 1ul << (id % (8 * sizeof(unsigned long)));
+        syscall(SYS_mbind, p, size, MPOL_PREFERRED, mask, TOPO_MAX_NODES + 1, 0);
+    }
+    return p;
+}
+
+void topo_free(void* p, size_t size) {
+    munmap(p, size);
+}
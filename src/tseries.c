@@ -0,0 +1,326 @@
+#include "tseries.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "core.h"
+
+#define TS_MAX_RECORD_BITS (4 + 64 + 1 + 6 + 6 + 64)
+#define TS_CHUNK_BITS (TS_CHUNK_BYTES * 8)
+
+typedef struct {
+    uint64_t first_ts;  // also the encoder's starting point
+    uint64_t min_ts;    // range covered, the clock may step back
+    uint64_t max_ts;
+    uint32_t count;
+    uint32_t bits;
+    int refs;           // queries decoding it outside the lock
+    bool retired;       // trimmed while pinned, the last query frees it
+    // Encoder state after the last point
+    uint64_t prev_ts;
+    int64_t prev_delta;
+    uint64_t prev_amount;
+    uint8_t data[TS_CHUNK_BYTES];
+} ts_chunk_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    ts_chunk_t** chunks;  // the last one is open, the rest are sealed
+    int len;
+    int cap;
+} __attribute__((aligned(CACHE_LINE))) ts_series_t;
+
+static ts_series_t series[NUM_CHARITIES];
+static uint64_t retention_ms;  // 0 while history is off
+
+/********************** bit stream *********/
+static void put_bits(ts_chunk_t* c, uint64_t v, int n) {
+    while (n > 0) {
+        int used = c->bits & 7;
+        int take = 8 - used < n ? 8 - used : n;
+        uint8_t part = (v >> (n - take)) & ((1u << take) - 1);
+        c->data[c->bits >> 3] |= part << (8 - used - take);
+        c->bits += take;
+        n -= take;
+    }
+}
+
+static uint64_t get_bits(const uint8_t* data, uint32_t* pos, int n) {
+    uint64_t v = 0;
+    while (n > 0) {
+        int used = *pos & 7;
+        int take = 8 - used < n ? 8 - used : n;
+        uint8_t part = (data[*pos >> 3] >> (8 - used - take)) & ((1u << take) - 1);
+        v = (v << take) | part;
+        *pos += take;
+        n -= take;
+    }
+    return v;
+}
+
+/********************** codecs *************/
+static void put_dod(ts_chunk_t* c, int64_t dod) {
+    if (dod == 0) {
+        put_bits(c, 0, 1);
+    } else if (dod >= -63 && dod <= 64) {
+        put_bits(c, 0x2, 2);
+        put_bits(c, dod + 63, 7);
+    } else if (dod >= -255 && dod <= 256) {
+        put_bits(c, 0x6, 3);
+        put_bits(c, dod + 255, 9);
+    } else if (dod >= -2047 && dod <= 2048) {
+        put_bits(c, 0xE, 4);
+        put_bits(c, dod + 2047, 12);
+    } else {
+        put_bits(c, 0xF, 4);
+        put_bits(c, (uint64_t) dod, 64);
+    }
+}
+
+static int64_t get_dod(const uint8_t* data, uint32_t* pos) {
+    if (!get_bits(data, pos, 1)) {
+        return 0;
+    }
+    if (!get_bits(data, pos, 1)) {
+        return (int64_t) get_bits(data, pos, 7) - 63;
+    }
+    if (!get_bits(data, pos, 1)) {
+        return (int64_t) get_bits(data, pos, 9) - 255;
+    }
+    if (!get_bits(data, pos, 1)) {
+        return (int64_t) get_bits(data, pos, 12) - 2047;
+    }
+    return (int64_t) get_bits(data, pos, 64);
+}
+
+// '0' for a repeated amount, else '1', leading zeros, length - 1, meaningful bits
+static void put_xor(ts_chunk_t* c, uint64_t x) {
+    if (x == 0) {
+        put_bits(c, 0, 1);
+        return;
+    }
+    int lead = __builtin_clzll(x);
+    int trail = __builtin_ctzll(x);
+    int len = 64 - lead - trail;
+    put_bits(c, 1, 1);
+    put_bits(c, lead, 6);
+    put_bits(c, len - 1, 6);
+    put_bits(c, x >> trail, len);
+}
+
+static uint64_t get_xor(const uint8_t* data, uint32_t* pos) {
+    if (!get_bits(data, pos, 1)) {
+        return 0;
+    }
+    int lead = get_bits(data, pos, 6);
+    int len = get_bits(data, pos, 6) + 1;
+    return get_bits(data, pos, len) << (64 - lead - len);
+}
+
+/********************** series *************/
+static ts_chunk_t* chunk_new(ts_series_t* s, uint64_t ms) {
+    if (s->len == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 64;
+        s->chunks = realloc(s->chunks, s->cap * sizeof(ts_chunk_t*));
+        if (s->chunks == NULL) {
+            printf("history realloc err\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    ts_chunk_t* c = calloc(1, sizeof(ts_chunk_t));
+    if (c == NULL) {
+        printf("history chunk alloc err\n");
+        exit(EXIT_FAILURE);
+    }
+    c->first_ts = c->prev_ts = c->min_ts = c->max_ts = ms;
+    s->chunks[s->len++] = c;
+    return c;
+}
+
+void ts_init() {
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        if (pthread_mutex_init(&series[i].lock, NULL)) {
+            printf("mutex init err\n");
+            exit(EXIT_FAILURE);
+        }
+        series[i].chunks = NULL;
+        series[i].len = series[i].cap = 0;
+    }
+}
+
+void ts_enable(int hours) {
+    retention_ms = hours * 3600000ull;
+}
+
+bool ts_enabled() {
+    return retention_ms != 0;
+}
+
+void ts_destroy() {
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        for (int j = 0; j < series[i].len; j++) {
+            free(series[i].chunks[j]);
+        }
+        free(series[i].chunks);
+        pthread_mutex_destroy(&series[i].lock);
+    }
+}
+
+void ts_append(int charity, uint64_t ms, uint64_t amount) {
+    ts_series_t* s = &series[charity];
+    pthread_mutex_lock(&s->lock);
+    ts_chunk_t* c = s->len ? s->chunks[s->len - 1] : NULL;
+    if (c == NULL || c->bits + TS_MAX_RECORD_BITS > TS_CHUNK_BITS) {
+        c = chunk_new(s, ms);
+    }
+    int64_t delta = (int64_t) (ms - c->prev_ts);
+    put_dod(c, delta - c->prev_delta);
+    put_xor(c, amount ^ c->prev_amount);
+    c->prev_ts = ms;
+    c->prev_delta = delta;
+    c->prev_amount = amount;
+    c->count++;
+    if (ms < c->min_ts) {
+        c->min_ts = ms;
+    }
+    if (ms > c->max_ts) {
+        c->max_ts = ms;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void ts_trim() {
+    if (!retention_ms) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t now_ms = now.tv_sec * 1000ull + now.tv_nsec / 1000000;
+    if (now_ms < retention_ms) {
+        return;
+    }
+    uint64_t cutoff = now_ms - retention_ms;
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        ts_series_t* s = &series[i];
+        pthread_mutex_lock(&s->lock);
+        int n = 0;
+        for (; n < s->len - 1 && s->chunks[n]->max_ts < cutoff; n++) {
+            // A query in flight still decodes it and frees it when done
+            if (s->chunks[n]->refs) {
+                s->chunks[n]->retired = true;
+            } else {
+                free(s->chunks[n]);
+            }
+        }
+        if (n) {
+            s->len -= n;
+            memmove(s->chunks, s->chunks + n, sizeof(ts_chunk_t*) * s->len);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+static void decode_into(const ts_chunk_t* c, uint64_t from_ms, uint64_t width_ms, uint64_t* out, int n) {
+    uint64_t ts = c->first_ts;
+    int64_t delta = 0;
+    uint64_t amount = 0;
+    uint32_t pos = 0;
+    for (uint32_t i = 0; i < c->count; i++) {
+        delta += get_dod(c->data, &pos);
+        ts += delta;
+        amount ^= get_xor(c->data, &pos);
+        if (ts >= from_ms) {
+            uint64_t bucket = (ts - from_ms) / width_ms;
+            if (bucket < n) {
+                out[bucket] += amount;
+            }
+        }
+    }
+}
+
+void ts_query(int charity, uint64_t from_ms, uint64_t width_ms, uint64_t* out, int n) {
+    ts_series_t* s = &series[charity];
+    uint64_t span = width_ms * n;
+    uint64_t to_ms = span > UINT64_MAX - from_ms ? UINT64_MAX : from_ms + span;
+    memset(out, 0, sizeof(uint64_t) * n);
+
+    // Sealed chunks are immutable and pinned against ts_trim(), only the
+    // open one has to be copied under the lock
+    pthread_mutex_lock(&s->lock);
+    ts_chunk_t** chunks = malloc(sizeof(ts_chunk_t*) * (s->len + 1));
+    int len = 0;
+    for (int i = 0; i < s->len - 1; i++) {
+        ts_chunk_t* c = s->chunks[i];
+        if (c->max_ts >= from_ms && c->min_ts < to_ms) {
+            c->refs++;
+            chunks[len++] = c;
+        }
+    }
+    int sealed = len;
+    ts_chunk_t open;
+    if (s->len) {
+        open = *s->chunks[s->len - 1];
+        if (open.max_ts >= from_ms && open.min_ts < to_ms) {
+            chunks[len++] = &open;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    for (int i = 0; i < len; i++) {
+        decode_into(chunks[i], from_ms, width_ms, out, n);
+    }
+
+    if (sealed) {
+        pthread_mutex_lock(&s->lock);
+        for (int i = 0; i < sealed; i++) {
+            if (--chunks[i]->refs == 0 && chunks[i]->retired) {
+                free(chunks[i]);
+            }
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    free(chunks);
+}
+
+size_t ts_memory() {
+    size_t bytes = 0;
+    for (int i = 0; i < NUM_CHARITIES; i++) {
+        pthread_mutex_lock(&series[i].lock);
+        bytes += series[i].len * sizeof(ts_chunk_t) + series[i].cap * sizeof(ts_chunk_t*);
+        pthread_mutex_unlock(&series[i].lock);
+    }
+    return bytes;
+}
+
+/*
+ * HISTORY request in the stats fields: charityID_high is the charity,
+ * charityID_low the bucket width in minutes (0 means 1), amount_high and
+ * amount_low the range [T1, T2) in seconds since the epoch.
+ */
+size_t ts_history_reply(const message_t* req, char** buf) {
+    int charity = req->msgdata.stats.charityID_high;
+    uint64_t width_ms = (req->msgdata.stats.charityID_low ? req->msgdata.stats.charityID_low : 1) * 60000ull;
+    uint64_t t1 = req->msgdata.stats.amount_high;
+    uint64_t t2 = req->msgdata.stats.amount_low;
+    // Past UINT64_MAX / 1000 the range no longer fits in ms
+    if (!retention_ms || charity >= NUM_CHARITIES || t2 <= t1 || t2 > UINT64_MAX / 1000) {
+        return 0;
+    }
+    uint64_t n = ((t2 - t1) * 1000 + width_ms - 1) / width_ms;
+    if (n > HISTORY_MAX_BUCKETS) {
+        n = HISTORY_MAX_BUCKETS;
+    }
+    *buf = malloc(sizeof(message_t) + n * sizeof(uint64_t));
+    if (*buf == NULL) {
+        return 0;
+    }
+    message_t reply = *req;
+    reply.msgdata.donation.amount = n * sizeof(uint64_t);
+    memcpy(*buf, &reply, sizeof(message_t));
+    ts_query(charity, t1 * 1000, width_ms, (uint64_t*) (*buf + sizeof(message_t)), n);
+    return sizeof(message_t) + n * sizeof(uint64_t);
+}
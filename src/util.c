@@ -0,0 +1,62 @@
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+void block_server_signals(sigset_t* old) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, old);
+}
+
+void restore_signals(const sigset_t* old) {
+    pthread_sigmask(SIG_SETMASK, old, NULL);
+}
+
+void spawn_thread(pthread_t* tid, void* (*fn)(void*), void* arg, const char* what) {
+    sigset_t old;
+    block_server_signals(&old);
+    if (pthread_create(tid, NULL, fn, arg)) {
+        printf("%s thread create err\n", what);
+        exit(EXIT_FAILURE);
+    }
+    restore_signals(&old);
+}
+
+int write_all(int fd, const void* buf, size_t len) {
+    const char* p = buf;
+    while (len) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int read_all(int fd, void* buf, size_t len) {
+    char* p = buf;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+uint64_t wall_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
@@ -0,0 +1,101 @@
+#include "wsdeque.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static ws_array_t* ws_array_new(long size) {
+    ws_array_t* a = malloc(sizeof(ws_array_t) + size * sizeof(void*));
+    if (a == NULL) {
+        printf("ws_array malloc err\n");
+        exit(EXIT_FAILURE);
+    }
+    a->size = size;
+    a->prev = NULL;
+    return a;
+}
+
+void ws_deque_init(ws_deque_t* q, long size) {
+    atomic_init(&q->top, 0);
+    atomic_init(&q->bottom, 0);
+    atomic_init(&q->array, ws_array_new(size));
+}
+
+void ws_deque_destroy(ws_deque_t* q) {
+    ws_array_t* a = atomic_load_explicit(&q->array, memory_order_relaxed);
+    while (a) {
+        ws_array_t* prev = a->prev;
+        free(a);
+        a = prev;
+    }
+}
+
+// Thieves may still be reading the old array, so it is retired, not freed
+static ws_array_t* ws_grow(ws_deque_t* q, ws_array_t* a, long top, long bottom) {
+    ws_array_t* bigger = ws_array_new(a->size * 2);
+    for (long i = top; i < bottom; i++) {
+        void* x = atomic_load_explicit(&a->buf[i & (a->size - 1)], memory_order_relaxed);
+        atomic_store_explicit(&bigger->buf[i & (bigger->size - 1)], x, memory_order_relaxed);
+    }
+    bigger->prev = a;
+    atomic_store_explicit(&q->array, bigger, memory_order_release);
+    return bigger;
+}
+
+void ws_push(ws_deque_t* q, void* x) {
+    long b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&q->top, memory_order_acquire);
+    ws_array_t* a = atomic_load_explicit(&q->array, memory_order_relaxed);
+    if (b - t > a->size - 1) {
+        a = ws_grow(q, a, t, b);
+    }
+    atomic_store_explicit(&a->buf[b & (a->size - 1)], x, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+}
+
+void* ws_take(ws_deque_t* q) {
+    long b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+    ws_array_t* a = atomic_load_explicit(&q->array, memory_order_relaxed);
+    atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&q->top, memory_order_relaxed);
+
+    void* x = NULL;
+    if (t <= b) {
+        x = atomic_load_explicit(&a->buf[b & (a->size - 1)], memory_order_relaxed);
+        if (t == b) {
+            // Last element, race against thieves for it
+            if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+                    memory_order_seq_cst, memory_order_relaxed)) {
+                x = NULL;
+            }
+            atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+    }
+    return x;
+}
+
+void* ws_steal(ws_deque_t* q) {
+    long t = atomic_load_explicit(&q->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+
+    if (t < b) {
+        ws_array_t* a = atomic_load_explicit(&q->array, memory_order_acquire);
+        void* x = atomic_load_explicit(&a->buf[t & (a->size - 1)], memory_order_relaxed);
+        if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+                memory_order_seq_cst, memory_order_relaxed)) {
+            return WS_ABORT;
+        }
+        return x;
+    }
+    return NULL;
+}
+
+long ws_size(ws_deque_t* q) {
+    long b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&q->top, memory_order_relaxed);
+    return b > t ? b - t : 0;
+}
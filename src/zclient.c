@@ -0,0 +1,452 @@
+#include "zclient.h"
+#include "mux.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define ZC_BUF_INITIAL 4096
+#define ZC_READ_CHUNK (64 * 1024)
+#define ZC_VERSION_BYTES sizeof(uint64_t)
+
+static void* xrealloc(void* p, size_t len) {
+    p = realloc(p, len);
+    if (p == NULL) {
+        printf("zclient alloc err\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+// Grow *buf so that need bytes fit
+static void reserve(char** buf, size_t* cap, size_t need) {
+    if (need <= *cap) {
+        return;
+    }
+    size_t n = *cap ? *cap : ZC_BUF_INITIAL;
+    while (n < need) {
+        n *= 2;
+    }
+    *buf = xrealloc(*buf, n);
+    *cap = n;
+}
+
+static bool write_all(int fd, const void* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = send(fd, (const char*) buf + done, len - done, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char*) buf + done, len - done);
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+static int tcp_connect(const char* host, int port) {
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* res;
+    if (getaddrinfo(host, service, &hints, &res)) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        // Batching happens in the send buffer, not in the kernel
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+zc_conn_t* zc_connect(const char* host, int port, int flags) {
+    int fd = tcp_connect(host, port);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (flags & ZC_MUX) {
+        // The server echoes the hello, or refuses it with ERROR
+        message_t hello = {0};
+        hello.msgtype = MUX_HELLO;
+        if (!write_all(fd, &hello, sizeof(hello)) || !read_all(fd, &hello, sizeof(hello)) || hello.msgtype != MUX_HELLO) {
+            close(fd);
+            return NULL;
+        }
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    zc_conn_t* c = calloc(1, sizeof(zc_conn_t));
+    if (c == NULL) {
+        printf("zclient alloc err\n");
+        exit(EXIT_FAILURE);
+    }
+    c->fd = fd;
+    c->mux = flags & ZC_MUX;
+    return c;
+}
+
+/********************** completions *********/
+static zc_pending_t pop(zc_conn_t* c) {
+    zc_pending_t p = c->pending[c->head];
+    c->head = (c->head + 1) % ZC_MAX_INFLIGHT;
+    c->count--;
+    return p;
+}
+
+static void complete(const zc_pending_t* p, zc_reply_t* r) {
+    r->session = p->session;
+    if (p->done) {
+        p->done(r, p->arg);
+    }
+}
+
+// Every pending request fails, the caller reopens if it wants to
+static int fail_all(zc_conn_t* c) {
+    int n = 0;
+    // A plain MT connection answers LOGOUT by closing
+    if (c->count && c->pending[c->head].type == LOGOUT) {
+        zc_pending_t p = pop(c);
+        zc_reply_t r = {ZC_OK};
+        r.msg.msgtype = LOGOUT;
+        complete(&p, &r);
+        n++;
+    }
+    while (c->count) {
+        zc_pending_t p = pop(c);
+        zc_reply_t r = {ZC_EDISCONNECTED};
+        complete(&p, &r);
+        n++;
+    }
+    c->broken = true;
+    return n;
+}
+
+static bool variable_length(uint8_t type) {
+    return type == TOP_DONORS || type == HISTORY || type == CINFO_ALL;
+}
+
+static bool conditional(uint8_t type) {
+    return type == CINFO_IF_CHANGED || type == TOP_IF_CHANGED || type == STATS_IF_CHANGED;
+}
+
+/*
+ * Size of the reply to a request of the given type at buf, 0 if len bytes do
+ * not tell yet. The reply shape is known from the type (protocol_ext.h).
+ */
+static size_t reply_len(uint8_t type, const char* buf, size_t len) {
+    if (len < 1) {
+        return 0;
+    }
+    if ((uint8_t) buf[0] == NOT_MODIFIED) {
+        return 1;
+    }
+    if (len < sizeof(message_t)) {
+        return 0;
+    }
+    const message_t* m = (const message_t*) buf;
+    if (m->msgtype == ERROR) {
+        return sizeof(message_t);
+    }
+    if (conditional(type)) {
+        return sizeof(message_t) + ZC_VERSION_BYTES;
+    }
+    if (variable_length(type)) {
+        return sizeof(message_t) + m->msgdata.donation.amount;
+    }
+    return sizeof(message_t);
+}
+
+// Match complete replies in c->in to pending requests
+static int dispatch(zc_conn_t* c) {
+    int n = 0;
+    size_t off = 0;
+    size_t prefix = c->mux ? MUX_ID_BYTES : 0;
+    while (c->count) {
+        const zc_pending_t* p = &c->pending[c->head];
+        if (c->in_len - off < prefix) {
+            break;
+        }
+        const char* buf = c->in + off + prefix;
+        size_t len = reply_len(p->type, buf, c->in_len - off - prefix);
+        if (len == 0 || c->in_len - off - prefix < len) {
+            break;
+        }
+        zc_reply_t r = {ZC_OK};
+        if (len == 1) {
+            r.msg.msgtype = NOT_MODIFIED;
+        } else {
+            memcpy(&r.msg, buf, sizeof(message_t));
+        }
+        if (r.msg.msgtype != ERROR && len > sizeof(message_t)) {
+            if (conditional(p->type)) {
+                memcpy(&r.version, buf + sizeof(message_t), ZC_VERSION_BYTES);
+            } else {
+                r.payload = buf + sizeof(message_t);
+                r.payload_len = len - sizeof(message_t);
+            }
+        }
+        zc_pending_t done = pop(c);
+        complete(&done, &r);
+        off += prefix + len;
+        n++;
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    return n;
+}
+
+/********************** I/O *****************/
+// Non-blocking send of whatever is queued. false once the connection is gone
+static bool flush(zc_conn_t* c) {
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        c->out_off += n;
+    }
+    c->out_off = c->out_len = 0;
+    return true;
+}
+
+// Read everything available and run completions. false once the connection is gone
+static bool receive(zc_conn_t* c, int* completed) {
+    while (1) {
+        reserve(&c->in, &c->in_cap, c->in_len + ZC_READ_CHUNK);
+        ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+        if (n == 0) {
+            *completed += dispatch(c);
+            return false;
+        }
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        c->in_len += n;
+        *completed += dispatch(c);
+    }
+}
+
+static int service(zc_conn_t* c, short revents) {
+    int n = 0;
+    bool ok = true;
+    if (revents & POLLOUT) {
+        ok = flush(c);
+    }
+    if (ok && (revents & (POLLIN | POLLHUP | POLLERR))) {
+        ok = receive(c, &n);
+    }
+    if (!ok) {
+        n += fail_all(c);
+    }
+    return n;
+}
+
+int zc_submit_session(zc_conn_t* c, uint32_t session, const message_t* req, zc_done_fn done, void* arg) {
+    if (c->broken || c->count == ZC_MAX_INFLIGHT || req->msgtype == SUBSCRIBE || req->msgtype == MUX_HELLO) {
+        return -1;
+    }
+    size_t len = (c->mux ? MUX_ID_BYTES : 0) + sizeof(message_t);
+    reserve(&c->out, &c->out_cap, c->out_len + len);
+    if (c->mux) {
+        memcpy(c->out + c->out_len, &session, MUX_ID_BYTES);
+    }
+    memcpy(c->out + c->out_len + len - sizeof(message_t), req, sizeof(message_t));
+    c->out_len += len;
+
+    zc_pending_t* p = &c->pending[(c->head + c->count) % ZC_MAX_INFLIGHT];
+    p->type = req->msgtype;
+    p->session = c->mux ? session : 0;
+    p->done = done;
+    p->arg = arg;
+    c->count++;
+    return 0;
+}
+
+int zc_submit(zc_conn_t* c, const message_t* req, zc_done_fn done, void* arg) {
+    return zc_submit_session(c, 0, req, done, arg);
+}
+
+int zc_fd(const zc_conn_t* c) {
+    return c->fd;
+}
+
+short zc_events(const zc_conn_t* c) {
+    return POLLIN | (c->out_off < c->out_len ? POLLOUT : 0);
+}
+
+int zc_inflight(const zc_conn_t* c) {
+    return c->count;
+}
+
+int zc_poll(zc_conn_t* c, int timeout_ms) {
+    if (c->broken) {
+        return -1;
+    }
+    if (!flush(c)) {
+        return fail_all(c);
+    }
+    if (c->count == 0) {
+        return 0;
+    }
+    struct pollfd pfd = {c->fd, zc_events(c), 0};
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return 0;
+    }
+    return service(c, pfd.revents);
+}
+
+int zc_service(zc_conn_t* c, short revents) {
+    return c->broken ? -1 : service(c, revents);
+}
+
+int zc_drain(zc_conn_t* c) {
+    while (c->count) {
+        zc_poll(c, -1);
+    }
+    return c->broken ? -1 : 0;
+}
+
+void zc_close(zc_conn_t* c) {
+    fail_all(c);
+    close(c->fd);
+    free(c->out);
+    free(c->in);
+    free(c);
+}
+
+/********************** pool ****************/
+zc_pool_t* zc_pool_open(const char* host, int port, int size, int flags) {
+    zc_pool_t* p = calloc(1, sizeof(zc_pool_t));
+    if (p == NULL || (p->conns = calloc(size, sizeof(zc_conn_t*))) == NULL || (p->host = strdup(host)) == NULL) {
+        printf("zclient alloc err\n");
+        exit(EXIT_FAILURE);
+    }
+    p->size = size;
+    p->port = port;
+    p->flags = flags;
+    int open = 0;
+    for (int i = 0; i < size; i++) {
+        p->conns[i] = zc_connect(host, port, flags);
+        open += p->conns[i] != NULL;
+    }
+    if (open == 0) {
+        zc_pool_close(p);
+        return NULL;
+    }
+    return p;
+}
+
+void zc_pool_close(zc_pool_t* p) {
+    for (int i = 0; i < p->size; i++) {
+        if (p->conns[i]) {
+            zc_close(p->conns[i]);
+        }
+    }
+    free(p->conns);
+    free(p->host);
+    free(p);
+}
+
+zc_conn_t* zc_pool_pick(zc_pool_t* p) {
+    zc_conn_t* best = NULL;
+    for (int i = 0; i < p->size; i++) {
+        zc_conn_t* c = p->conns[i];
+        if (c && c->broken) {
+            zc_close(c);
+            c = p->conns[i] = NULL;
+        }
+        if (c == NULL) {
+            c = p->conns[i] = zc_connect(p->host, p->port, p->flags);
+        }
+        if (c && c->count < ZC_MAX_INFLIGHT && (best == NULL || c->count < best->count)) {
+            best = c;
+        }
+    }
+    return best;
+}
+
+int zc_pool_submit(zc_pool_t* p, const message_t* req, zc_done_fn done, void* arg) {
+    zc_conn_t* c = zc_pool_pick(p);
+    return c ? zc_submit(c, req, done, arg) : -1;
+}
+
+int zc_pool_poll(zc_pool_t* p, int timeout_ms) {
+    struct pollfd pfds[p->size];
+    zc_conn_t* live[p->size];
+    int n = 0, completed = 0;
+    for (int i = 0; i < p->size; i++) {
+        zc_conn_t* c = p->conns[i];
+        if (c == NULL || c->broken) {
+            continue;
+        }
+        if (!flush(c)) {
+            completed += fail_all(c);
+            continue;
+        }
+        if (c->count) {
+            live[n] = c;
+            pfds[n] = (struct pollfd) {c->fd, zc_events(c), 0};
+            n++;
+        }
+    }
+    if (n == 0 || poll(pfds, n, timeout_ms) <= 0) {
+        return completed;
+    }
+    for (int i = 0; i < n; i++) {
+        if (pfds[i].revents) {
+            completed += service(live[i], pfds[i].revents);
+        }
+    }
+    return completed;
+}
+
+int zc_pool_inflight(const zc_pool_t* p) {
+    int n = 0;
+    for (int i = 0; i < p->size; i++) {
+        if (p->conns[i]) {
+            n += p->conns[i]->count;
+        }
+    }
+    return n;
+}
+
+void zc_pool_drain(zc_pool_t* p) {
+    while (zc_pool_inflight(p)) {
+        zc_pool_poll(p, -1);
+    }
+}
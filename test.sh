@@ -2,9 +2,9 @@
 
 RW_SERVER="./bin/ZotDonate_RWserver"
 MT_SERVER="./bin/ZotDonate_MTserver"
-RCLIENT="./bin/zotDonate_Rclient"
-WCLIENT="./bin/zotDonate_Wclient"
-CLIENT="./bin/zotDonate_client"
+RCLIENT="./bin/ZotDonate_Rclient"
+WCLIENT="./bin/ZotDonate_Wclient"
+CLIENT="./bin/ZotDonate_client"
 RW_SERVER_LOG="./bin/rw_server_log.txt"
 MT_SERVER_LOG="./bin/mt_server_log.txt"
 R_PORT=8080
@@ -0,0 +1,127 @@
+// Session table of multiplexed connections (include/mux.h), deletion across the wrap
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mux.h"
+
+#define CAP 16  // MUX_INITIAL_CAP, grows past 7 sessions
+#define MAX_IDS 64
+
+static int failures;
+
+static uint32_t home_of(uint32_t id) {
+    return (uint32_t) (id * 2654435769u) & (CAP - 1);
+}
+
+// First ids whose home slot is home
+static int ids_at(uint32_t home, uint32_t* out, int n) {
+    int len = 0;
+    for (uint32_t id = 1; len < n; id++) {
+        if (home_of(id) == home) {
+            out[len++] = id;
+        }
+    }
+    return len;
+}
+
+// Every live id must be found where a lookup probes, holding its own total
+static void check(mux_table_t* t, const uint32_t* ids, const bool* live, int n, const char* what) {
+    uint32_t count = t->count;
+    for (int i = 0; i < n; i++) {
+        if (!live[i]) {
+            continue;
+        }
+        session_t* s = mux_get(t, ids[i]);
+        if (t->count != count || s->donation_total != ids[i]) {
+            printf("%s: session %u lost\n", what, ids[i]);
+            failures++;
+            return;
+        }
+    }
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < t->cap; i++) {
+        used += t->slots[i].used;
+    }
+    if (used != count) {
+        printf("%s: %u slots used, %u sessions\n", what, used, count);
+        failures++;
+    }
+}
+
+static void add(mux_table_t* t, uint32_t id) {
+    mux_get(t, id)->donation_total = id;
+}
+
+int main() {
+    uint32_t last[3], first[2], mid[1];
+    ids_at(CAP - 1, last, 3);
+    ids_at(0, first, 2);
+    ids_at(1, mid, 1);
+
+    // Slots 15, 0, 1 hold the ids homed at 15, then 2, 3 the ids homed at 0
+    // and 4 the one homed at 1: every removal shifts entries back over the wrap
+    uint32_t ids[] = {last[0], last[1], last[2], first[0], first[1], mid[0]};
+    int n = sizeof(ids) / sizeof(ids[0]);
+    for (int victim = 0; victim < n; victim++) {
+        mux_table_t t;
+        mux_init(&t);
+        bool live[MAX_IDS];
+        for (int i = 0; i < n; i++) {
+            add(&t, ids[i]);
+            live[i] = true;
+        }
+        if (t.cap != CAP || !t.slots[CAP - 1].used || t.slots[CAP - 1].id != last[0] || t.slots[0].id != last[1]) {
+            printf("cluster does not wrap\n");
+            exit(EXIT_FAILURE);
+        }
+        mux_remove(&t, ids[victim]);
+        live[victim] = false;
+        check(&t, ids, live, n, "remove one");
+        // A hole left in the cluster would hide whatever is behind it
+        for (int i = 0; i < n; i++) {
+            if (live[i]) {
+                mux_remove(&t, ids[i]);
+                live[i] = false;
+                check(&t, ids, live, n, "remove rest");
+            }
+        }
+        if (t.count != 0) {
+            printf("%u sessions left\n", t.count);
+            failures++;
+        }
+        mux_destroy(&t);
+    }
+
+    // Random churn of ids crowding the end of the table, below the grow point
+    uint32_t pool[MAX_IDS];
+    ids_at(CAP - 2, pool, MAX_IDS / 4);
+    ids_at(CAP - 1, pool + MAX_IDS / 4, MAX_IDS / 4);
+    ids_at(0, pool + MAX_IDS / 2, MAX_IDS / 4);
+    ids_at(1, pool + 3 * MAX_IDS / 4, MAX_IDS / 4);
+    bool live[MAX_IDS] = {false};
+    int live_count = 0;
+    mux_table_t t;
+    mux_init(&t);
+    srand(1);
+    for (int round = 0; round < 100000 && !failures; round++) {
+        int i = rand() % MAX_IDS;
+        if (live[i]) {
+            mux_remove(&t, pool[i]);
+            live[i] = false;
+            live_count--;
+        } else if (live_count < CAP / 2 - 1) {
+            add(&t, pool[i]);
+            live[i] = true;
+            live_count++;
+        }
+        check(&t, pool, live, MAX_IDS, "churn");
+    }
+    mux_destroy(&t);
+
+    if (failures) {
+        printf("mux: %d failures\n", failures);
+        exit(EXIT_FAILURE);
+    }
+    printf("mux: ok\n");
+    return 0;
+}
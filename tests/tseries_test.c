@@ -0,0 +1,114 @@
+// Round trip of the history codec (include/tseries.h) and its retention
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "tseries.h"
+
+#define CYCLES 40
+
+// Around a 5 s delta, the delta-of-deltas hit both ends of the 7, 9 and 12
+// bit codes, one past them, and the 64-bit code (each row sums to 0)
+static const int64_t dods[] = {
+    0, 1, -1, -63, 63, 64, -64, -64, 64, 65, -65,
+    -255, 255, 256, -256, -256, 256, 257, -257,
+    -2047, 2047, 2048, -2048, -2048, 2048, 2049, -2049,
+    100000, -100000,
+};
+
+// Repeats (XOR 0), single bits at both ends and 64 meaningful bits
+static const uint64_t amounts[] = {
+    1, 1, 0x8000000000000000ull, 0x8000000000000001ull, 1, UINT64_MAX, 0, UINT64_MAX,
+    0x7ffffffffffffffeull, 0x8000000000000001ull, 42, 42, 0x0123456789abcdefull,
+};
+
+#define NUM_DODS (sizeof(dods) / sizeof(dods[0]))
+#define NUM_AMOUNTS (sizeof(amounts) / sizeof(amounts[0]))
+#define NUM_POINTS (CYCLES * NUM_DODS)
+
+static uint64_t stamps[NUM_POINTS];
+static uint64_t values[NUM_POINTS];
+static int failures;
+
+static void check(const char* what, int i, uint64_t got, uint64_t want) {
+    if (got != want) {
+        printf("%s %d: got %llu, want %llu\n", what, i, (unsigned long long) got, (unsigned long long) want);
+        failures++;
+    }
+}
+
+int main() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t now_ms = now.tv_sec * 1000ull + now.tv_nsec / 1000000;
+
+    ts_init();
+    ts_enable(1);
+    // Every point is unique in its ms, about 3 hours of them ending well
+    // before the hour kept
+    uint64_t ms = now_ms - 5 * 3600000ull;
+    int64_t delta = 5000;
+    for (int i = 0; i < NUM_POINTS; i++) {
+        delta += dods[i % NUM_DODS];
+        ms += delta;
+        stamps[i] = ms;
+        values[i] = amounts[i % NUM_AMOUNTS];
+        ts_append(0, ms, values[i]);
+    }
+
+    for (int i = 0; i < NUM_POINTS; i++) {
+        uint64_t got[3];
+        ts_query(0, stamps[i] - 1, 1, got, 3);
+        check("before", i, got[0], 0);
+        check("point", i, got[1], values[i]);
+        check("after", i, got[2], 0);
+    }
+    size_t before = ts_memory();
+    if (before < 4 * TS_CHUNK_BYTES) {
+        printf("only %zu bytes of chunks, nothing sealed\n", before);
+        failures++;
+    }
+
+    // Everything above is older than the hour kept, only the open chunk stays
+    ts_append(0, now_ms, 7);
+    ts_trim();
+    uint64_t got;
+    ts_query(0, stamps[0], 1, &got, 1);
+    check("trimmed", 0, got, 0);
+    ts_query(0, now_ms, 1, &got, 1);
+    check("kept", 0, got, 7);
+    if (ts_memory() >= before) {
+        printf("trim freed nothing: %zu bytes\n", ts_memory());
+        failures++;
+    }
+
+    // A range past UINT64_MAX ms is malformed, the largest one left is not
+    message_t req = {0};
+    req.msgtype = HISTORY;
+    req.msgdata.stats.amount_high = now_ms / 1000;
+    req.msgdata.stats.amount_low = UINT64_MAX / 1000 + 1;
+    char* buf = NULL;
+    if (ts_history_reply(&req, &buf)) {
+        printf("range past UINT64_MAX ms answered\n");
+        failures++;
+        free(buf);
+    }
+    req.msgdata.stats.amount_low = UINT64_MAX / 1000;
+    req.msgdata.stats.charityID_low = 255;
+    size_t len = ts_history_reply(&req, &buf);
+    if (len != sizeof(message_t) + HISTORY_MAX_BUCKETS * sizeof(uint64_t)) {
+        printf("largest range: %zu bytes\n", len);
+        failures++;
+    } else {
+        check("largest range", 0, ((uint64_t*) (buf + sizeof(message_t)))[0], 7);
+        free(buf);
+    }
+    ts_destroy();
+
+    if (failures) {
+        printf("tseries: %d failures\n", failures);
+        exit(EXIT_FAILURE);
+    }
+    printf("tseries: %d points ok\n", (int) NUM_POINTS);
+    return 0;
+}